@@ -0,0 +1,349 @@
+/**
+ * Benchmark harness for the requantizer pipeline.
+ *
+ * Each input jpeg is run through the load, huffman decode, requantize, huffman recode and store
+ * stages, through the whole of a lossless recode with optimized huffman tables on its own, and
+ * through recode_jpeg_with_roi_map(), the library's one-call requantizer.
+ * Every stage is run a number of warmup times and then timed over several repetitions.
+ * Throughput is reported relative to the input's compressed size, pixel count and block count.
+ *
+ * Allocation counts are gathered by linking with --wrap=malloc,--wrap=calloc,--wrap=realloc
+ * (see the bench target in the makefile).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jpeg.h"
+#include "jpeg-requantizer.h"
+
+////////////////////////////////////////////////////////////////
+// allocation counting
+////////////////////////////////////////////////////////////////
+static uint64_t allocation_count = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    allocation_count++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    allocation_count++;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    allocation_count++;
+    return __real_realloc(ptr, size);
+}
+
+////////////////////////////////////////////////////////////////
+// timing
+////////////////////////////////////////////////////////////////
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+typedef enum bench_stage
+{
+    STAGE_LOAD = 0,
+    STAGE_DECODE,
+    STAGE_REQUANTIZE,
+    STAGE_RECODE,
+    STAGE_STORE,
+    STAGE_OPTIMIZE,
+    STAGE_ROI_RECODE,
+    NUM_STAGES
+} bench_stage_t;
+
+static const char* stage_names[NUM_STAGES] = {
+    "load", "decode", "requantize", "recode", "store", "optimize", "roi-recode"
+};
+
+typedef struct stage_result
+{
+    // one entry per repetition
+    double* seconds;
+    uint64_t allocations;
+
+    // bytes processed by one run of the stage; compressed input size for every stage but store,
+    // which is measured on the bytes it writes.
+    uint64_t bytes;
+} stage_result_t;
+
+typedef struct bench_options
+{
+    int warmup;
+    int repetitions;
+    int quality;
+    const char* output_path;
+} bench_options_t;
+
+static int compare_doubles(const void* a, const void* b)
+{
+    const double da = *(const double*)a;
+    const double db = *(const double*)b;
+    return (da > db) - (da < db);
+}
+
+static uint64_t file_size(const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+static void print_stage(const char* name, bench_stage_t stage, const stage_result_t* r,
+                        int repetitions, double megapixels, uint64_t blocks)
+{
+    qsort(r->seconds, repetitions, sizeof(double), compare_doubles);
+    const double min = r->seconds[0];
+    const double median = r->seconds[repetitions / 2];
+
+    printf("%-28s %-11s %9.3f %9.3f %9.2f %9.2f %10.3f %8llu\n",
+           name, stage_names[stage], min * 1e3, median * 1e3,
+           (r->bytes / 1e6) / median, megapixels / median, (blocks / 1e6) / median,
+           (unsigned long long)r->allocations);
+}
+
+/**
+ * Runs every stage on one file. Returns 0 on success.
+ */
+static int bench_file(const char* path, const bench_options_t* opts)
+{
+    stage_result_t results[NUM_STAGES] = { 0 };
+    for (int s = 0; s < NUM_STAGES; s++) {
+        results[s].seconds = calloc(opts->repetitions, sizeof(double));
+    }
+
+    const uint64_t input_bytes = file_size(path);
+    int retval = -1;
+
+    // load once up front so that later stages have something to work with.
+    jpeg_image_t* jpeg = jpeg_image_load_from_file(path);
+    if (jpeg == NULL) {
+        fprintf(stderr, "%s: error reading jpeg\n", path);
+        goto cleanup;
+    }
+    huffman_decoded_jpeg_scan_t* decoded = jpeg_image_huffman_decode(jpeg);
+    if (decoded == NULL) {
+        fprintf(stderr, "%s: error during huffman decoding\n", path);
+        jpeg_image_destroy(jpeg);
+        goto cleanup;
+    }
+    jpeg_requantizer_t* rq = jpeg_requantizer_create(jpeg);
+    if (rq == NULL) {
+        fprintf(stderr, "%s: unsupported quantization tables\n", path);
+        huffman_decoded_jpeg_scan_destroy(decoded);
+        jpeg_image_destroy(jpeg);
+        goto cleanup;
+    }
+    jpeg_roi_map_t* roi_map = jpeg_roi_map_create_uniform(jpeg, opts->quality);
+
+    uint64_t blocks = 0;
+    for (int c = 0; c < jpeg->frame_header.num_components; c++) {
+        blocks += decoded->components[c].num_blocks;
+    }
+    const double megapixels = (jpeg->frame_header.samples_per_line *
+                               (double)jpeg->frame_header.number_of_lines) / 1e6;
+
+    const int total_runs = opts->warmup + opts->repetitions;
+    for (int run = 0; run < total_runs; run++) {
+        const int rep = run - opts->warmup;
+        const bool timed = (rep >= 0);
+        double t0, t1;
+        uint64_t a0;
+
+        // load
+        a0 = allocation_count;
+        t0 = now_seconds();
+        jpeg_image_t* loaded = jpeg_image_load_from_file(path);
+        t1 = now_seconds();
+        if (timed) {
+            results[STAGE_LOAD].seconds[rep] = t1 - t0;
+            results[STAGE_LOAD].allocations = allocation_count - a0;
+        }
+        jpeg_image_destroy(loaded);
+
+        // huffman decode
+        a0 = allocation_count;
+        t0 = now_seconds();
+        huffman_decoded_jpeg_scan_t* scan = jpeg_image_huffman_decode(jpeg);
+        t1 = now_seconds();
+        if (timed) {
+            results[STAGE_DECODE].seconds[rep] = t1 - t0;
+            results[STAGE_DECODE].allocations = allocation_count - a0;
+        }
+        huffman_decoded_jpeg_scan_destroy(scan);
+
+        // requantize; runs on a fresh copy of the coefficients every time.
+        scan = huffman_decoded_jpeg_scan_copy(decoded);
+        a0 = allocation_count;
+        t0 = now_seconds();
+        jpeg_requantize_decoded_scan(rq, jpeg, roi_map, scan);
+        t1 = now_seconds();
+        if (timed) {
+            results[STAGE_REQUANTIZE].seconds[rep] = t1 - t0;
+            results[STAGE_REQUANTIZE].allocations = allocation_count - a0;
+        }
+
+        // huffman recode; falls back to optimized tables where the source's can't code the
+        // requantized coefficients, which is common for sources with optimized tables.
+        a0 = allocation_count;
+        t0 = now_seconds();
+        jpeg_image_t* recoded = jpeg_image_huffman_recode(scan, jpeg);
+        t1 = now_seconds();
+        if (timed) {
+            results[STAGE_RECODE].seconds[rep] = t1 - t0;
+            results[STAGE_RECODE].allocations = allocation_count - a0;
+        }
+        huffman_decoded_jpeg_scan_destroy(scan);
+        if (recoded == NULL) {
+            fprintf(stderr, "%s: error during huffman recoding\n", path);
+            goto cleanup_images;
+        }
+
+        // store
+        a0 = allocation_count;
+        t0 = now_seconds();
+        jpeg_image_store_to_file(opts->output_path, recoded);
+        t1 = now_seconds();
+        if (timed) {
+            results[STAGE_STORE].seconds[rep] = t1 - t0;
+            results[STAGE_STORE].allocations = allocation_count - a0;
+        }
+        jpeg_image_destroy(recoded);
+
+        // lossless optimize: decode, make tables from one histogram pass and recode, from a
+        // copy of the image so that its tables are the source's every time.
+        jpeg_image_t* source = jpeg_image_copy(jpeg);
+        a0 = allocation_count;
+        t0 = now_seconds();
+        scan = jpeg_image_huffman_decode(source);
+        jpeg_image_t* optimized = NULL;
+        if (scan != NULL) {
+            jpeg_image_strip_unused_tables(source);
+            jpeg_image_optimize_huffman_tables(source, scan);
+            optimized = jpeg_image_huffman_recode_with_tables(scan, source);
+        }
+        t1 = now_seconds();
+        if (timed) {
+            results[STAGE_OPTIMIZE].seconds[rep] = t1 - t0;
+            results[STAGE_OPTIMIZE].allocations = allocation_count - a0;
+        }
+        if (scan != NULL) {
+            huffman_decoded_jpeg_scan_destroy(scan);
+        }
+        jpeg_image_destroy(source);
+        if (optimized == NULL) {
+            fprintf(stderr, "%s: error during lossless optimization\n", path);
+            goto cleanup_images;
+        }
+        jpeg_image_destroy(optimized);
+
+        // one-call requantize, from a copy for the same reason.
+        source = jpeg_image_copy(jpeg);
+        a0 = allocation_count;
+        t0 = now_seconds();
+        const int roi_recode_failed = recode_jpeg_with_roi_map(source, roi_map);
+        t1 = now_seconds();
+        if (timed) {
+            results[STAGE_ROI_RECODE].seconds[rep] = t1 - t0;
+            results[STAGE_ROI_RECODE].allocations = allocation_count - a0;
+        }
+        jpeg_image_destroy(source);
+        if (roi_recode_failed) {
+            fprintf(stderr, "%s: error in recode_jpeg_with_roi_map\n", path);
+            goto cleanup_images;
+        }
+    }
+
+    for (int s = 0; s < NUM_STAGES; s++) {
+        results[s].bytes = input_bytes;
+    }
+    results[STAGE_STORE].bytes = file_size(opts->output_path);
+
+    const char* name = strrchr(path, '/') ? (strrchr(path, '/') + 1) : path;
+    for (int s = 0; s < NUM_STAGES; s++) {
+        print_stage(name, s, &results[s], opts->repetitions, megapixels, blocks);
+    }
+    retval = 0;
+
+cleanup_images:
+    jpeg_roi_map_destroy(roi_map);
+    jpeg_requantizer_destroy(rq);
+    huffman_decoded_jpeg_scan_destroy(decoded);
+    jpeg_image_destroy(jpeg);
+
+cleanup:
+    for (int s = 0; s < NUM_STAGES; s++) {
+        free(results[s].seconds);
+    }
+
+    return retval;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-w warmup] [-r repetitions] [-q quality] [-o scratch.jpg] file.jpg...\n",
+            argv0);
+}
+
+int main(int argc, char** argv)
+{
+    bench_options_t opts = {
+        .warmup = 1,
+        .repetitions = 5,
+        .quality = 50,
+        .output_path = "/tmp/jpeg-bench-out.jpg"
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:q:o:")) != -1) {
+        switch (opt) {
+            case 'w': opts.warmup = atoi(optarg); break;
+            case 'r': opts.repetitions = atoi(optarg); break;
+            case 'q': opts.quality = atoi(optarg); break;
+            case 'o': opts.output_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if ((optind == argc) || (opts.repetitions < 1) || (opts.warmup < 0) ||
+        (opts.quality < 1) || (opts.quality > 100)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    printf("%-28s %-11s %9s %9s %9s %9s %10s %8s\n",
+           "file", "stage", "min ms", "median ms", "MB/s", "MP/s", "Mblocks/s", "allocs");
+
+    int failures = 0;
+    for (int i = optind; i < argc; i++) {
+        if (bench_file(argv[i], &opts)) {
+            failures++;
+        }
+    }
+
+    return failures ? -1 : 0;
+}
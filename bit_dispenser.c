@@ -2,23 +2,12 @@
 
 #include <stdlib.h>
 
-struct bit_dispenser
-{
-    int datalen;
-    const uint8_t* data;
-
-    uint8_t currval;
-    int bitcount;
-    int curidx;
-};
-
 bit_dispenser_t* bit_dispenser_create(const uint8_t* data, int datalen)
 {
     bit_dispenser_t* result = calloc(1, sizeof(bit_dispenser_t));
 
     result->data = data;
     result->datalen = datalen;
-    result->currval = data[0];
 
     return result;
 }
@@ -29,63 +18,65 @@ void bit_dispenser_destroy(bit_dispenser_t* bd)
 }
 
 /**
- *
+ * Consumes up to n <= 32 bits, stopping at the end of the data, and returns them right-aligned.
+ * The number of bits actually consumed is written to consumed.
  */
-static uint8_t bit_dispenser_dispense_u1(bit_dispenser_t* bd)
+static uint32_t bit_dispenser_dispense(int n, bit_dispenser_t* bd, int* consumed)
 {
-    if (bit_dispenser_empty(bd) == true) {
-        return 0xff;
+    const int64_t bits_left = bit_dispenser_bits_left(bd);
+    if (bits_left < n) {
+        n = (bits_left > 0) ? bits_left : 0;
     }
-
-    uint8_t result = (bd->currval & 0x80) >> 7;
-    bd->currval <<= 1;
-    bd->bitcount++;
-    if (bd->bitcount == 8) {
-        bd->bitcount = 0;
-        bd->curidx++;
-        bd->currval = bd->data[bd->curidx];
+    *consumed = n;
+    if (n == 0) {
+        return 0;
     }
 
+    bit_dispenser_refill(bd);
+    const uint32_t result = bit_dispenser_peek(bd, n);
+    bit_dispenser_consume(bd, n);
     return result;
 }
 
 void bit_dispenser_dispense_u8(uint8_t*  target, int n, bit_dispenser_t* bd)
 {
-    for (int i = 0; i < n; i++) {
-        *target <<= 1;
-        uint8_t result = bit_dispenser_dispense_u1(bd);
-        if (result == 0xff) {
-            return;
-        }
-        *target |= result;
-    }
+    int consumed;
+    const uint32_t bits = bit_dispenser_dispense(n, bd, &consumed);
+    *target = (consumed < 8) ? ((*target << consumed) | bits) : bits;
 }
 
 void bit_dispenser_dispense_u16(uint16_t* target, int n, bit_dispenser_t* bd)
 {
-    for (int i = 0; i < n; i++) {
-        *target <<= 1;
-        uint8_t result = bit_dispenser_dispense_u1(bd);
-        if (result == 0xff) {
-            return;
-        }
-        *target |= result;
-    }
+    int consumed;
+    const uint32_t bits = bit_dispenser_dispense(n, bd, &consumed);
+    *target = (consumed < 16) ? ((*target << consumed) | bits) : bits;
 }
 
 void bit_dispenser_dispense_u32(uint32_t* target, int n, bit_dispenser_t* bd)
 {
-    for (int i = 0; i < n; i++) {
-        *target <<= 1;
-        uint8_t result = bit_dispenser_dispense_u1(bd);
-        if (result == 0xff) {
-            return;
-        }
-        *target |= result;
+    int consumed;
+    const uint32_t bits = bit_dispenser_dispense(n, bd, &consumed);
+    *target = (consumed < 32) ? ((*target << consumed) | bits) : bits;
+}
+
+void bit_dispenser_skip(int n, bit_dispenser_t* bd)
+{
+    while (n > 0) {
+        const int step = (n > 32) ? 32 : n;
+        bit_dispenser_refill(bd);
+        bit_dispenser_consume(bd, step);
+        n -= step;
+    }
+
+    // skipping past the end leaves the dispenser empty.
+    if (bit_dispenser_bits_left(bd) < 0) {
+        bd->curidx = bd->datalen;
+        bd->buffer = 0;
+        bd->bits_buffered = 0;
     }
 }
 
 bool bit_dispenser_empty(const bit_dispenser_t* bd)
 {
-    return (bd->curidx == bd->datalen);
+    return (bit_dispenser_bits_left(bd) <= 0);
 }
@@ -3,12 +3,84 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
+// exposed so that the decoder's per-symbol peek and consume can be inlined.
 typedef struct bit_dispenser bit_dispenser_t;
+struct bit_dispenser
+{
+    int datalen;
+    const uint8_t* data;
+
+    // the next unconsumed bits of data, msb first. Only the first bits_buffered of them are
+    // counted; the rest are either zero or the bits that follow them in data.
+    uint64_t buffer;
+    int bits_buffered;
+
+    // next byte of data to go into buffer. Past the end of data, zeros are buffered instead and
+    // curidx keeps counting up.
+    int curidx;
+};
 
 bit_dispenser_t* bit_dispenser_create(const uint8_t* data, int datalen);
 void bit_dispenser_destroy(bit_dispenser_t* bd);
 
+/**
+ * Tops up the buffer to at least 57 bits, a byte at a time near the end of data and a whole word
+ * at a time everywhere else.
+ */
+static inline void bit_dispenser_refill(bit_dispenser_t* bd)
+{
+    if (bd->bits_buffered > 56) {
+        return;
+    }
+
+    if ((bd->curidx + 8) <= bd->datalen) {
+        // bytes that don't fit whole go in as well, but aren't counted until the next refill
+        // puts the very same bits in the very same place.
+        uint64_t word;
+        memcpy(&word, &bd->data[bd->curidx], 8);
+        bd->buffer |= __builtin_bswap64(word) >> bd->bits_buffered;
+        const int bytes = (64 - bd->bits_buffered) >> 3;
+        bd->curidx += bytes;
+        bd->bits_buffered += bytes * 8;
+    } else {
+        while (bd->bits_buffered <= 56) {
+            const uint64_t byte = (bd->curidx < bd->datalen) ? bd->data[bd->curidx] : 0;
+            bd->buffer |= byte << (56 - bd->bits_buffered);
+            bd->curidx++;
+            bd->bits_buffered += 8;
+        }
+    }
+}
+
+/**
+ * Returns the next n bits, 1 <= n <= 32, without consuming them. The buffer has to hold at least
+ * n bits, which a refill guarantees.
+ */
+static inline uint32_t bit_dispenser_peek(const bit_dispenser_t* bd, int n)
+{
+    return (uint32_t)(bd->buffer >> (64 - n));
+}
+
+/**
+ * Consumes n <= bits_buffered bits.
+ */
+static inline void bit_dispenser_consume(bit_dispenser_t* bd, int n)
+{
+    bd->buffer <<= n;
+    bd->bits_buffered -= n;
+}
+
+/**
+ * Number of bits of data that haven't been consumed yet; negative once more bits were consumed
+ * than data holds.
+ */
+static inline int64_t bit_dispenser_bits_left(const bit_dispenser_t* bd)
+{
+    return ((int64_t)(bd->datalen - bd->curidx) * 8) + bd->bits_buffered;
+}
+
 /**
  * Consumes bits from the bit dispenser and right-shifts them into the given target.
  *
@@ -19,6 +91,11 @@ void bit_dispenser_dispense_u8(uint8_t*  target, int n, bit_dispenser_t* dispens
 void bit_dispenser_dispense_u16(uint16_t* target, int n, bit_dispenser_t* dispenser);
 void bit_dispenser_dispense_u32(uint32_t* target, int n, bit_dispenser_t* dispenser);
 
+/**
+ * Consumes n bits without looking at them.
+ */
+void bit_dispenser_skip(int n, bit_dispenser_t* dispenser);
+
 bool bit_dispenser_empty(const bit_dispenser_t* dispenser);
 
 #endif
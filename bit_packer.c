@@ -1,6 +1,7 @@
 #include "bit_packer.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 bit_packer_t* bit_packer_create()
 {
@@ -8,7 +9,6 @@ bit_packer_t* bit_packer_create()
 
     bp->capacity = 2048;
     bp->data = calloc(1, bp->capacity);
-    bp->bitcount = 7;
 
     return bp;
 }
@@ -19,79 +19,35 @@ void bit_packer_destroy(bit_packer_t* bp)
     free(bp);
 }
 
-void bit_packer_fill_endbits(bit_packer_t* bp)
+void bit_packer_reset(bit_packer_t* bp)
 {
-    while (bp->bitcount != 7) {
-        bit_packer_pack_u8(0x01, 1, bp);
-    }
+    bp->accumulator = 0;
+    bp->accumulated_bits = 0;
+    bp->curidx = 0;
 }
 
-static void bit_packer_pack_u1(uint8_t src, bit_packer_t* bp)
+void bit_packer_flush(bit_packer_t* bp)
 {
-    // src should be either 0 or 1.
-    bp->currval |= (src << bp->bitcount);
-    bp->bitcount -= 1;
-    if (bp->bitcount == -1) {
-        bp->data[bp->curidx] = bp->currval;
-
-        bp->currval = 0;
-        bp->bitcount = 7;
-
-        bp->curidx += 1;
-        if (bp->curidx == bp->capacity) {
-            bp->capacity *= 2;
-            bp->data = realloc(bp->data, bp->capacity);
-        }
+    if (bp->accumulated_bits < 8) {
+        return;
     }
-}
 
-void bit_packer_pack_u8(uint8_t src, int n, bit_packer_t* packer)
-{
-    // start by left-aligning the data.
-    src <<= (8 - n);
-
-    // pack
-    for (int i = 0; i < n; i++) {
-        if (src & 0x80) {
-            bit_packer_pack_u1(0x01, packer);
-        } else {
-            bit_packer_pack_u1(0x00, packer);
-        }
-
-        src <<= 1;
+    // all 8 bytes get stored, but only the whole ones are counted; the rest is overwritten by
+    // the next flush.
+    if ((bp->curidx + 8) > bp->capacity) {
+        bp->capacity *= 2;
+        bp->data = realloc(bp->data, bp->capacity);
     }
-}
+    const uint64_t word = __builtin_bswap64(bp->accumulator << (64 - bp->accumulated_bits));
+    memcpy(&bp->data[bp->curidx], &word, 8);
 
-void bit_packer_pack_u16(uint16_t src, int n, bit_packer_t* packer)
-{
-    // start by left-aligning the data.
-    src <<= (16 - n);
-
-    // pack
-    for (int i = 0; i < n; i++) {
-        if (src & 0x8000) {
-            bit_packer_pack_u1(0x01, packer);
-        } else {
-            bit_packer_pack_u1(0x00, packer);
-        }
-
-        src <<= 1;
-    }
+    bp->curidx += bp->accumulated_bits >> 3;
+    bp->accumulated_bits &= 7;
 }
 
-void bit_packer_pack_u32(uint32_t src, int n, bit_packer_t* packer)
+void bit_packer_fill_endbits(bit_packer_t* bp)
 {
-    // start by left-aligning the data.
-    src <<= (32 - n);
-
-    // pack
-    for (int i = 0; i < n; i++) {
-        if (src & 0x80000000) {
-            bit_packer_pack_u1(0x01, packer);
-        } else {
-            bit_packer_pack_u1(0x00, packer);
-        }
-
-        src <<= 1;
-    }
+    const int padding = (8 - (bp->accumulated_bits & 7)) & 7;
+    bit_packer_pack_u32(0xff, padding, bp);
+    bit_packer_flush(bp);
 }
@@ -4,21 +4,34 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-// exposed to make it easier for users to get at the data and length.
+// exposed to make it easier for users to get at the data and length, and so that packing can be
+// inlined into the encoder.
 typedef struct bit_packer bit_packer_t;
 struct bit_packer
 {
     int capacity;
     uint8_t* data;
 
-    uint8_t currval;
-    int bitcount;
+    // bits that haven't been written out to data yet, right-aligned. Anything above the lowest
+    // accumulated_bits of them is left over from earlier packs.
+    uint64_t accumulator;
+    int accumulated_bits;
     int curidx;
 };
 
 bit_packer_t* bit_packer_create();
 void bit_packer_destroy(bit_packer_t* bp);
 
+/**
+ * Writes the whole bytes of the accumulator out to data, leaving fewer than 8 bits in it.
+ */
+void bit_packer_flush(bit_packer_t* bp);
+
+/**
+ * Discards everything that has been packed so far, keeping the allocated buffer.
+ */
+void bit_packer_reset(bit_packer_t* bp);
+
 /**
  * If the currently pending byte has unfilled bits, fills it with ones and moves up to the next
  * byte.
@@ -53,8 +66,26 @@ void bit_packer_fill_endbits(bit_packer_t* bp);
  * about bit-alignment before re-packing, so we don't want to go back to front, we still want to
  * go front-to-back.
  */
-void bit_packer_pack_u8(uint8_t   src, int n, bit_packer_t* packer);
-void bit_packer_pack_u16(uint16_t src, int n, bit_packer_t* packer);
-void bit_packer_pack_u32(uint32_t src, int n, bit_packer_t* packer);
+static inline void bit_packer_pack_u32(uint32_t src, int n, bit_packer_t* packer)
+{
+    if (n == 0) {
+        return;
+    }
+    if ((packer->accumulated_bits + n) > 64) {
+        bit_packer_flush(packer);
+    }
+    packer->accumulator = (packer->accumulator << n) | (src & (0xffffffffu >> (32 - n)));
+    packer->accumulated_bits += n;
+}
+
+static inline void bit_packer_pack_u8(uint8_t src, int n, bit_packer_t* packer)
+{
+    bit_packer_pack_u32(src, n, packer);
+}
+
+static inline void bit_packer_pack_u16(uint16_t src, int n, bit_packer_t* packer)
+{
+    bit_packer_pack_u32(src, n, packer);
+}
 
 #endif
@@ -1,8 +1,1326 @@
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "jpeg-requantizer.h"
+#include "jpeg_stats.h"
 
-void recode_jpeg(jpeg_image_t *jpg, unsigned char *rois)
+/**
+ * Example quantization tables from Annex K of T.81, stored in zigzag order.
+ */
+static const uint8_t annex_k_luminance_table[64] = {
+     16,  11,  12,  14,  12,  10,  16,  14,
+     13,  14,  18,  17,  16,  19,  24,  40,
+     26,  24,  22,  22,  24,  49,  35,  37,
+     29,  40,  58,  51,  61,  60,  57,  51,
+     56,  55,  64,  72,  92,  78,  64,  68,
+     87,  69,  55,  56,  80, 109,  81,  87,
+     95,  98, 103, 104, 103,  62,  77, 113,
+    121, 112, 100, 120,  92, 101, 103,  99
+};
+
+static const uint8_t annex_k_chrominance_table[64] = {
+     17,  18,  18,  24,  21,  24,  47,  26,
+     26,  47,  99,  66,  56,  66,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99,
+     99,  99,  99,  99,  99,  99,  99,  99
+};
+
+/**
+ * Largest quantization step allowed for samples of the given precision: 8-bit samples only
+ * allow 8-bit tables.
+ */
+static int max_quantization_step(int sample_precision)
+{
+    return (sample_precision > 8) ? 32767 : 255;
+}
+
+void jpeg_quantization_table_for_quality(int component, int quality, int sample_precision,
+                                         jpeg_quantization_table_t* target)
+{
+    const uint8_t* base = (component == 0) ? annex_k_luminance_table : annex_k_chrominance_table;
+
+    if (quality < 1) {
+        quality = 1;
+    } else if (quality > 100) {
+        quality = 100;
+    }
+
+    // same scaling curve as the IJG's libjpeg
+    const int scale = (quality < 50) ? (5000 / quality) : (200 - (2 * quality));
+
+    const int max_q = max_quantization_step(sample_precision);
+
+    int q[64];
+    bool table_16bit = false;
+    for (int i = 0; i < 64; i++) {
+        q[i] = ((base[i] * scale) + 50) / 100;
+        if (q[i] < 1) {
+            q[i] = 1;
+        } else if (q[i] > max_q) {
+            q[i] = max_q;
+        }
+        table_16bit |= (q[i] > 255);
+    }
+
+    memset(target, 0, sizeof(*target));
+    target->table_valid = true;
+    target->pq_tq = table_16bit ? 0x10 : 0x00;
+    for (int i = 0; i < 64; i++) {
+        if (table_16bit) {
+            target->Q[i]._16 = q[i];
+        } else {
+            target->Q[i]._8 = q[i];
+        }
+    }
+}
+
+int jpeg_quantization_table_estimate_quality(int component, int sample_precision,
+                                             const jpeg_quantization_table_t* table)
+{
+    const uint8_t* base = (component == 0) ? annex_k_luminance_table : annex_k_chrominance_table;
+    const bool table_16bit = ((table->pq_tq >> 4) & 0x0f) != 0;
+    const int max_q = max_quantization_step(sample_precision);
+
+    // invert the scaling curve for the table's overall scale to get a first guess, leaving out
+    // steps that were clamped; a table that's nothing but those is as coarse as they come...
+    uint32_t table_sum = 0;
+    uint32_t base_sum = 0;
+    for (int i = 0; i < 64; i++) {
+        const int q = table_16bit ? table->Q[i]._16 : table->Q[i]._8;
+        if (q < max_q) {
+            table_sum += q;
+            base_sum += base[i];
+        }
+    }
+    int guess = 1;
+    if (base_sum != 0) {
+        const int scale = ((table_sum * 100) + (base_sum / 2)) / base_sum;
+        guess = (scale <= 100) ? ((200 - scale + 1) / 2) : ((5000 + (scale / 2)) / scale);
+    }
+
+    // ...then settle on whichever quality near it gives the closest table, which copes with
+    // clamped steps and with tables that weren't made from Annex K at all.
+    int best_quality = 1;
+    uint32_t best_error = UINT32_MAX;
+    for (int quality = guess - 4; quality <= (guess + 4); quality++) {
+        if ((quality < 1) || (quality > 100)) {
+            continue;
+        }
+
+        jpeg_quantization_table_t candidate;
+        jpeg_quantization_table_for_quality(component, quality, sample_precision, &candidate);
+        const bool candidate_16bit = ((candidate.pq_tq >> 4) & 0x0f) != 0;
+
+        uint32_t error = 0;
+        for (int i = 0; i < 64; i++) {
+            const int q = table_16bit ? table->Q[i]._16 : table->Q[i]._8;
+            error += abs(q - (candidate_16bit ? candidate.Q[i]._16 : candidate.Q[i]._8));
+        }
+
+        // ties go to the higher quality, which is what all-ones tables should come out as.
+        if (error <= best_error) {
+            best_error = error;
+            best_quality = quality;
+        }
+    }
+
+    return best_quality;
+}
+
+/**
+ * Builds a requantizer for num_components components of sample_precision bits, component c using
+ * quantization_tables[csps[c].quantization_table_selector].
+ */
+static jpeg_requantizer_t* rq_create(int num_components, int sample_precision,
+                                     const frame_component_specification_parameters_t* csps,
+                                     const jpeg_quantization_table_t* quantization_tables)
+{
+    if ((num_components < 1) || (num_components > 3)) {
+        return NULL;
+    }
+
+    jpeg_requantizer_t* rq = calloc(1, sizeof(jpeg_requantizer_t));
+    rq->num_components = num_components;
+
+    for (int c = 0; c < rq->num_components; c++) {
+        const int qt_idx = csps[c].quantization_table_selector & 0x03;
+        const jpeg_quantization_table_t* source = &quantization_tables[qt_idx];
+        if (!source->table_valid) {
+            free(rq);
+            return NULL;
+        }
+        const bool source_16bit = ((source->pq_tq >> 4) & 0x0f) != 0;
+
+        for (int quality = 1; quality <= 100; quality++) {
+            requantization_table_t* t = &rq->tables[c][quality - 1];
+            jpeg_quantization_table_t target;
+            jpeg_quantization_table_for_quality(c, quality, sample_precision, &target);
+            const bool target_16bit = ((target.pq_tq >> 4) & 0x0f) != 0;
+
+            t->identity = true;
+            for (int i = 0; i < 64; i++) {
+                t->source_q[i] = source_16bit ? source->Q[i]._16 : source->Q[i]._8;
+                if (t->source_q[i] == 0) {
+                    t->source_q[i] = 1;
+                }
+
+                t->target_q[i] = target_16bit ? target.Q[i]._16 : target.Q[i]._8;
+                if (t->target_q[i] <= t->source_q[i]) {
+                    t->target_q[i] = t->source_q[i];
+                } else {
+                    t->identity = false;
+                }
+            }
+        }
+    }
+
+    return rq;
+}
+
+jpeg_requantizer_t* jpeg_requantizer_create(const jpeg_image_t* jpeg)
+{
+    return rq_create(jpeg->frame_header.num_components, jpeg->frame_header.sample_precision,
+                     jpeg->frame_header.csps, jpeg->jpeg_quantization_tables);
+}
+
+jpeg_requantizer_t* jpeg_requantizer_create_from_probe(const jpeg_probe_t* probe)
+{
+    return rq_create(probe->num_components, probe->sample_precision, probe->csps,
+                     probe->quantization_tables);
+}
+
+bool jpeg_requantizer_quality_is_identity(const jpeg_requantizer_t* rq, int quality)
+{
+    for (int c = 0; c < rq->num_components; c++) {
+        if (!rq->tables[c][quality - 1].identity) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool jpeg_requantizer_component_is_identity(const jpeg_requantizer_t* rq, int c,
+                                            const jpeg_roi_map_t* roi_map)
+{
+    // a block's quality is always one of the map's values, so checking each distinct value once
+    // is enough.
+    bool seen[101] = { false };
+    const uint32_t n = roi_map->blocks_wide * roi_map->blocks_high;
+    for (uint32_t i = 0; i < n; i++) {
+        const int quality = (roi_map->quality[i] > 100) ? 100 : roi_map->quality[i];
+        if (!seen[quality]) {
+            seen[quality] = true;
+            if ((quality > 0) && !rq->tables[c][quality - 1].identity) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool jpeg_requantizer_is_identity(const jpeg_requantizer_t* rq, const jpeg_roi_map_t* roi_map)
+{
+    for (int c = 0; c < rq->num_components; c++) {
+        if (!jpeg_requantizer_component_is_identity(rq, c, roi_map)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void jpeg_requantizer_destroy(jpeg_requantizer_t* rq)
+{
+    free(rq);
+}
+
+static inline int16_t requantize_coefficient(int16_t coefficient, uint16_t qs, uint16_t qt)
+{
+    const int32_t magnitude = (coefficient < 0) ? -coefficient : coefficient;
+
+    // dequantize, round to the target step, then express the result in source units again.
+    const int32_t quantized = ((magnitude * qs) + (qt / 2)) / qt;
+    const int32_t result = ((quantized * qt) + (qs / 2)) / qs;
+
+    return (coefficient < 0) ? -result : result;
+}
+
+void jpeg_requantize_block(const requantization_table_t* t, jpeg_block_t* block)
+{
+    if (block->dc_value != 0) {
+        block->dc_value = requantize_coefficient(block->dc_value, t->source_q[0], t->target_q[0]);
+    }
+    for (int i = 0; i < 63; i++) {
+        if (block->ac_values[i] != 0) {
+            block->ac_values[i] = requantize_coefficient(block->ac_values[i],
+                                                         t->source_q[i + 1], t->target_q[i + 1]);
+        }
+    }
+}
+
+static int block_count_nonzeros(const jpeg_block_t* block)
+{
+    int count = (block->dc_value != 0);
+    for (int i = 0; i < 63; i++) {
+        count += (block->ac_values[i] != 0);
+    }
+    return count;
+}
+
+static uint64_t component_count_nonzeros(const huffman_decoded_jpeg_component_t* component)
+{
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < component->num_blocks; i++) {
+        count += block_count_nonzeros(&component->blocks[i]);
+    }
+    return count;
+}
+
+/**
+ * Returns the highest quality in the ROI map rectangle covered by one component block.
+ */
+static int roi_map_block_quality(const jpeg_roi_map_t* roi_map, int x0, int y0, int x1, int y1)
+{
+    if (x1 > roi_map->blocks_wide) {
+        x1 = roi_map->blocks_wide;
+    }
+    if (y1 > roi_map->blocks_high) {
+        y1 = roi_map->blocks_high;
+    }
+
+    int quality = 0;
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* row = &roi_map->quality[y * roi_map->blocks_wide];
+        for (int x = x0; x < x1; x++) {
+            if (row[x] > quality) {
+                quality = row[x];
+            }
+        }
+    }
+
+    // blocks that fall entirely in the padding region take the quality of the nearest edge.
+    if (quality == 0) {
+        const int x = (x0 < roi_map->blocks_wide) ? x0 : (roi_map->blocks_wide - 1);
+        const int y = (y0 < roi_map->blocks_high) ? y0 : (roi_map->blocks_high - 1);
+        quality = roi_map->quality[(y * roi_map->blocks_wide) + x];
+    }
+
+    return (quality > 100) ? 100 : quality;
+}
+
+/**
+ * Finds the rectangle of ROI map blocks covered by block (bx, by) of a component with the given
+ * sampling factors.
+ */
+static void component_block_roi_rect(const huffman_decoded_jpeg_scan_t* decoded_scan, int H, int V,
+                                     int bx, int by, int* x0, int* y0, int* x1, int* y1)
+{
+    *x0 = (bx * decoded_scan->H_max) / H;
+    *y0 = (by * decoded_scan->V_max) / V;
+    *x1 = (((bx + 1) * decoded_scan->H_max) + (H - 1)) / H;
+    *y1 = (((by + 1) * decoded_scan->V_max) + (V - 1)) / V;
+}
+
+const requantization_table_t* jpeg_requantizer_table_at(const jpeg_requantizer_t* rq,
+                                                        const jpeg_image_t* jpeg,
+                                                        const jpeg_roi_map_t* roi_map,
+                                                        const huffman_decoded_jpeg_scan_t* scan,
+                                                        int c, int bx, int by)
+{
+    int x0, y0, x1, y1;
+    component_block_roi_rect(scan, jpeg->frame_header.csps[c].horizontal_sampling_factor,
+                             jpeg->frame_header.csps[c].vertical_sampling_factor, bx, by,
+                             &x0, &y0, &x1, &y1);
+    return &rq->tables[c][roi_map_block_quality(roi_map, x0, y0, x1, y1) - 1];
+}
+
+/**
+ * Requantizes every block of source once per level, with level l following roi_maps[l] and
+ * writing its blocks to dst[l]. A destination may be source itself, as long as it's the only
+ * level. Each source block is read once and fanned out to every level while it's still in cache.
+ */
+static void requantize_scan_levels(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                                   const jpeg_roi_map_t* const* roi_maps, int num_levels,
+                                   const huffman_decoded_jpeg_scan_t* source,
+                                   huffman_decoded_jpeg_scan_t* const* dst)
+{
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    const bool count_nonzeros = JPEG_STATS_ENABLED();
+    uint64_t nonzero_before = 0;
+    uint64_t nonzero_after = 0;
+
+    for (int c = 0; c < rq->num_components; c++) {
+        const int H = jpeg->frame_header.csps[c].horizontal_sampling_factor;
+        const int V = jpeg->frame_header.csps[c].vertical_sampling_factor;
+        const huffman_decoded_jpeg_component_t* component = &source->components[c];
+
+        // a component that no level changes is only copied, skipping the per block ROI lookups.
+        bool unchanged = true;
+        for (int l = 0; (l < num_levels) && unchanged; l++) {
+            unchanged = jpeg_requantizer_component_is_identity(rq, c, roi_maps[l]);
+        }
+        if (unchanged) {
+            const uint64_t source_nonzeros = count_nonzeros ?
+                                             component_count_nonzeros(component) : 0;
+            for (int l = 0; l < num_levels; l++) {
+                jpeg_block_t* blocks = dst[l]->components[c].blocks;
+                if (blocks != component->blocks) {
+                    memcpy(blocks, component->blocks, component->num_blocks * sizeof(jpeg_block_t));
+                }
+                nonzero_before += source_nonzeros;
+                nonzero_after += source_nonzeros;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < component->num_blocks; i++) {
+            int x0, y0, x1, y1;
+            component_block_roi_rect(source, H, V, i % component->blocks_per_line,
+                                     i / component->blocks_per_line, &x0, &y0, &x1, &y1);
+            const jpeg_block_t* source_block = &component->blocks[i];
+            const int source_nonzeros = count_nonzeros ? block_count_nonzeros(source_block) : 0;
+
+            for (int l = 0; l < num_levels; l++) {
+                const int quality = roi_map_block_quality(roi_maps[l], x0, y0, x1, y1);
+                const requantization_table_t* t = &rq->tables[c][quality - 1];
+                jpeg_block_t* block = &dst[l]->components[c].blocks[i];
+
+                if (block != source_block) {
+                    *block = *source_block;
+                }
+                if (!t->identity) {
+                    jpeg_requantize_block(t, block);
+                }
+                if (count_nonzeros) {
+                    nonzero_before += source_nonzeros;
+                    nonzero_after += block_count_nonzeros(block);
+                }
+            }
+        }
+    }
+
+    JPEG_STATS_ADD(nonzero_coefficients_before, nonzero_before);
+    JPEG_STATS_ADD(nonzero_coefficients_after, nonzero_after);
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_REQUANTIZE, t0);
+}
+
+void jpeg_requantize_decoded_scan(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                                  const jpeg_roi_map_t* roi_map,
+                                  huffman_decoded_jpeg_scan_t* decoded_scan)
+{
+    requantize_scan_levels(rq, jpeg, &roi_map, 1, decoded_scan, &decoded_scan);
+}
+
+jpeg_image_t* jpeg_requantize_image_spliced(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                                            const jpeg_roi_map_t* roi_map,
+                                            uint32_t* intervals_recoded)
+{
+    jpeg_image_t* result = NULL;
+    bool* intervals = NULL;
+
+    huffman_decoded_jpeg_scan_t* decoded_scan = huffman_decoded_jpeg_scan_create(jpeg);
+    if (decoded_scan == NULL) {
+        return NULL;
+    }
+
+    const jpeg_mcu_map_t* map = decoded_scan->mcu_map;
+    const uint32_t num_intervals = huffman_decoded_jpeg_scan_num_intervals(decoded_scan, jpeg);
+    const int interval_mcus = (jpeg->restart_interval != 0) ? jpeg->restart_interval :
+                                                              map->num_mcus;
+    intervals = calloc(num_intervals, sizeof(bool));
+
+    // an interval has to be recoded if any of its blocks gets a non-identity table. Components
+    // that are identity everywhere are skipped without looking at their blocks.
+    bool component_changes[3] = { false, false, false };
+    for (int c = 0; c < rq->num_components; c++) {
+        component_changes[c] = !jpeg_requantizer_component_is_identity(rq, c, roi_map);
+    }
+
+    uint32_t num_changed = 0;
+    for (int i = 0; i < map->num_mcus; i++) {
+        const int interval = i / interval_mcus;
+        if (intervals[interval]) {
+            continue;
+        }
+
+        const uint32_t* mcu_blocks = &map->block_index[i * map->blocks_per_mcu];
+        for (int k = 0; k < map->blocks_per_mcu; k++) {
+            const int c = map->block_component[k];
+            if (!component_changes[c]) {
+                continue;
+            }
+
+            const int blocks_per_line = decoded_scan->components[c].blocks_per_line;
+            const requantization_table_t* t =
+                jpeg_requantizer_table_at(rq, jpeg, roi_map, decoded_scan, c,
+                                          mcu_blocks[k] % blocks_per_line,
+                                          mcu_blocks[k] / blocks_per_line);
+            if (!t->identity) {
+                intervals[interval] = true;
+                num_changed++;
+                break;
+            }
+        }
+    }
+
+    if (jpeg_image_huffman_decode_intervals(jpeg, intervals, decoded_scan)) {
+        goto cleanup;
+    }
+
+    // blocks of the untouched intervals were never decoded, so only the changed intervals'
+    // blocks are requantized.
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    for (int i = 0; i < map->num_mcus; i++) {
+        if (!intervals[i / interval_mcus]) {
+            i = ((i / interval_mcus) + 1) * interval_mcus - 1;
+            continue;
+        }
+
+        const uint32_t* mcu_blocks = &map->block_index[i * map->blocks_per_mcu];
+        for (int k = 0; k < map->blocks_per_mcu; k++) {
+            const int c = map->block_component[k];
+            if (!component_changes[c]) {
+                continue;
+            }
+
+            huffman_decoded_jpeg_component_t* component = &decoded_scan->components[c];
+            const requantization_table_t* t =
+                jpeg_requantizer_table_at(rq, jpeg, roi_map, decoded_scan, c,
+                                          mcu_blocks[k] % component->blocks_per_line,
+                                          mcu_blocks[k] / component->blocks_per_line);
+            if (!t->identity) {
+                jpeg_requantize_block(t, &component->blocks[mcu_blocks[k]]);
+            }
+        }
+    }
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_REQUANTIZE, t0);
+
+    // the copied intervals are only valid with the tables they were coded with. If those can't
+    // code the requantized intervals, every interval is decoded and the whole scan is recoded with
+    // tables made for it. Blocks of intervals that weren't decoded are zero and count towards
+    // the check as well, which can only cause a needless full recode.
+    if (jpeg_image_huffman_tables_can_code(jpeg, decoded_scan)) {
+        result = jpeg_image_huffman_recode_intervals(decoded_scan, jpeg, intervals);
+    } else {
+        for (uint32_t i = 0; i < num_intervals; i++) {
+            intervals[i] = !intervals[i];
+        }
+        if (jpeg_image_huffman_decode_intervals(jpeg, intervals, decoded_scan)) {
+            goto cleanup;
+        }
+        result = jpeg_image_huffman_recode(decoded_scan, jpeg);
+        num_changed = num_intervals;
+    }
+    if ((result != NULL) && (intervals_recoded != NULL)) {
+        *intervals_recoded = num_changed;
+    }
+
+cleanup:
+    free(intervals);
+    huffman_decoded_jpeg_scan_destroy(decoded_scan);
+    return result;
+}
+
+// bits charged for a symbol that the huffman table has no code for, which keeps the quantizer
+// from choosing it when anything else will do.
+#define RDO_MISSING_CODE_BITS 32
+
+#define RDO_MAX_THREADS 64
+
+/**
+ * Costs of one component's AC symbols, already weighted by lambda. rate[(r << 4) | s] is the cost
+ * of a run of r zeros followed by a coefficient of size s, magnitude bits included, so rate[0x00]
+ * is EOB and rate[0xf0] is ZRL.
+ */
+typedef struct rdo_component
+{
+    bool unchanged;
+    float rate[256];
+} rdo_component_t;
+
+typedef struct rdo_context
+{
+    const jpeg_requantizer_t* rq;
+    const jpeg_image_t* jpeg;
+    const jpeg_roi_map_t* roi_map;
+    jpeg_rdo_mode_t mode;
+    bool count_nonzeros;
+    huffman_decoded_jpeg_scan_t* decoded_scan;
+    rdo_component_t components[3];
+} rdo_context_t;
+
+/**
+ * What each coefficient of a block can become, in zigzag order. stored[0] is the plainly rounded
+ * value and stored[1] the one a target step below it, both in source units, with 0 where there's
+ * no such level. distortion[2] is the distortion of zeroing the coefficient.
+ */
+typedef struct rdo_candidates
+{
+    int16_t magnitude[64];
+    int16_t stored[2][64];
+    float weights[64];
+    float distortion[3][64];
+} rdo_candidates_t;
+
+static inline int rdo_size(int32_t value)
+{
+    return (value == 0) ? 0 : (32 - __builtin_clz(value));
+}
+
+static inline float rdo_run_rate(const rdo_component_t* rc, int run, int size)
+{
+    return ((run >> 4) * rc->rate[0xf0]) + rc->rate[((run & 0x0f) << 4) | size];
+}
+
+/**
+ * Squared error of coding magnitude as stored, in target steps: weights holds the ratio of the
+ * source step to the target step of every coefficient.
+ */
+static void rdo_distortions(const int16_t* stored, const int16_t* magnitude, const float* weights,
+                            float* out)
+{
+#ifdef __SSE2__
+    for (int i = 0; i < 64; i += 8) {
+        const __m128i diff = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)&stored[i]),
+                                           _mm_loadu_si128((const __m128i*)&magnitude[i]));
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(diff, diff), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(diff, diff), 16);
+        const __m128 error_lo = _mm_mul_ps(_mm_cvtepi32_ps(lo), _mm_loadu_ps(&weights[i]));
+        const __m128 error_hi = _mm_mul_ps(_mm_cvtepi32_ps(hi), _mm_loadu_ps(&weights[i + 4]));
+        _mm_storeu_ps(&out[i], _mm_mul_ps(error_lo, error_lo));
+        _mm_storeu_ps(&out[i + 4], _mm_mul_ps(error_hi, error_hi));
+    }
+#else
+    for (int i = 0; i < 64; i++) {
+        const float error = (stored[i] - magnitude[i]) * weights[i];
+        out[i] = error * error;
+    }
+#endif
+}
+
+static void rdo_block_candidates(const requantization_table_t* t, const jpeg_block_t* block,
+                                 rdo_candidates_t* cand)
+{
+    static const int16_t zeros[64] = { 0 };
+    const int16_t* coefficients = (const int16_t*)block;
+
+    for (int i = 0; i < 64; i++) {
+        const int32_t magnitude = abs(coefficients[i]);
+        const int32_t qs = t->source_q[i];
+        const int32_t qt = t->target_q[i];
+
+        // same rounding as requantize_coefficient().
+        const int32_t level = ((magnitude * qs) + (qt / 2)) / qt;
+        cand->magnitude[i] = magnitude;
+        cand->stored[0][i] = ((level * qt) + (qs / 2)) / qs;
+        cand->stored[1][i] = (level > 1) ? ((((level - 1) * qt) + (qs / 2)) / qs) : 0;
+        cand->weights[i] = (float)qs / qt;
+    }
+
+    rdo_distortions(cand->stored[0], cand->magnitude, cand->weights, cand->distortion[0]);
+    rdo_distortions(cand->stored[1], cand->magnitude, cand->weights, cand->distortion[1]);
+    rdo_distortions(zeros, cand->magnitude, cand->weights, cand->distortion[2]);
+}
+
+/**
+ * Picks the levels of a block's AC coefficients in a single backward pass. A coefficient is
+ * lowered or zeroed if that's cheaper given the choices already made after it and the plainly
+ * rounded coefficients before it.
+ */
+static void rdo_block_greedy(const rdo_component_t* rc, const rdo_candidates_t* cand,
+                             int16_t* out)
+{
+    // previous nonzero position of every position, before anything is changed.
+    int before[64];
+    for (int i = 1, p = 0; i < 64; i++) {
+        before[i] = p;
+        if (cand->stored[0][i] != 0) {
+            p = i;
+        }
+    }
+
+    int next = 64;
+    for (int i = 63; i > 0; i--) {
+        out[i] = 0;
+        if (cand->stored[0][i] == 0) {
+            continue;
+        }
+
+        // whatever follows i is coded differently depending on whether i stays nonzero.
+        const int p = before[i];
+        float tail_kept = (i < 63) ? rc->rate[0x00] : 0.0f;
+        float tail_zeroed = rc->rate[0x00];
+        if (next < 64) {
+            const int next_size = rdo_size(out[next]);
+            tail_kept = rdo_run_rate(rc, next - i - 1, next_size);
+            tail_zeroed = rdo_run_rate(rc, next - p - 1, next_size);
+        }
+
+        float best = cand->distortion[2][i] + tail_zeroed;
+        for (int k = 0; k < 2; k++) {
+            const int16_t stored = cand->stored[k][i];
+            if (stored == 0) {
+                continue;
+            }
+            const float cost = cand->distortion[k][i] + tail_kept +
+                               rdo_run_rate(rc, i - p - 1, rdo_size(stored));
+            if (cost < best) {
+                best = cost;
+                out[i] = stored;
+            }
+        }
+        if (out[i] != 0) {
+            next = i;
+        }
+    }
+}
+
+/**
+ * Picks the levels of a block's AC coefficients that minimize its cost. cost[i] is the cheapest
+ * way to code the coefficients up to i with i as the last nonzero one, which only depends on
+ * the cheapest ways to reach the nonzero positions before it, so every choice of levels and of
+ * where the block ends is covered.
+ */
+static void rdo_block_trellis(const rdo_component_t* rc, const rdo_candidates_t* cand,
+                              int16_t* out)
+{
+    // zeroed[i] is the distortion of zeroing positions 1 to i - 1.
+    float zeroed[65];
+    zeroed[0] = 0.0f;
+    zeroed[1] = 0.0f;
+    for (int i = 1; i < 64; i++) {
+        zeroed[i + 1] = zeroed[i] + cand->distortion[2][i];
+    }
+
+    float cost[64];
+    uint8_t from[64];
+    uint8_t choice[64];
+    uint8_t nonzero[64];
+    int num_nonzero = 1;
+    cost[0] = 0.0f;
+    nonzero[0] = 0;
+
+    for (int i = 1; i < 64; i++) {
+        if (cand->stored[0][i] == 0) {
+            continue;
+        }
+
+        float best = INFINITY;
+        for (int k = 0; k < 2; k++) {
+            const int16_t stored = cand->stored[k][i];
+            if (stored == 0) {
+                continue;
+            }
+            const int size = rdo_size(stored);
+            const float distortion = cand->distortion[k][i] + zeroed[i];
+            for (int n = 0; n < num_nonzero; n++) {
+                const int j = nonzero[n];
+                const float c = cost[j] - zeroed[j + 1] + distortion +
+                                rdo_run_rate(rc, i - j - 1, size);
+                if (c < best) {
+                    best = c;
+                    from[i] = j;
+                    choice[i] = k;
+                }
+            }
+        }
+        cost[i] = best;
+        nonzero[num_nonzero++] = i;
+    }
+
+    int last = 0;
+    float best = INFINITY;
+    for (int n = 0; n < num_nonzero; n++) {
+        const int j = nonzero[n];
+        const float c = cost[j] + (zeroed[64] - zeroed[j + 1]) + ((j < 63) ? rc->rate[0x00] : 0.0f);
+        if (c < best) {
+            best = c;
+            last = j;
+        }
+    }
+
+    memset(out, 0, 64 * sizeof(int16_t));
+    for (int i = last; i > 0; i = from[i]) {
+        out[i] = cand->stored[choice[i]][i];
+    }
+}
+
+typedef struct rdo_worker
+{
+    const rdo_context_t* ctx;
+    int index;
+    int num_workers;
+    uint64_t nonzero_before;
+    uint64_t nonzero_after;
+} rdo_worker_t;
+
+/**
+ * Requantizes the index-th of num_workers bands of block rows of every component.
+ */
+static void* rdo_worker_run(void* arg)
+{
+    rdo_worker_t* worker = arg;
+    const rdo_context_t* ctx = worker->ctx;
+
+    for (int c = 0; c < ctx->rq->num_components; c++) {
+        const rdo_component_t* rc = &ctx->components[c];
+        huffman_decoded_jpeg_component_t* component = &ctx->decoded_scan->components[c];
+        const int row0 = (component->block_lines * worker->index) / worker->num_workers;
+        const int row1 = (component->block_lines * (worker->index + 1)) / worker->num_workers;
+
+        for (int by = row0; by < row1; by++) {
+            for (int bx = 0; bx < component->blocks_per_line; bx++) {
+                jpeg_block_t* block = &component->blocks[(by * component->blocks_per_line) + bx];
+                if (ctx->count_nonzeros) {
+                    worker->nonzero_before += block_count_nonzeros(block);
+                }
+
+                const requantization_table_t* t = rc->unchanged ? NULL :
+                    jpeg_requantizer_table_at(ctx->rq, ctx->jpeg, ctx->roi_map,
+                                              ctx->decoded_scan, c, bx, by);
+                if ((t != NULL) && !t->identity) {
+                    rdo_candidates_t cand;
+                    rdo_block_candidates(t, block, &cand);
+
+                    int16_t levels[64];
+                    if (ctx->mode == JPEG_RDO_TRELLIS) {
+                        rdo_block_trellis(rc, &cand, levels);
+                    } else {
+                        rdo_block_greedy(rc, &cand, levels);
+                    }
+
+                    if (block->dc_value != 0) {
+                        block->dc_value = requantize_coefficient(block->dc_value, t->source_q[0],
+                                                                 t->target_q[0]);
+                    }
+                    for (int i = 1; i < 64; i++) {
+                        block->ac_values[i - 1] = (block->ac_values[i - 1] < 0) ? -levels[i] :
+                                                                                  levels[i];
+                    }
+                }
+
+                if (ctx->count_nonzeros) {
+                    worker->nonzero_after += block_count_nonzeros(block);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void jpeg_requantize_decoded_scan_rdo(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                                      const jpeg_roi_map_t* roi_map,
+                                      const jpeg_rdo_params_t* params,
+                                      huffman_decoded_jpeg_scan_t* decoded_scan)
+{
+    if (params->mode == JPEG_RDO_OFF) {
+        jpeg_requantize_decoded_scan(rq, jpeg, roi_map, decoded_scan);
+        return;
+    }
+
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    rdo_context_t* ctx = calloc(1, sizeof(rdo_context_t));
+    ctx->rq = rq;
+    ctx->jpeg = jpeg;
+    ctx->roi_map = roi_map;
+    ctx->mode = params->mode;
+    ctx->count_nonzeros = JPEG_STATS_ENABLED();
+    ctx->decoded_scan = decoded_scan;
+
+    const float lambda = (params->lambda > 0.0f) ? params->lambda : JPEG_RDO_DEFAULT_LAMBDA;
+    for (int c = 0; c < rq->num_components; c++) {
+        rdo_component_t* rc = &ctx->components[c];
+        rc->unchanged = jpeg_requantizer_component_is_identity(rq, c, roi_map);
+
+        const uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[c].dc_ac_entropy_coding_table;
+        uint8_t code_length[256];
+        jpeg_huffman_table_code_lengths(&jpeg->ac_huffman_tables[huff_tables & 0x03], code_length);
+        for (int s = 0; s < 256; s++) {
+            const int bits = (code_length[s] != 0) ? (code_length[s] + (s & 0x0f)) :
+                                                     RDO_MISSING_CODE_BITS;
+            rc->rate[s] = lambda * bits;
+        }
+    }
+
+    // every worker takes a band of block rows of each component; the first band is done on the
+    // calling thread.
+    int num_workers = params->num_threads;
+    num_workers = (num_workers < 1) ? 1 : ((num_workers > RDO_MAX_THREADS) ? RDO_MAX_THREADS :
+                                                                             num_workers);
+    rdo_worker_t workers[RDO_MAX_THREADS];
+    pthread_t threads[RDO_MAX_THREADS];
+    bool started[RDO_MAX_THREADS] = { false };
+    for (int w = 0; w < num_workers; w++) {
+        workers[w].ctx = ctx;
+        workers[w].index = w;
+        workers[w].num_workers = num_workers;
+        workers[w].nonzero_before = 0;
+        workers[w].nonzero_after = 0;
+    }
+    for (int w = 1; w < num_workers; w++) {
+        started[w] = (pthread_create(&threads[w], NULL, rdo_worker_run, &workers[w]) == 0);
+    }
+    rdo_worker_run(&workers[0]);
+
+    for (int w = 0; w < num_workers; w++) {
+        if (started[w]) {
+            pthread_join(threads[w], NULL);
+        } else if (w != 0) {
+            rdo_worker_run(&workers[w]);
+        }
+        JPEG_STATS_ADD(nonzero_coefficients_before, workers[w].nonzero_before);
+        JPEG_STATS_ADD(nonzero_coefficients_after, workers[w].nonzero_after);
+    }
+
+    free(ctx);
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_REQUANTIZE, t0);
+}
+
+typedef struct ladder_level
+{
+    const jpeg_image_t* jpeg;
+    const huffman_decoded_jpeg_scan_t* decoded_scan;
+    bool optimize_huffman_tables;
+    jpeg_image_t* output;
+} ladder_level_t;
+
+static void* ladder_level_encode(void* arg)
+{
+    ladder_level_t* level = arg;
+
+    if (level->optimize_huffman_tables) {
+        jpeg_image_t* tables = jpeg_image_copy(level->jpeg);
+        jpeg_image_optimize_huffman_tables(tables, level->decoded_scan);
+        level->output = jpeg_image_huffman_recode_with_tables(level->decoded_scan, tables);
+        jpeg_image_destroy(tables);
+    } else {
+        // requantizing can call for symbols, DC sizes included, that the source's tables don't
+        // code; those levels get tables of their own.
+        level->output = jpeg_image_huffman_recode(level->decoded_scan, level->jpeg);
+    }
+
+    return NULL;
+}
+
+int jpeg_requantize_ladder(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                           const huffman_decoded_jpeg_scan_t* decoded_scan,
+                           const jpeg_roi_map_t* const* roi_maps, int num_levels,
+                           bool optimize_huffman_tables, jpeg_image_t** outputs)
+{
+    if ((num_levels < 1) || (num_levels > JPEG_LADDER_MAX_LEVELS)) {
+        return -1;
+    }
+
+    huffman_decoded_jpeg_scan_t* scans[JPEG_LADDER_MAX_LEVELS];
+    for (int l = 0; l < num_levels; l++) {
+        scans[l] = huffman_decoded_jpeg_scan_create(jpeg);
+        if (scans[l] == NULL) {
+            for (int i = 0; i < l; i++) {
+                huffman_decoded_jpeg_scan_destroy(scans[i]);
+            }
+            return -1;
+        }
+    }
+
+    requantize_scan_levels(rq, jpeg, roi_maps, num_levels, decoded_scan, scans);
+
+    // every level is coded on its own thread; the first one is done on the calling thread, where
+    // it also counts towards any attached stats.
+    ladder_level_t levels[JPEG_LADDER_MAX_LEVELS];
+    pthread_t threads[JPEG_LADDER_MAX_LEVELS];
+    bool started[JPEG_LADDER_MAX_LEVELS] = { false };
+    for (int l = 0; l < num_levels; l++) {
+        levels[l].jpeg = jpeg;
+        levels[l].decoded_scan = scans[l];
+        levels[l].optimize_huffman_tables = optimize_huffman_tables;
+        levels[l].output = NULL;
+    }
+    for (int l = 1; l < num_levels; l++) {
+        started[l] = (pthread_create(&threads[l], NULL, ladder_level_encode, &levels[l]) == 0);
+    }
+    ladder_level_encode(&levels[0]);
+
+    int retval = 0;
+    for (int l = 0; l < num_levels; l++) {
+        if (started[l]) {
+            pthread_join(threads[l], NULL);
+        } else if (l != 0) {
+            ladder_level_encode(&levels[l]);
+        }
+
+        outputs[l] = levels[l].output;
+        if (outputs[l] == NULL) {
+            retval = -1;
+        }
+        huffman_decoded_jpeg_scan_destroy(scans[l]);
+    }
+
+    return retval;
+}
+
+jpeg_roi_map_t* jpeg_roi_map_create_uniform(const jpeg_image_t* jpeg, uint8_t quality)
+{
+    jpeg_roi_map_t* roi_map = calloc(1, sizeof(jpeg_roi_map_t));
+    roi_map->blocks_wide = (jpeg->frame_header.samples_per_line + (8 - 1)) / 8;
+    roi_map->blocks_high = (jpeg->frame_header.number_of_lines + (8 - 1)) / 8;
+    roi_map->quality = malloc(roi_map->blocks_wide * roi_map->blocks_high);
+    memset(roi_map->quality, quality, roi_map->blocks_wide * roi_map->blocks_high);
+
+    return roi_map;
+}
+
+jpeg_roi_map_t* jpeg_roi_map_create_scaled(const jpeg_image_t* jpeg, const jpeg_roi_map_t* roi_map,
+                                           int scale)
+{
+    if (roi_map == NULL) {
+        return jpeg_roi_map_create_uniform(jpeg, (scale < 1) ? 1 : (scale > 100) ? 100 : scale);
+    }
+
+    jpeg_roi_map_t* scaled = calloc(1, sizeof(jpeg_roi_map_t));
+    scaled->blocks_wide = roi_map->blocks_wide;
+    scaled->blocks_high = roi_map->blocks_high;
+    scaled->quality = malloc(scaled->blocks_wide * scaled->blocks_high);
+    for (int i = 0; i < scaled->blocks_wide * scaled->blocks_high; i++) {
+        int q = ((roi_map->quality[i] * scale) + 50) / 100;
+        scaled->quality[i] = (q < 1) ? 1 : (q > 100) ? 100 : q;
+    }
+
+    return scaled;
+}
+
+/**
+ * Raises every 0 in roi_map to 1, the lowest quality there is.
+ */
+static void roi_map_raise_zeros(jpeg_roi_map_t* roi_map)
+{
+    for (uint32_t i = 0; i < roi_map->blocks_wide * roi_map->blocks_high; i++) {
+        if (roi_map->quality[i] < 1) {
+            roi_map->quality[i] = 1;
+        }
+    }
+}
+
+jpeg_roi_map_t* jpeg_roi_map_create_from_blocks(const jpeg_image_t* jpeg, const uint8_t* quality)
+{
+    jpeg_roi_map_t* roi_map = jpeg_roi_map_create_uniform(jpeg, 0);
+    memcpy(roi_map->quality, quality, roi_map->blocks_wide * roi_map->blocks_high);
+    roi_map_raise_zeros(roi_map);
+
+    return roi_map;
+}
+
+jpeg_roi_map_t* jpeg_roi_map_create_from_mcus(const jpeg_image_t* jpeg, const uint8_t* quality)
+{
+    // a grayscale scan isn't interleaved, so its MCUs are single blocks.
+    int H_max = 1, V_max = 1;
+    if (jpeg->frame_header.num_components > 1) {
+        for (int c = 0; c < jpeg->frame_header.num_components; c++) {
+            if (jpeg->frame_header.csps[c].horizontal_sampling_factor > H_max) {
+                H_max = jpeg->frame_header.csps[c].horizontal_sampling_factor;
+            }
+            if (jpeg->frame_header.csps[c].vertical_sampling_factor > V_max) {
+                V_max = jpeg->frame_header.csps[c].vertical_sampling_factor;
+            }
+        }
+    }
+
+    jpeg_roi_map_t* roi_map = jpeg_roi_map_create_uniform(jpeg, 0);
+    const uint32_t mcus_per_line = (roi_map->blocks_wide + H_max - 1) / H_max;
+    for (uint32_t y = 0; y < roi_map->blocks_high; y++) {
+        const uint8_t* mcu_row = &quality[(y / V_max) * mcus_per_line];
+        uint8_t* row = &roi_map->quality[y * roi_map->blocks_wide];
+        for (uint32_t x = 0; x < roi_map->blocks_wide; x++) {
+            row[x] = mcu_row[x / H_max];
+        }
+    }
+    roi_map_raise_zeros(roi_map);
+
+    return roi_map;
+}
+
+jpeg_roi_map_t* jpeg_roi_map_create_from_pixels(const jpeg_image_t* jpeg, const uint8_t* rois)
 {
+    const uint32_t width = jpeg->frame_header.samples_per_line;
+    const uint32_t height = jpeg->frame_header.number_of_lines;
+    jpeg_roi_map_t* roi_map = jpeg_roi_map_create_uniform(jpeg, 0);
+
+    for (uint32_t by = 0; by < roi_map->blocks_high; by++) {
+        const uint32_t y0 = by * 8;
+        const uint32_t rows = ((height - y0) < 8) ? (height - y0) : 8;
+        const uint8_t* block_row = &rois[(size_t)y0 * width];
+        uint8_t* out = &roi_map->quality[by * roi_map->blocks_wide];
+
+        uint32_t x = 0;
+#ifdef __SSE2__
+        // two blocks at a time: the max down the rows, then across each 8 byte half.
+        for (; (x + 16) <= width; x += 16) {
+            __m128i m = _mm_loadu_si128((const __m128i*)&block_row[x]);
+            for (uint32_t r = 1; r < rows; r++) {
+                m = _mm_max_epu8(m, _mm_loadu_si128((const __m128i*)&block_row[(r * width) + x]));
+            }
+            m = _mm_max_epu8(m, _mm_srli_epi64(m, 32));
+            m = _mm_max_epu8(m, _mm_srli_epi64(m, 16));
+            m = _mm_max_epu8(m, _mm_srli_epi64(m, 8));
+            out[x / 8] = _mm_cvtsi128_si32(m) & 0xff;
+            out[(x / 8) + 1] = _mm_extract_epi16(m, 4) & 0xff;
+        }
+#endif
+        for (; x < width; x++) {
+            for (uint32_t r = 0; r < rows; r++) {
+                const uint8_t q = block_row[(r * width) + x];
+                if (q > out[x / 8]) {
+                    out[x / 8] = q;
+                }
+            }
+        }
+    }
+    roi_map_raise_zeros(roi_map);
+
+    return roi_map;
+}
+
+/**
+ * Raises the blocks of roi_map whose centers polygon contains to the polygon's quality, going
+ * row by row and filling between pairs of edge crossings, i.e. with the even-odd rule.
+ */
+static void roi_map_fill_polygon(jpeg_roi_map_t* roi_map, const jpeg_roi_polygon_t* polygon)
+{
+    if (polygon->num_points < 3) {
+        return;
+    }
+
+    double* crossings = malloc(polygon->num_points * sizeof(double));
+    for (uint32_t by = 0; by < roi_map->blocks_high; by++) {
+        const double cy = (by * 8) + 4;
+        int num_crossings = 0;
+        for (int i = 0; i < polygon->num_points; i++) {
+            const int j = (i + 1) % polygon->num_points;
+            const double x0 = polygon->points[(2 * i) + 0], y0 = polygon->points[(2 * i) + 1];
+            const double x1 = polygon->points[(2 * j) + 0], y1 = polygon->points[(2 * j) + 1];
+            if ((y0 > cy) != (y1 > cy)) {
+                crossings[num_crossings++] = x0 + (((cy - y0) * (x1 - x0)) / (y1 - y0));
+            }
+        }
+
+        // there are only ever a handful of crossings per row.
+        for (int i = 1; i < num_crossings; i++) {
+            const double x = crossings[i];
+            int k = i;
+            for (; (k > 0) && (crossings[k - 1] > x); k--) {
+                crossings[k] = crossings[k - 1];
+            }
+            crossings[k] = x;
+        }
+
+        uint8_t* row = &roi_map->quality[by * roi_map->blocks_wide];
+        for (int i = 0; (i + 1) < num_crossings; i += 2) {
+            // blocks with their center cx = (bx * 8) + 4 in [crossings[i], crossings[i + 1]).
+            double first = ceil((crossings[i] - 4) / 8);
+            double last = ceil((crossings[i + 1] - 4) / 8) - 1;
+            first = (first < 0) ? 0 : first;
+            last = (last > (roi_map->blocks_wide - 1)) ? (roi_map->blocks_wide - 1) : last;
+            for (int bx = first; bx <= last; bx++) {
+                if (polygon->quality > row[bx]) {
+                    row[bx] = polygon->quality;
+                }
+            }
+        }
+    }
+    free(crossings);
+}
+
+jpeg_roi_map_t* jpeg_roi_map_create_from_shapes(const jpeg_image_t* jpeg, uint8_t base_quality,
+                                                const jpeg_roi_rect_t* rects, int num_rects,
+                                                const jpeg_roi_polygon_t* polygons,
+                                                int num_polygons)
+{
+    jpeg_roi_map_t* roi_map = jpeg_roi_map_create_uniform(jpeg, base_quality);
+
+    for (int i = 0; i < num_rects; i++) {
+        const jpeg_roi_rect_t* rect = &rects[i];
+        if ((rect->width == 0) || (rect->height == 0)) {
+            continue;
+        }
+
+        const uint32_t bx0 = rect->x / 8;
+        const uint32_t by0 = rect->y / 8;
+        uint32_t bx1 = (((uint64_t)rect->x + rect->width - 1) / 8) + 1;
+        uint32_t by1 = (((uint64_t)rect->y + rect->height - 1) / 8) + 1;
+        bx1 = (bx1 > roi_map->blocks_wide) ? roi_map->blocks_wide : bx1;
+        by1 = (by1 > roi_map->blocks_high) ? roi_map->blocks_high : by1;
+        for (uint32_t by = by0; by < by1; by++) {
+            uint8_t* row = &roi_map->quality[by * roi_map->blocks_wide];
+            for (uint32_t bx = bx0; bx < bx1; bx++) {
+                if (rect->quality > row[bx]) {
+                    row[bx] = rect->quality;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < num_polygons; i++) {
+        roi_map_fill_polygon(roi_map, &polygons[i]);
+    }
+    roi_map_raise_zeros(roi_map);
+
+    return roi_map;
+}
+
+jpeg_roi_map_t* jpeg_roi_map_create_from_rle(const jpeg_image_t* jpeg, const uint8_t* data,
+                                             size_t size)
+{
+    jpeg_roi_map_t* roi_map = jpeg_roi_map_create_uniform(jpeg, 0);
+    const uint64_t num_blocks = roi_map->blocks_wide * roi_map->blocks_high;
+
+    uint64_t filled = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        uint64_t length = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            if ((pos == size) || (shift > 28)) {
+                goto fail;
+            }
+            byte = data[pos++];
+            length |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+
+        if ((pos == size) || (length > (num_blocks - filled))) {
+            goto fail;
+        }
+        memset(&roi_map->quality[filled], data[pos++], length);
+        filled += length;
+    }
+    if (filled != num_blocks) {
+        goto fail;
+    }
+    roi_map_raise_zeros(roi_map);
+
+    return roi_map;
+
+fail:
+    jpeg_roi_map_destroy(roi_map);
+    return NULL;
+}
+
+void jpeg_roi_map_destroy(jpeg_roi_map_t* roi_map)
+{
+    free(roi_map->quality);
+    free(roi_map);
+}
+
+/**
+ * Requantizes a fresh copy of source into scratch at the given scale and estimates its size.
+ */
+static uint64_t estimate_size_at_scale(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                                       const jpeg_roi_map_t* roi_map,
+                                       const huffman_decoded_jpeg_scan_t* source,
+                                       huffman_decoded_jpeg_scan_t* scratch, int scale,
+                                       bool optimize_huffman_tables)
+{
+    for (int c = 0; c < rq->num_components; c++) {
+        memcpy(scratch->components[c].blocks, source->components[c].blocks,
+               source->components[c].num_blocks * sizeof(jpeg_block_t));
+    }
+
+    jpeg_roi_map_t* scaled = jpeg_roi_map_create_scaled(jpeg, roi_map, scale);
+    jpeg_requantize_decoded_scan(rq, jpeg, scaled, scratch);
+    jpeg_roi_map_destroy(scaled);
+
+    return jpeg_image_estimate_coded_size(jpeg, scratch, optimize_huffman_tables);
+}
+
+int jpeg_requantizer_fit_size(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                              const jpeg_roi_map_t* roi_map,
+                              const huffman_decoded_jpeg_scan_t* decoded_scan,
+                              uint64_t target_bytes, bool optimize_huffman_tables,
+                              uint64_t* estimated_bytes)
+{
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+
+    // the trial requantizations shouldn't show up in the caller's coefficient counts.
+    jpeg_stats_t* stats = jpeg_stats_active;
+    jpeg_stats_attach(NULL);
+
+    huffman_decoded_jpeg_scan_t* scratch = huffman_decoded_jpeg_scan_copy(decoded_scan);
+
+    // size only grows with quality, so bisect for the last scale that fits.
+    int lo = 1;
+    int hi = 100;
+    uint64_t lo_bytes = estimate_size_at_scale(rq, jpeg, roi_map, decoded_scan, scratch, lo,
+                                               optimize_huffman_tables);
+    const uint64_t hi_bytes = estimate_size_at_scale(rq, jpeg, roi_map, decoded_scan, scratch, hi,
+                                                     optimize_huffman_tables);
+    if (hi_bytes <= target_bytes) {
+        lo = hi;
+        lo_bytes = hi_bytes;
+    } else {
+        while ((hi - lo) > 1) {
+            const int mid = (lo + hi) / 2;
+            const uint64_t mid_bytes = estimate_size_at_scale(rq, jpeg, roi_map, decoded_scan,
+                                                              scratch, mid,
+                                                              optimize_huffman_tables);
+            if (mid_bytes <= target_bytes) {
+                lo = mid;
+                lo_bytes = mid_bytes;
+            } else {
+                hi = mid;
+            }
+        }
+    }
+
+    huffman_decoded_jpeg_scan_destroy(scratch);
+
+    jpeg_stats_attach(stats);
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_REQUANTIZE, t0);
+
+    if (estimated_bytes != NULL) {
+        *estimated_bytes = lo_bytes;
+    }
+    return lo;
+}
+
+int recode_jpeg(jpeg_image_t *jpg, unsigned char *rois)
+{
+    jpeg_roi_map_t* roi_map = jpeg_roi_map_create_from_pixels(jpg, rois);
+    const int retval = recode_jpeg_with_roi_map(jpg, roi_map);
+    jpeg_roi_map_destroy(roi_map);
+    return retval;
+}
+
+int recode_jpeg_with_roi_map(jpeg_image_t* jpg, const jpeg_roi_map_t* roi_map)
+{
+    jpeg_requantizer_t* rq = jpeg_requantizer_create(jpg);
+    if (rq == NULL) {
+        return -1;
+    }
+
+    // only the restart intervals that the ROIs lower the quality of are decoded and recoded.
+    int retval = -1;
+    jpeg_image_t* recoded = jpeg_requantize_image_spliced(rq, jpg, roi_map, NULL);
+    if (recoded != NULL) {
+        // swap the recoded entropy coded segments, and the tables they were coded with, into the
+        // caller's image.
+        jpeg_scan_t tmp = jpg->scan;
+        jpg->scan = recoded->scan;
+        recoded->scan = tmp;
+        memcpy(jpg->dc_huffman_tables, recoded->dc_huffman_tables, sizeof(jpg->dc_huffman_tables));
+        memcpy(jpg->ac_huffman_tables, recoded->ac_huffman_tables, sizeof(jpg->ac_huffman_tables));
+        jpeg_image_destroy(recoded);
+        retval = 0;
+    }
 
+    jpeg_requantizer_destroy(rq);
+    return retval;
 }
@@ -2,14 +2,315 @@
 #define JPEG_REQUANTIZER_H
 
 #include "jpeg.h"
+#include "jpeg_probe.h"
+
+/**
+ * Quality map with one entry per 8x8 block of pixels in the full-resolution image.
+ *
+ * Every value of quality should be in [1, 100].
+ */
+typedef struct jpeg_roi_map
+{
+    uint32_t blocks_wide;
+    uint32_t blocks_high;
+    uint8_t* quality;
+} jpeg_roi_map_t;
+
+/**
+ * Lookup data for requantizing one component's blocks to a single quality level.
+ *
+ * Coefficients stay expressed in units of the source quantization table; requantizing a
+ * coefficient rounds its dequantized value to the nearest multiple of the target step.
+ */
+typedef struct requantization_table
+{
+    // true if requantizing to this quality leaves every coefficient unchanged, which happens when
+    // the target table is no coarser than the source table.
+    bool identity;
+
+    // both tables are in zigzag order, matching jpeg_block_t.
+    uint16_t source_q[64];
+    uint16_t target_q[64];
+} requantization_table_t;
+
+typedef struct jpeg_requantizer
+{
+    int num_components;
+
+    // indexed by [component][quality - 1]
+    requantization_table_t tables[3][100];
+} jpeg_requantizer_t;
+
+/**
+ * Fills target with the IJG-scaled Annex K example table for the given quality. Luminance tables
+ * are used for component 0 and chrominance tables for every other component.
+ *
+ * Steps are clamped to 255 for 8-bit samples and to 32767 for 12-bit samples. The result is in
+ * zigzag order with destination identifier 0, and is a 16-bit table only if some step needs it.
+ */
+void jpeg_quantization_table_for_quality(int component, int quality, int sample_precision,
+                                         jpeg_quantization_table_t* target);
+
+/**
+ * Estimates the IJG quality that table was made with, as the quality in [1, 100] whose
+ * jpeg_quantization_table_for_quality() table is closest to it. component picks the luminance or
+ * chrominance base table, as for jpeg_quantization_table_for_quality().
+ */
+int jpeg_quantization_table_estimate_quality(int component, int sample_precision,
+                                             const jpeg_quantization_table_t* table);
+
+/**
+ * Builds requantization tables for every component and quality level of the given image.
+ *
+ * A target table never has a finer step than the source table, so quality levels at or above the
+ * source's quality become identity tables.
+ *
+ * Returns NULL if a component references an undefined quantization table.
+ */
+jpeg_requantizer_t* jpeg_requantizer_create(const jpeg_image_t* jpeg);
+
+/**
+ * Same as jpeg_requantizer_create(), working from the quantization tables found by a probe, so
+ * that whether requantizing would change anything can be decided before the image is loaded.
+ */
+jpeg_requantizer_t* jpeg_requantizer_create_from_probe(const jpeg_probe_t* probe);
+
+void jpeg_requantizer_destroy(jpeg_requantizer_t* rq);
+
+/**
+ * Returns true if requantizing every component to quality would leave all of their coefficients
+ * unchanged, i.e. if quality is at or above what the source was saved at.
+ */
+bool jpeg_requantizer_quality_is_identity(const jpeg_requantizer_t* rq, int quality);
+
+/**
+ * Returns true if requantizing component c following roi_map would leave all of its coefficients
+ * unchanged. jpeg_requantize_decoded_scan() and jpeg_requantize_ladder() skip such components.
+ */
+bool jpeg_requantizer_component_is_identity(const jpeg_requantizer_t* rq, int c,
+                                            const jpeg_roi_map_t* roi_map);
+
+/**
+ * Returns true if jpeg_requantizer_component_is_identity() holds for every component, in which
+ * case the source's entropy coded data can be reused as is.
+ */
+bool jpeg_requantizer_is_identity(const jpeg_requantizer_t* rq, const jpeg_roi_map_t* roi_map);
+
+/**
+ * Requantizes every block of decoded_scan in place. Each component block takes the highest
+ * quality found among the ROI map blocks that it covers.
+ */
+void jpeg_requantize_decoded_scan(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                                  const jpeg_roi_map_t* roi_map,
+                                  huffman_decoded_jpeg_scan_t* decoded_scan);
+
+/**
+ * Requantizes jpeg following roi_map and returns the newly allocated result, decoding and recoding
+ * only the restart intervals that contain a block whose quality is lowered. Every other interval's
+ * entropy coded data is copied from jpeg unchanged, which makes a small ROI change on an image
+ * with restart markers cost roughly the size of the ROI rather than the size of the image.
+ *
+ * jpeg's huffman tables are kept, unless they lack codes that the requantized intervals need. Then
+ * the whole scan is decoded and recoded with tables that are optimal for it, as
+ * jpeg_image_huffman_recode() does. If intervals_recoded isn't NULL, the number of restart
+ * intervals that were recoded is stored there. Returns NULL on a decoding or recoding error.
+ */
+jpeg_image_t* jpeg_requantize_image_spliced(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                                            const jpeg_roi_map_t* roi_map,
+                                            uint32_t* intervals_recoded);
+
+/**
+ * Returns the table that jpeg_requantize_decoded_scan() would use for block (bx, by) of
+ * component c of scan, for callers that requantize blocks one at a time.
+ */
+const requantization_table_t* jpeg_requantizer_table_at(const jpeg_requantizer_t* rq,
+                                                        const jpeg_image_t* jpeg,
+                                                        const jpeg_roi_map_t* roi_map,
+                                                        const huffman_decoded_jpeg_scan_t* scan,
+                                                        int c, int bx, int by);
+
+/**
+ * Requantizes a single block in place.
+ */
+void jpeg_requantize_block(const requantization_table_t* t, jpeg_block_t* block);
+
+typedef enum jpeg_rdo_mode
+{
+    // plain rounding, as jpeg_requantize_decoded_scan() does.
+    JPEG_RDO_OFF = 0,
+
+    // one backward pass over each block that lowers or zeroes a coefficient whenever that alone
+    // pays for itself.
+    JPEG_RDO_GREEDY,
+
+    // a search over every choice of levels and last coefficient of each block, which finds the
+    // cheapest one under the cost model. Several times slower than greedy.
+    JPEG_RDO_TRELLIS
+} jpeg_rdo_mode_t;
+
+/**
+ * Weight of rate against distortion used when jpeg_rdo_params_t.lambda is 0. Distortion is
+ * measured in squared target quantization steps, so this is how much squared error in those
+ * units a single bit is worth.
+ */
+#define JPEG_RDO_DEFAULT_LAMBDA 0.025f
+
+typedef struct jpeg_rdo_params
+{
+    jpeg_rdo_mode_t mode;
+
+    // 0 picks JPEG_RDO_DEFAULT_LAMBDA; larger values give smaller files.
+    float lambda;
+
+    // threads to split the block rows of each component over; values below 2 use only the
+    // calling thread.
+    int num_threads;
+} jpeg_rdo_params_t;
+
+/**
+ * Same as jpeg_requantize_decoded_scan(), except that each AC coefficient can also be lowered by
+ * one target step or set to zero, and the choice is made per block to minimize
+ * distortion + lambda * bits. Bits are counted with the code lengths of the huffman tables that
+ * jpeg's scan header selects, so the result is tuned for being coded with those tables. DC
+ * coefficients are rounded as usual, and blocks whose table is an identity table are left alone.
+ *
+ * decoded_scan has to be in zigzag order. With mode set to JPEG_RDO_OFF this is
+ * jpeg_requantize_decoded_scan().
+ */
+void jpeg_requantize_decoded_scan_rdo(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                                      const jpeg_roi_map_t* roi_map,
+                                      const jpeg_rdo_params_t* params,
+                                      huffman_decoded_jpeg_scan_t* decoded_scan);
+
+#define JPEG_LADDER_MAX_LEVELS 16
+
+/**
+ * Produces num_levels recoded images from a single decode, level l being decoded_scan
+ * requantized with roi_maps[l]. decoded_scan isn't modified.
+ *
+ * All levels are requantized in one pass over the source blocks, then entropy coded in parallel,
+ * one thread per level. With optimize_huffman_tables, every level gets its own optimal tables;
+ * otherwise jpeg's tables are used for all of them.
+ *
+ * outputs must have room for num_levels images, which the caller frees with jpeg_image_destroy().
+ * Returns 0 on success, or -1 if any level failed, in which case that level's output is NULL.
+ */
+int jpeg_requantize_ladder(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                           const huffman_decoded_jpeg_scan_t* decoded_scan,
+                           const jpeg_roi_map_t* const* roi_maps, int num_levels,
+                           bool optimize_huffman_tables, jpeg_image_t** outputs);
+
+/**
+ * Allocates a ROI map that has the given quality everywhere. The map can be freed with
+ * jpeg_roi_map_destroy().
+ */
+jpeg_roi_map_t* jpeg_roi_map_create_uniform(const jpeg_image_t* jpeg, uint8_t quality);
+
+/**
+ * Allocates a copy of roi_map with every quality multiplied by scale / 100, rounded, and clamped
+ * to [1, 100]. A NULL roi_map is treated as a uniform map of quality 100.
+ */
+jpeg_roi_map_t* jpeg_roi_map_create_scaled(const jpeg_image_t* jpeg, const jpeg_roi_map_t* roi_map,
+                                           int scale);
+
+/**
+ * Allocates a ROI map from quality, which has one value per 8x8 block of the image, row by row,
+ * ceil(width / 8) values to a row. Values of 0 are raised to 1.
+ */
+jpeg_roi_map_t* jpeg_roi_map_create_from_blocks(const jpeg_image_t* jpeg, const uint8_t* quality);
+
+/**
+ * Same as jpeg_roi_map_create_from_blocks(), with one value per MCU instead, ceil(width / MCU
+ * width) values to a row. Every block of an MCU gets the MCU's value.
+ */
+jpeg_roi_map_t* jpeg_roi_map_create_from_mcus(const jpeg_image_t* jpeg, const uint8_t* quality);
+
+/**
+ * Allocates a ROI map from a per-pixel quality map with the same dimensions as the image, taking
+ * the highest value of each 8x8 block. Values of 0 are raised to 1.
+ */
+jpeg_roi_map_t* jpeg_roi_map_create_from_pixels(const jpeg_image_t* jpeg, const uint8_t* rois);
+
+/**
+ * Rectangle of the image, in pixels, to be given a quality.
+ */
+typedef struct jpeg_roi_rect
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint8_t quality;
+} jpeg_roi_rect_t;
+
+/**
+ * Polygon of the image to be given a quality. points holds num_points (x, y) pairs in pixels, and
+ * the last point is joined back to the first.
+ */
+typedef struct jpeg_roi_polygon
+{
+    const int32_t* points;
+    int num_points;
+    uint8_t quality;
+} jpeg_roi_polygon_t;
+
+/**
+ * Allocates a ROI map of base_quality with the given rectangles and polygons drawn over it. A
+ * block takes the highest quality of the shapes that touch it: any overlap with a rectangle
+ * counts, while a polygon has to contain the block's center. Either list can be NULL if its count
+ * is 0.
+ */
+jpeg_roi_map_t* jpeg_roi_map_create_from_shapes(const jpeg_image_t* jpeg, uint8_t base_quality,
+                                                const jpeg_roi_rect_t* rects, int num_rects,
+                                                const jpeg_roi_polygon_t* polygons,
+                                                int num_polygons);
+
+/**
+ * Allocates a ROI map from a run length coded per-block map. Each run is an unsigned LEB128
+ * length followed by one quality byte, and the runs cover the blocks in the same order as
+ * jpeg_roi_map_create_from_blocks().
+ *
+ * Returns NULL if the runs are truncated or don't add up to exactly one value per block.
+ */
+jpeg_roi_map_t* jpeg_roi_map_create_from_rle(const jpeg_image_t* jpeg, const uint8_t* data,
+                                             size_t size);
+
+void jpeg_roi_map_destroy(jpeg_roi_map_t* roi_map);
+
+/**
+ * Searches for the highest quality scale in [1, 100] at which requantizing decoded_scan with
+ * jpeg_roi_map_create_scaled(jpeg, roi_map, scale) is estimated to fit in target_bytes once it's
+ * recoded. decoded_scan isn't modified.
+ *
+ * Each step of the bisection requantizes a scratch copy of the scan and sizes it with
+ * jpeg_image_estimate_coded_size(), so a search costs a handful of histogram passes and no
+ * entropy coding. The estimate is tightest with optimize_huffman_tables set, in which case the
+ * caller should recode with jpeg_image_optimize_huffman_tables() as well.
+ *
+ * Returns the scale, or 1 if nothing fits. If estimated_bytes isn't NULL, the estimated size at
+ * the returned scale is stored there.
+ */
+int jpeg_requantizer_fit_size(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                              const jpeg_roi_map_t* roi_map,
+                              const huffman_decoded_jpeg_scan_t* decoded_scan,
+                              uint64_t target_bytes, bool optimize_huffman_tables,
+                              uint64_t* estimated_bytes);
 
 /**
  *
  * rois should have the same dimensions as the image stored in jpg.
  * every value of rois should be in [1, 100]. If there are conflicting values for one 8x8 MCU, the
  * higher value is taken for that MCU.
+ *
+ * Returns 0 on success. On failure, -1 is returned and jpg is left unchanged.
+ */
+int recode_jpeg(jpeg_image_t *jpg, unsigned char *rois);
+
+/**
+ * Same as recode_jpeg(), taking a ROI map built by one of the jpeg_roi_map_create_*() functions,
+ * which is far smaller than a per-pixel map.
  */
-void recode_jpeg(jpeg_image_t *jpg, unsigned char *rois);
+int recode_jpeg_with_roi_map(jpeg_image_t* jpg, const jpeg_roi_map_t* roi_map);
 
 
 #endif
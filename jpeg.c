@@ -2,9 +2,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// the SSSE3 block shuffles are compiled for every x86 build and picked at run time, so that they
+// don't depend on the build enabling SSSE3 for the whole file.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JPEG_SSSE3_SHUFFLES
+#include <tmmintrin.h>
+#endif
 #include "bit_dispenser.h"
 #include "bit_packer.h"
 #include "jpeg.h"
+#include "jpeg_stats.h"
 
 ////////////////////////////////////////////////////////////////
 // Marker symbol definitions
@@ -26,6 +36,9 @@ const static uint8_t DHT = 0xc4;
 const static uint8_t JPG_EXT = 0xc8;
 const static uint8_t DAC = 0xcc;
 
+const static uint8_t RST_0 = 0xd0;
+const static uint8_t RST_7 = 0xd7;
+
 const static uint8_t SOI = 0xd8;
 const static uint8_t EOI = 0xd9;
 const static uint8_t SOS = 0xda;
@@ -43,6 +56,13 @@ const static uint8_t JPG_13 = 0xfd;
 
 const static uint8_t COM = 0xfe;
 
+// Loader trace output is compiled out unless JPEG_TRACE is defined; printing dominates the cost
+// of loading small images.
+#ifdef JPEG_TRACE
+#define jpeg_trace(...) printf(__VA_ARGS__)
+#else
+#define jpeg_trace(...) do { } while (0)
+#endif
 
 /**
  * Reads the next segment marker into target
@@ -84,12 +104,72 @@ static int marker_is_SOF_marker(uint8_t marker)
             ((marker >= SOF_13) && (marker <= SOF_15)));
 }
 
+/**
+ * Appends a new, empty entropy coded segment to the given scan and returns it.
+ */
+static entropy_coded_segment_t* scan_append_ecs(jpeg_scan_t* scan)
+{
+    scan->num_ecs++;
+    scan->entropy_coded_segments = realloc(scan->entropy_coded_segments,
+                                           scan->num_ecs * sizeof(entropy_coded_segment_t*));
+    entropy_coded_segment_t* ecs = calloc(1, sizeof(entropy_coded_segment_t));
+    scan->entropy_coded_segments[scan->num_ecs - 1] = ecs;
+    return ecs;
+}
+
+/**
+ * Returns true for the frame types that can be decoded: baseline, and extended sequential huffman
+ * or arithmetic coding with 8- or 12-bit samples.
+ */
+static bool frame_is_supported(const jpeg_frame_header_t* frame_header)
+{
+    const uint8_t marker = frame_header->header.segment_marker;
+    const uint8_t P = frame_header->sample_precision;
+    return ((marker == SOF_0) && (P == 8)) ||
+           (((marker == SOF_1) || (marker == SOF_9)) && ((P == 8) || (P == 12)));
+}
+
+bool jpeg_image_is_arithmetic_coded(const jpeg_image_t* jpeg)
+{
+    const uint8_t marker = jpeg->frame_header.header.segment_marker;
+    return ((marker >= SOF_9) && (marker <= SOF_11)) || ((marker >= SOF_13) && (marker <= SOF_15));
+}
+
+/**
+ * Largest DC difference and AC coefficient sizes, in bits, that can appear in a frame.
+ */
+typedef struct coefficient_limits
+{
+    int max_dc_bits;
+    int max_ac_bits;
+} coefficient_limits_t;
+
+/**
+ * Fills limits in from jpeg's sample precision, as in F.1.2.1 of T.81: 11 and 10 bits for 8-bit
+ * samples, 15 and 14 bits for 12-bit samples.
+ */
+static void coefficient_limits_for_frame(const jpeg_image_t* jpeg, coefficient_limits_t* limits)
+{
+    limits->max_dc_bits = jpeg->frame_header.sample_precision + 3;
+    limits->max_ac_bits = jpeg->frame_header.sample_precision + 2;
+}
+
+/**
+ * Bytes a quantization table takes up in a DQT segment, Pq/Tq included.
+ */
+static int quantization_table_bytes(const jpeg_quantization_table_t* table)
+{
+    return 1 + ((((table->pq_tq >> 4) & 0x0f) == 0) ? 64 : 128);
+}
+
 /**
  *
  */
 static int decode_scan(uint8_t marker, FILE* fp, jpeg_scan_t* dest)
 {
     int retval = -1;
+    uint8_t* buf = NULL;
+    uint64_t stuffed_bytes = 0;
 
     dest->jpeg_scan_header.header.segment_marker = marker;
 
@@ -101,7 +181,7 @@ static int decode_scan(uint8_t marker, FILE* fp, jpeg_scan_t* dest)
     dest->jpeg_scan_header.header.Ls = Ls;
 
     const uint16_t remaining_bytes = dest->jpeg_scan_header.header.Ls - 2;
-    uint8_t* buf = calloc(1, remaining_bytes);
+    buf = calloc(1, remaining_bytes);
     if (fread(buf, remaining_bytes, 1, fp) != 1) {
         goto cleanup_0;
     }
@@ -120,47 +200,52 @@ static int decode_scan(uint8_t marker, FILE* fp, jpeg_scan_t* dest)
         goto cleanup_0;
     }
 
-    dest->num_ecs = 1;
-    dest->entropy_coded_segments = calloc(1, sizeof(entropy_coded_segment_t*));
-
-    // just dump into a buffer until we hit a non-stuffed ff byte
-    // we are going to assume that our image has no RST segments.
-    uint32_t ecs_capacity = 1024;
-    dest->entropy_coded_segments[0] = calloc(1, sizeof(entropy_coded_segment_t));
-    entropy_coded_segment_t* ecs = dest->entropy_coded_segments[0];
-    ecs->data = malloc(ecs_capacity);
-    bool bitstuff_just_happened = false;
+    // Dump everything up to the next marker into entropy coded segments, removing stuffed 0x00
+    // bytes along the way. Each restart interval gets its own segment; the RSTn markers are
+    // dropped here and regenerated when the image is stored.
+    uint32_t ecs_capacity = 0;
+    entropy_coded_segment_t* ecs = scan_append_ecs(dest);
     while (1) {
-        if (ecs->size == ecs_capacity) {
-            ecs_capacity *= 2;
-            ecs->data = realloc(ecs->data, ecs_capacity);
-        }
-        if (fread(&ecs->data[ecs->size], 1, 1, fp) != 1) {
+        int c = getc(fp);
+        if (c == EOF) {
             goto cleanup_0;
         }
-        ecs->size += 1;
 
-        // check the last 2 bytes.
-        if ((ecs->size > 2) && (ecs->data[ecs->size - 2] == 0xff)) {
-            if (bitstuff_just_happened) {
-                bitstuff_just_happened = false;
-            } else if (ecs->data[ecs->size - 1] == 0x00) {
+        if (c == 0xff) {
+            // skip any fill bytes and look at what follows.
+            do {
+                c = getc(fp);
+            } while (c == 0xff);
+
+            if (c == EOF) {
+                goto cleanup_0;
+            } else if (c == 0x00) {
                 // throw away the stuffed 0.
-                ecs->size -= 1;
-                bitstuff_just_happened = true;
+                c = 0xff;
+                stuffed_bytes++;
+            } else if ((c >= RST_0) && (c <= RST_7)) {
+                ecs = scan_append_ecs(dest);
+                ecs_capacity = 0;
+                continue;
             } else {
                 // we've reached a segment marker and need to rewind the file 2 bytes and pass
                 // control back up.
                 retval = 0;
-                ecs->size -= 2;
                 fseek(fp, -2, SEEK_CUR);
                 goto cleanup_0;
             }
         }
+
+        if (ecs->size == ecs_capacity) {
+            ecs_capacity = (ecs_capacity == 0) ? 1024 : (ecs_capacity * 2);
+            ecs->data = realloc(ecs->data, ecs_capacity);
+        }
+        ecs->data[ecs->size++] = c;
     }
 
 cleanup_0:
     free(buf);
+    JPEG_STATS_ADD(stuffed_bytes_read, stuffed_bytes);
 
     return retval;
 }
@@ -277,6 +362,11 @@ static int decode_quantization_tables(uint8_t marker, FILE* fp, jpeg_image_t* jp
         idx += 1;
         uint8_t table_precision = pq_tq >> 4;
         uint8_t table_dest = pq_tq & 0x0f;
+        if ((table_precision > 1) || (table_dest > 3) ||
+            ((idx + (64 << table_precision)) > remaining_bytes)) {
+            free(buf);
+            return -1;
+        }
         jpeg_quantization_table_t* dest = &jpeg->jpeg_quantization_tables[table_dest];
 
         dest->table_valid = true;
@@ -300,16 +390,77 @@ static int decode_quantization_tables(uint8_t marker, FILE* fp, jpeg_image_t* jp
     return 0;
 }
 
-jpeg_image_t* jpeg_image_load_from_file(const char* filename)
+static int decode_restart_interval(uint8_t marker, FILE* fp, jpeg_image_t* jpeg)
 {
-    jpeg_image_t* jpeg = NULL;
+    uint8_t buf[4];
+    if (fread(buf, 4, 1, fp) != 1) {
+        return -1;
+    }
 
-    // open the file.
-    FILE* fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        return NULL;
+    const uint16_t Ls = (buf[0] << 8) | buf[1];
+    if (Ls != 4) {
+        return -1;
+    }
+    jpeg->restart_interval = (buf[2] << 8) | buf[3];
+
+    return 0;
+}
+
+/**
+ * Reads a DAC segment's conditioning into jpeg, as in B.2.4.3 of T.81.
+ */
+static int decode_arithmetic_conditioning(uint8_t marker, FILE* fp, jpeg_image_t* jpeg)
+{
+    uint8_t Ls_buf[2];
+    if (fread(Ls_buf, 2, 1, fp) != 1) {
+        return -1;
+    }
+    uint16_t Ls = (Ls_buf[0] << 8) | Ls_buf[1];
+    if ((Ls < 2) || ((Ls % 2) != 0)) {
+        return -1;
+    }
+    const uint16_t remaining_bytes = Ls - 2;
+
+    uint8_t* buf = calloc(1, remaining_bytes + 1);
+    if ((remaining_bytes > 0) && (fread(buf, remaining_bytes, 1, fp) != 1)) {
+        free(buf);
+        return -1;
+    }
+
+    int retval = 0;
+    for (int idx = 0; idx < remaining_bytes; idx += 2) {
+        const uint8_t table_class = buf[idx] >> 4;
+        const uint8_t table_dest = buf[idx] & 0x0f;
+        const uint8_t Cs = buf[idx + 1];
+        if (table_dest > 3) {
+            retval = -1;
+        } else if (table_class == 0) {
+            // DC tables have their lower bound L in the low nibble and upper bound U in the high
+            // one.
+            if ((Cs & 0x0f) > (Cs >> 4)) {
+                retval = -1;
+            }
+            jpeg->arithmetic_dc_conditioning[table_dest] = Cs;
+        } else if (table_class == 1) {
+            if ((Cs < 1) || (Cs > 63)) {
+                retval = -1;
+            }
+            jpeg->arithmetic_ac_conditioning[table_dest] = Cs;
+        } else {
+            retval = -1;
+        }
     }
 
+    free(buf);
+    return retval;
+}
+
+jpeg_image_t* jpeg_image_load_from_stream(FILE* fp)
+{
+    jpeg_image_t* jpeg = NULL;
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    const long start = ftell(fp);
+
     // read the SOI marker, just to be sure. We are assuming that there are no 0xff pads before SOI.
     uint8_t SOI_marker[2] = { 0 };
     fread(SOI_marker, 2, 1, fp);
@@ -317,8 +468,13 @@ jpeg_image_t* jpeg_image_load_from_file(const char* filename)
         return NULL;
     }
 
-    // allocate a new structure.
+    // allocate a new structure. Arithmetic conditioning that no DAC segment sets keeps the
+    // defaults of F.1.4.4.1.4 and F.1.4.4.2.1 of T.81: L = 0 and U = 1 for DC, Kx = 5 for AC.
     jpeg = calloc(1, sizeof(jpeg_image_t));
+    for (int i = 0; i < 4; i++) {
+        jpeg->arithmetic_dc_conditioning[i] = 0x10;
+        jpeg->arithmetic_ac_conditioning[i] = 5;
+    }
 
     // handle each segment as it comes up.
     while (1) {
@@ -329,25 +485,35 @@ jpeg_image_t* jpeg_image_load_from_file(const char* filename)
         }
 
         if (marker_is_SOF_marker(marker)) {
-            printf("jpeg decoding trace:    decoding SOF segment.\n");
+            jpeg_trace("jpeg decoding trace:    decoding SOF segment.\n");
             if (decode_frame_header(marker, fp, &jpeg->frame_header)) {
                 goto cleanup_on_fail;
             }
         } else if (marker == SOS) {
-            printf("jpeg decoding trace:    decoding scan segment.\n");
+            jpeg_trace("jpeg decoding trace:    decoding scan segment.\n");
             if (decode_scan(marker, fp, &jpeg->scan)) {
                 goto cleanup_on_fail;
             }
         } else if (marker == DHT) {
-            printf("jpeg decoding trace:    decoding huffman table.\n");
+            jpeg_trace("jpeg decoding trace:    decoding huffman table.\n");
             if (decode_huffman_tables(marker, fp, jpeg)) {
                 goto cleanup_on_fail;
             }
         } else if (marker == DQT) {
-            printf("jpeg decoding trace:    decoding quantization table.\n");
+            jpeg_trace("jpeg decoding trace:    decoding quantization table.\n");
             if (decode_quantization_tables(marker, fp, jpeg)) {
                 goto cleanup_on_fail;
             }
+        } else if (marker == DAC) {
+            jpeg_trace("jpeg decoding trace:    decoding arithmetic conditioning.\n");
+            if (decode_arithmetic_conditioning(marker, fp, jpeg)) {
+                goto cleanup_on_fail;
+            }
+        } else if (marker == DRI) {
+            jpeg_trace("jpeg decoding trace:    decoding restart interval.\n");
+            if (decode_restart_interval(marker, fp, jpeg)) {
+                goto cleanup_on_fail;
+            }
         } else if (marker == EOI) {
             if (fgetc(fp) != -1) {
                 printf("jpeg decoding warn :    EOI marker found but not at end-of-file.\n");
@@ -368,7 +534,7 @@ jpeg_image_t* jpeg_image_load_from_file(const char* filename)
             }
             gs->header.Ls = (Ls_buf[0] << 8) | Ls_buf[1];
 
-            printf("jpeg decoding trace:    decoding misc segment with length %04x "
+            jpeg_trace("jpeg decoding trace:    decoding misc segment with length %04x "
                    "and marker %02x.\n", gs->header.Ls, marker);
 
             uint16_t payload_size = gs->header.Ls - 2;
@@ -387,15 +553,32 @@ jpeg_image_t* jpeg_image_load_from_file(const char* filename)
         }
     }
 
-    fclose(fp);
+    if (JPEG_STATS_ENABLED()) {
+        JPEG_STATS_ADD(bytes_read, ftell(fp) - start);
+        for (int i = 0; i < jpeg->scan.num_ecs; i++) {
+            JPEG_STATS_ADD(ecs_bytes, jpeg->scan.entropy_coded_segments[i]->size);
+        }
+    }
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_LOAD, t0);
     return jpeg;
 
 cleanup_on_fail:
-    fclose(fp);
     jpeg_image_destroy(jpeg);
     return NULL;
 }
 
+jpeg_image_t* jpeg_image_load_from_file(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    jpeg_image_t* jpeg = jpeg_image_load_from_stream(fp);
+    fclose(fp);
+    return jpeg;
+}
+
 
 static int jpeg_segment_header_store_to_file(const jpeg_segment_t* header, FILE* fp)
 {
@@ -411,8 +594,16 @@ static int jpeg_segment_header_store_to_file(const jpeg_segment_t* header, FILE*
 
 static int jpeg_huffman_table_store_to_file(const jpeg_huffman_table_t* table, FILE* fp)
 {
+    // Several tables may have been loaded from one DHT segment, but each one is stored in its
+    // own segment, so the length has to be recalculated.
+    jpeg_segment_t header = table->header;
+    header.Ls = 2 + 1 + 16;
+    for (int i = 0; i < 16; i++) {
+        header.Ls += table->number_of_codes_with_length[i];
+    }
+
     int retval = -1;
-    if ((retval = jpeg_segment_header_store_to_file(&table->header, fp))) {
+    if ((retval = jpeg_segment_header_store_to_file(&header, fp))) {
         return retval;
     }
 
@@ -440,13 +631,10 @@ static int jpeg_huffman_table_store_to_file(const jpeg_huffman_table_t* table, F
 }
 
 
-int jpeg_image_store_to_file(const char* filepath, const jpeg_image_t* jpeg)
+int jpeg_image_store_to_stream(FILE* fp, const jpeg_image_t* jpeg)
 {
-    FILE* fp = fopen(filepath, "w");
-
-    if (fp == NULL) {
-        return -1;
-    }
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    const long start = ftell(fp);
 
     // start by writing SOI
     int retval = -1;
@@ -472,14 +660,13 @@ int jpeg_image_store_to_file(const char* filepath, const jpeg_image_t* jpeg)
         goto cleanup;
     }
 
-    // calculate length of quantization tables. assume they are all 8-bit.
-    int num_valid_qtables = 0;
+    // calculate length of quantization tables; 16-bit tables take two bytes per step.
+    uint16_t qtLs = 2;
     for (int i = 0; i < 4; i++) {
         if (jpeg->jpeg_quantization_tables[i].table_valid) {
-            num_valid_qtables++;
+            qtLs += quantization_table_bytes(&jpeg->jpeg_quantization_tables[i]);
         }
     }
-    uint16_t qtLs = 65 * num_valid_qtables + 2;
     uint8_t Lshton[] = { ((qtLs >> 8) & 0xff), qtLs & 0xff };
     fwrite(Lshton, 1, 2, fp);
 
@@ -499,9 +686,9 @@ int jpeg_image_store_to_file(const char* filepath, const jpeg_image_t* jpeg)
                         goto cleanup;
                     }
                 } else {
-                    // 16-bit quant table
-                    // TODO WRONG BIT ORDER.
-                    if (fwrite(&qt->Q[i]._16, 2, 1, fp) != 1) {
+                    // 16-bit quant table, most significant byte first.
+                    const uint8_t q[2] = { (qt->Q[i]._16 >> 8) & 0xff, qt->Q[i]._16 & 0xff };
+                    if (fwrite(q, 2, 1, fp) != 1) {
                         retval = -1;
                         goto cleanup;
                     }
@@ -546,6 +733,13 @@ int jpeg_image_store_to_file(const char* filepath, const jpeg_image_t* jpeg)
         fwrite(&csp->quantization_table_selector, 1, 1, fp);
     }
 
+    // write DRI
+    if (jpeg->restart_interval != 0) {
+        uint8_t dri[] = { 0xff, DRI, 0x00, 0x04,
+                          (jpeg->restart_interval >> 8) & 0xff, jpeg->restart_interval & 0xff };
+        fwrite(dri, sizeof(dri), 1, fp);
+    }
+
     // write SOS
     jpeg_segment_header_store_to_file(&jpeg->scan.jpeg_scan_header.header, fp);
     fwrite(&jpeg->scan.jpeg_scan_header.num_components, 1, 1, fp);
@@ -557,25 +751,50 @@ int jpeg_image_store_to_file(const char* filepath, const jpeg_image_t* jpeg)
     fwrite(&jpeg->scan.jpeg_scan_header.selection_end, 1, 1, fp);
     fwrite(&jpeg->scan.jpeg_scan_header.approximation_high_approximation_low, 1, 1, fp);
 
-    // write ecs.
+    // write ecs, with an RSTn marker between each restart interval.
     // do it byte by byte in case any byte-stuffing needs to happen.
-    for (int i = 0; i < jpeg->scan.entropy_coded_segments[0]->size; i++) {
-        uint8_t writebyte = jpeg->scan.entropy_coded_segments[0]->data[i];
-        fwrite(&writebyte, 1, 1, fp);
+    uint64_t stuffed_bytes = 0;
+    for (int i = 0; i < jpeg->scan.num_ecs; i++) {
+        const entropy_coded_segment_t* ecs = jpeg->scan.entropy_coded_segments[i];
+        if (i != 0) {
+            fwrite((uint8_t[]) { 0xff, RST_0 + ((i - 1) % 8) }, 1, 2, fp);
+        }
 
-        if (writebyte == 0xff) {
-            fwrite((uint8_t[]) {0x00}, 1, 1, fp);
+        for (int j = 0; j < ecs->size; j++) {
+            uint8_t writebyte = ecs->data[j];
+            fwrite(&writebyte, 1, 1, fp);
+
+            if (writebyte == 0xff) {
+                fwrite((uint8_t[]) {0x00}, 1, 1, fp);
+                stuffed_bytes++;
+            }
         }
     }
 
     // write EOI
     fwrite((uint8_t[]) {0xff, EOI}, 1, 2, fp);
 
+    JPEG_STATS_ADD(stuffed_bytes_written, stuffed_bytes);
+    JPEG_STATS_ADD(output_bytes, ftell(fp) - start);
 
-    retval = 0;
+    retval = ferror(fp) ? -1 : 0;
 
 cleanup:
-    fclose(fp);
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_STORE, t0);
+    return retval;
+}
+
+int jpeg_image_store_to_file(const char* filepath, const jpeg_image_t* jpeg)
+{
+    FILE* fp = fopen(filepath, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    int retval = jpeg_image_store_to_stream(fp, jpeg);
+    if (fclose(fp) != 0) {
+        retval = -1;
+    }
     return retval;
 }
 
@@ -589,7 +808,7 @@ static jpeg_generic_segment_t* jpeg_generic_segment_copy(const jpeg_generic_segm
     return result;
 }
 
-jpeg_image_t* jpeg_image_copy(const jpeg_image_t* jpeg)
+jpeg_image_t* jpeg_image_copy_headers(const jpeg_image_t* jpeg)
 {
     jpeg_image_t* result = calloc(1, sizeof(jpeg_image_t));
 
@@ -608,22 +827,101 @@ jpeg_image_t* jpeg_image_copy(const jpeg_image_t* jpeg)
     memcpy(result->frame_header.csps, jpeg->frame_header.csps,
            jpeg->frame_header.num_components * sizeof(*result->frame_header.csps));
 
-    // scan header needs no deep copy, but the scan itself does.
-    // for the sake of laziness, we assume that there's only one entropy coded segment.
-    result->scan.entropy_coded_segments = calloc(1, sizeof(entropy_coded_segment_t*));
-    result->scan.entropy_coded_segments[0] = calloc(1, sizeof(entropy_coded_segment_t));
-    result->scan.entropy_coded_segments[0]->size = jpeg->scan.entropy_coded_segments[0]->size;
-    result->scan.entropy_coded_segments[0]->data = malloc(jpeg->scan.entropy_coded_segments[0]->size);
-    memcpy(result->scan.entropy_coded_segments[0]->data, jpeg->scan.entropy_coded_segments[0]->data,
-           jpeg->scan.entropy_coded_segments[0]->size);
+    // scan header needs no deep copy; the entropy coded segments are left to the caller.
+    result->scan.entropy_coded_segments = NULL;
+    result->scan.num_ecs = 0;
+    return result;
+}
+
+jpeg_image_t* jpeg_image_copy(const jpeg_image_t* jpeg)
+{
+    jpeg_image_t* result = jpeg_image_copy_headers(jpeg);
+
+    result->scan.num_ecs = jpeg->scan.num_ecs;
+    result->scan.entropy_coded_segments = calloc(jpeg->scan.num_ecs,
+                                                 sizeof(entropy_coded_segment_t*));
+    for (int i = 0; i < jpeg->scan.num_ecs; i++) {
+        const entropy_coded_segment_t* src = jpeg->scan.entropy_coded_segments[i];
+        entropy_coded_segment_t* dst = calloc(1, sizeof(entropy_coded_segment_t));
+        dst->size = src->size;
+        dst->data = malloc(src->size);
+        memcpy(dst->data, src->data, src->size);
+        result->scan.entropy_coded_segments[i] = dst;
+    }
     return result;
 }
 
 /**
- * Allocates a new huffman_decoded_jpeg_scan_t with appropriately sized mcu tables given the width,
- * height, and sampling factors of the given jpeg.
+ * Builds the MCU -> block map for a scan whose component planes have already been sized.
+ *
+ * A scan with a single component is non-interleaved, so each of its MCUs is one block and they
+ * come in plain raster order (A.2.2 of T.81). Otherwise each MCU holds H x V blocks of every
+ * component, left to right and top to bottom (A.2.3).
+ */
+static jpeg_mcu_map_t* jpeg_mcu_map_create(const jpeg_image_t* jpeg,
+                                           const huffman_decoded_jpeg_scan_t* decoded_scan)
+{
+    const int num_components = jpeg->frame_header.num_components;
+    jpeg_mcu_map_t* map = calloc(1, sizeof(jpeg_mcu_map_t));
+    map->refcount = 1;
+
+    if (num_components == 1) {
+        map->mcus_per_line = decoded_scan->components[0].blocks_per_line;
+        map->mcu_lines = decoded_scan->components[0].block_lines;
+        map->blocks_per_mcu = 1;
+    } else {
+        map->mcus_per_line = (jpeg->frame_header.samples_per_line + (8 * decoded_scan->H_max) - 1) /
+                             (8 * decoded_scan->H_max);
+        map->mcu_lines = (jpeg->frame_header.number_of_lines + (8 * decoded_scan->V_max) - 1) /
+                         (8 * decoded_scan->V_max);
+        for (int c = 0; c < num_components; c++) {
+            const int H = jpeg->frame_header.csps[c].horizontal_sampling_factor;
+            const int V = jpeg->frame_header.csps[c].vertical_sampling_factor;
+            for (int k = 0; k < (H * V); k++) {
+                map->block_component[map->blocks_per_mcu++] = c;
+            }
+        }
+    }
+    map->num_mcus = map->mcus_per_line * map->mcu_lines;
+    map->block_index = malloc(map->num_mcus * map->blocks_per_mcu * sizeof(uint32_t));
+
+    uint32_t* idx = map->block_index;
+    for (int my = 0; my < map->mcu_lines; my++) {
+        for (int mx = 0; mx < map->mcus_per_line; mx++) {
+            if (num_components == 1) {
+                *idx++ = (my * map->mcus_per_line) + mx;
+                continue;
+            }
+
+            for (int c = 0; c < num_components; c++) {
+                const int H = jpeg->frame_header.csps[c].horizontal_sampling_factor;
+                const int V = jpeg->frame_header.csps[c].vertical_sampling_factor;
+                const int blocks_per_line = decoded_scan->components[c].blocks_per_line;
+                for (int v = 0; v < V; v++) {
+                    for (int h = 0; h < H; h++) {
+                        *idx++ = (((my * V) + v) * blocks_per_line) + (mx * H) + h;
+                    }
+                }
+            }
+        }
+    }
+
+    return map;
+}
+
+static void jpeg_mcu_map_release(jpeg_mcu_map_t* map)
+{
+    if ((map != NULL) && (__atomic_sub_fetch(&map->refcount, 1, __ATOMIC_ACQ_REL) == 0)) {
+        free(map->block_index);
+        free(map);
+    }
+}
+
+/**
+ * huffman_decoded_jpeg_scan_create(), optionally leaving the block planes unallocated for callers
+ * that only need the geometry.
  */
-static huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg_scan_create(const jpeg_image_t* jpeg)
+static huffman_decoded_jpeg_scan_t* scan_create(const jpeg_image_t* jpeg, bool allocate_blocks)
 {
     // check and make sure that the number of components is compliant with our system
     if ((jpeg->frame_header.num_components != 3) &&
@@ -631,6 +929,21 @@ static huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg_scan_create(const jpeg_
         return NULL;
     }
 
+    int blocks_per_mcu = 0;
+    for (int i = 0; i < jpeg->frame_header.num_components; i++) {
+        const int H = jpeg->frame_header.csps[i].horizontal_sampling_factor;
+        const int V = jpeg->frame_header.csps[i].vertical_sampling_factor;
+        if ((H < 1) || (H > 4) || (V < 1) || (V > 4)) {
+            printf("jpeg decoding error:    invalid sampling factors %ix%i.\n", H, V);
+            return NULL;
+        }
+        blocks_per_mcu += H * V;
+    }
+    if ((jpeg->frame_header.num_components > 1) && (blocks_per_mcu > JPEG_MAX_BLOCKS_PER_MCU)) {
+        printf("jpeg decoding error:    %i blocks per MCU is too many.\n", blocks_per_mcu);
+        return NULL;
+    }
+
     huffman_decoded_jpeg_scan_t* result = calloc(1, sizeof(huffman_decoded_jpeg_scan_t));
 
     for (int i = 0; i < jpeg->frame_header.num_components; i++) {
@@ -642,423 +955,2566 @@ static huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg_scan_create(const jpeg_
         }
     }
 
+    const int mcus_x = (jpeg->frame_header.samples_per_line + (8 * result->H_max) - 1) /
+                       (8 * result->H_max);
+    const int mcus_y = (jpeg->frame_header.number_of_lines + (8 * result->V_max) - 1) /
+                       (8 * result->V_max);
+
     for (int i = 0; i < jpeg->frame_header.num_components; i++) {
-        // NB: this handles the ceiling operation
-        const int component_x = (jpeg->frame_header.csps[i].horizontal_sampling_factor *
-                                 jpeg->frame_header.samples_per_line) / result->H_max;
-        const int component_y = (jpeg->frame_header.csps[i].vertical_sampling_factor *
-                                 jpeg->frame_header.number_of_lines) / result->V_max;
+        const int H = jpeg->frame_header.csps[i].horizontal_sampling_factor;
+        const int V = jpeg->frame_header.csps[i].vertical_sampling_factor;
+        huffman_decoded_jpeg_component_t* component = &result->components[i];
+
+        // component dimensions are rounded up, as in A.1.1 of T.81.
+        const int component_x = ((jpeg->frame_header.samples_per_line * H) + (result->H_max - 1)) /
+                                result->H_max;
+        const int component_y = ((jpeg->frame_header.number_of_lines * V) + (result->V_max - 1)) /
+                                result->V_max;
+        component->width_in_blocks  = (component_x + (8 - 1)) / 8;
+        component->height_in_blocks = (component_y + (8 - 1)) / 8;
+
+        // an interleaved scan codes whole MCUs, which can reach past the component's edge.
+        if (jpeg->frame_header.num_components == 1) {
+            component->blocks_per_line = component->width_in_blocks;
+            component->block_lines     = component->height_in_blocks;
+        } else {
+            component->blocks_per_line = mcus_x * H;
+            component->block_lines     = mcus_y * V;
+        }
 
-        // calculate number of BLOCKs
-        const int blocks_x   = (component_x + (8 - 1)) / 8;
-        const int blocks_y   = (component_y + (8 - 1)) / 8;
-        result->components[i].num_blocks = blocks_x * blocks_y;
-        result->components[i].blocks     = calloc(result->components[i].num_blocks,
-                                                  sizeof(jpeg_block_t));
+        component->num_blocks = component->blocks_per_line * component->block_lines;
+        if (allocate_blocks) {
+            component->blocks = calloc(component->num_blocks, sizeof(jpeg_block_t));
+        }
     }
 
+    result->mcu_map = jpeg_mcu_map_create(jpeg, result);
+
     return result;
 }
 
+huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg_scan_create(const jpeg_image_t* jpeg)
+{
+    return scan_create(jpeg, true);
+}
+
 
 /**
- * The values coded into the file need to be converted as described in tables F.1 and F.2 of T.81.
+ * Number of blocks component c contributes to each MCU.
  */
-static int16_t coded_value_to_coefficient_value(uint16_t coded_value, int bitlen)
+static int mcu_map_component_blocks(const jpeg_mcu_map_t* map, int c)
 {
-    int16_t result = 0;
-    if (bitlen == 0) {
-        return 0;
-    }
-
-    // "split" between negative and positive values happens depending on msb.
-    uint16_t msb = (coded_value & (1 << (bitlen - 1)));
-
-    // once we have the msb, we should delete it.
-    coded_value &= (1 << (bitlen - 1)) - 1;
-
-    if (msb) {
-        int16_t basis = (1 << (bitlen - 1));
-        result = basis + coded_value;
-    } else {
-        int16_t basis = 1 - (1 << bitlen);
-        result = basis + coded_value;
+    int n = 0;
+    for (int k = 0; k < map->blocks_per_mcu; k++) {
+        n += (map->block_component[k] == c);
     }
-
-    return result;
+    return n;
 }
 
 /**
- * Valid return values are in the range [0, 255]. A return value of -1 signifies a decoding error.
+ * Number of MCUs in each restart interval. A scan without restart markers is a single interval.
  */
-static int decode_one_huffman(const jpeg_huffman_table_t* htable, bit_dispenser_t* bd)
+static int mcus_per_interval(const jpeg_image_t* jpeg, const jpeg_mcu_map_t* map)
 {
-    // dc block decode
-    uint16_t huff_reg = 0;
-    int num_bits_shifted = 0;
-    uint16_t min_exempt_value = 0;
-    uint16_t cumsum = 0;
-    int huffman_decode = -1;
-
-    while ((num_bits_shifted < 16) && (huffman_decode == -1) && (!bit_dispenser_empty(bd))) {
-        // shift in new bit.
-        bit_dispenser_dispense_u16(&huff_reg, 1, bd);
-
-        // update tree tracking
-        min_exempt_value <<= 1;
-        min_exempt_value += htable->number_of_codes_with_length[num_bits_shifted];
-        cumsum += htable->number_of_codes_with_length[num_bits_shifted];
+    return (jpeg->restart_interval != 0) ? jpeg->restart_interval : map->num_mcus;
+}
 
-        num_bits_shifted++;
+uint32_t huffman_decoded_jpeg_scan_num_intervals(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                 const jpeg_image_t* jpeg)
+{
+    const jpeg_mcu_map_t* map = decoded_scan->mcu_map;
+    const int interval_mcus = mcus_per_interval(jpeg, map);
+    return (map->num_mcus + interval_mcus - 1) / interval_mcus;
+}
 
-        // check
-        if (huff_reg < min_exempt_value) {
-            int dist_from_end = min_exempt_value - huff_reg;
-            huffman_decode = htable->huffman_codes[cumsum - dist_from_end];
+/**
+ * Copies the DC values of component c in MCUs [first_mcu, end_mcu) out of its plane into dc, in
+ * coding order.
+ */
+static void dc_plane_gather(const huffman_decoded_jpeg_scan_t* decoded_scan, int c, int first_mcu,
+                            int end_mcu, int16_t* dc)
+{
+    const jpeg_mcu_map_t* map = decoded_scan->mcu_map;
+    const jpeg_block_t* blocks = decoded_scan->components[c].blocks;
+    const uint32_t* block_index = &map->block_index[first_mcu * map->blocks_per_mcu];
+    for (int i = first_mcu; i < end_mcu; i++, block_index += map->blocks_per_mcu) {
+        for (int k = 0; k < map->blocks_per_mcu; k++) {
+            if (map->block_component[k] == c) {
+                *dc++ = blocks[block_index[k]].dc_value;
+            }
         }
     }
-
-    return huffman_decode;
 }
 
-
 /**
- * NB: this assumes that components are in the same order in the scan as they are in the
- * frame header, which is probably true most of the time.
+ * Writes component c's DC values, given in coding order, to a plane of one value per block laid out
+ * like the component's block plane.
  */
-huffman_decoded_jpeg_scan_t* jpeg_image_huffman_decode(const jpeg_image_t* jpeg)
+static void dc_values_scatter(const jpeg_mcu_map_t* map, int c, const int16_t* dc, int16_t* plane)
 {
-    // allocate new structure
-    huffman_decoded_jpeg_scan_t* result = huffman_decoded_jpeg_scan_create(jpeg);
-
-    //
-    bit_dispenser_t* bd = bit_dispenser_create(jpeg->scan.entropy_coded_segments[0]->data,
-                                               jpeg->scan.entropy_coded_segments[0]->size);
-
-    // num of MCUs is the min of the number of blocks
-    int num_mcus = result->components[0].num_blocks;
-    for (int i = 1; i < jpeg->frame_header.num_components; i++) {
-        if (result->components[i].num_blocks < num_mcus) {
-            num_mcus = result->components[i].num_blocks;
+    const uint32_t* block_index = map->block_index;
+    for (int i = 0; i < map->num_mcus; i++, block_index += map->blocks_per_mcu) {
+        for (int k = 0; k < map->blocks_per_mcu; k++) {
+            if (map->block_component[k] == c) {
+                plane[block_index[k]] = *dc++;
+            }
         }
     }
-    //printf("jpeg decoding trace:    %i MCUs in image.\n", num_mcus);
-
-    for (int i = 0; i < num_mcus; i++) {
-        //printf("jpeg decoding trace:    decoding MCU %i.\n", i);
-        for (int j = 0; j < jpeg->frame_header.num_components; j++) {
-            //printf("jpeg decoding trace:    decoding component %i of MCU %i.\n", j, i);
-            int blocks_per_mcu = (jpeg->frame_header.csps[j].horizontal_sampling_factor *
-                                  jpeg->frame_header.csps[j].vertical_sampling_factor);
-            int block_idx      = blocks_per_mcu * i;
-
-            uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
-            int dc_huff_idx = (huff_tables >> 4) & 0x0f;
-            int ac_huff_idx = (huff_tables >> 0) & 0x0f;
-            const jpeg_huffman_table_t* dc_huff_table = &(jpeg->dc_huffman_tables[dc_huff_idx]);
-            const jpeg_huffman_table_t* ac_huff_table = &(jpeg->ac_huffman_tables[ac_huff_idx]);
-
-            // huffman decode!
-            for (int k = 0; k < blocks_per_mcu; k++) {
-                //printf("jpeg decoding trace:    decoding block %i of component %i of MCU %i.\n",
-                //k, j, i);
-                jpeg_block_t* target_block = &result->components[j].blocks[block_idx + k];
-
-                // DC value
-                int dc_raw_length = decode_one_huffman(dc_huff_table, bd);
-                if (dc_raw_length == -1) {
-                    //printf("jpeg decoding error:    error decoding DC huffman value.\n");
-                    goto fail_cleanup;
-                }
-
-                // special EOB case
-                if (dc_raw_length == 0) {
-                    //printf("jpeg decoding trace:    DC EOB reached.\n");
-                } else {
-                    //printf("jpeg decoding trace:    Decoding %i bits for DC value.\n", dc_raw_length);
-                    uint16_t dc_raw_value = 0;
-                    bit_dispenser_dispense_u16(&dc_raw_value, dc_raw_length, bd);
-
-                    // TODO: DC differential decoding.
-                    target_block->dc_value = coded_value_to_coefficient_value(dc_raw_value,
-                                                                              dc_raw_length);
-                    //printf("jpeg decoding trace:    Value %04x (length %i) decoded to %i.\n",
-                    //dc_raw_value, dc_raw_length, target_block->dc_value);
-                }
-
-                // ac block decode
-                int ac_values_decoded = 0;
-                while (ac_values_decoded < 63) {
-                    // read in RRRRSSSS byte as described in section F.1.2.2.1 of T.81.
-                    int ac_huffman_decode = decode_one_huffman(ac_huff_table, bd);
-                    if (ac_huffman_decode == -1) {
-                        printf("jpeg decoding error:    error decoding AC huffman value.\n");
-                        goto fail_cleanup;
-                    }
-                    uint8_t rrrrssss = (uint8_t)ac_huffman_decode;
-                    //printf("jpeg decoding trace:    rrrrssss = %02x.\n", rrrrssss);
-
-                    // special EOB case
-                    if (rrrrssss == 0x00) {
-                        //printf("jpeg decoding trace:    AC EOB reached.\n");
-                        break;
-                    }
-
-                    uint8_t zeros_before_next_coeff = (rrrrssss >> 4) & 0x0f;
-                    //printf("jpeg decoding trace:    %i RLE'd zeros in AC table.\n",
-                    //zeros_before_next_coeff);
-
-                    for (int i = 0; i < zeros_before_next_coeff; i++) {
-                        target_block->ac_values[ac_values_decoded] = 0;
-                        ac_values_decoded += 1;
-                    }
+}
 
-                    // read next AC coefficient
-                    uint8_t ac_coefficient_len = (rrrrssss >> 0) & 0x0f;
-                    //printf("jpeg decoding trace:    Decoding %i bits.\n", ac_coefficient_len);
-                    uint16_t ac_raw_value = 0;
-                    bit_dispenser_dispense_u16(&ac_raw_value, ac_coefficient_len, bd);
-                    int ac_val = coded_value_to_coefficient_value(ac_raw_value, ac_coefficient_len);
-                    target_block->ac_values[ac_values_decoded] = ac_val;
-                    //printf("jpeg decoding trace:    Value %04x (length %i) decoded to %i.\n",
-                    //ac_raw_value, ac_coefficient_len, ac_val);
-                    ac_values_decoded += 1;
-                }
-                //printf("jpeg decoding trace:    ========================================\n");
+/**
+ * Inverse of dc_plane_gather.
+ */
+static void dc_plane_scatter(huffman_decoded_jpeg_scan_t* decoded_scan, int c, int first_mcu,
+                             int end_mcu, const int16_t* dc)
+{
+    const jpeg_mcu_map_t* map = decoded_scan->mcu_map;
+    jpeg_block_t* blocks = decoded_scan->components[c].blocks;
+    const uint32_t* block_index = &map->block_index[first_mcu * map->blocks_per_mcu];
+    for (int i = first_mcu; i < end_mcu; i++, block_index += map->blocks_per_mcu) {
+        for (int k = 0; k < map->blocks_per_mcu; k++) {
+            if (map->block_component[k] == c) {
+                blocks[block_index[k]].dc_value = *dc++;
             }
         }
     }
-
-    return result;
-
-fail_cleanup:
-    huffman_decoded_jpeg_scan_destroy(result);
-    bit_dispenser_destroy(bd);
-    return NULL;
 }
 
 /**
- * The values coded into the file need to be converted as described in tables F.1 and F.2 of T.81.
+ * Turns n DC differences into absolute DC values in place, as in F.2.1.3.1 of T.81. The
+ * predictor goes back to 0 every segment_len values, which is how restart intervals look from
+ * the point of view of a single component.
  *
- * @param[in]     coefficient_value
- * @param[out]    bitlen              Bitlength of the returned coded value. Should be in [0, 11]
+ * The sums are allowed to wrap in 16 bits; every absolute value fits, so the results are exact.
  */
-static uint16_t coefficient_value_to_coded_value(int16_t coefficient_value, int* bitlen)
+static void dc_prefix_sum(int16_t* dc, uint32_t n, uint32_t segment_len)
 {
-    uint16_t result = 0;
-    if (coefficient_value == 0) {
-        *bitlen = 0;
-        return 0;
+    for (uint32_t start = 0; start < n; start += segment_len) {
+        const uint32_t end = ((n - start) < segment_len) ? n : (start + segment_len);
+        uint32_t i = start;
+        int16_t pred = 0;
+#ifdef __SSE2__
+        __m128i carry = _mm_setzero_si128();
+        for (; (i + 8) <= end; i += 8) {
+            __m128i x = _mm_loadu_si128((const __m128i*)&dc[i]);
+            x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+            x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi16(x, carry);
+            _mm_storeu_si128((__m128i*)&dc[i], x);
+
+            // broadcast the last lane as the carry into the next 8 values.
+            carry = _mm_shufflehi_epi16(x, 0xff);
+            carry = _mm_unpackhi_epi64(carry, carry);
+        }
+        pred = (i > start) ? dc[i - 1] : 0;
+#endif
+        for (; i < end; i++) {
+            pred += dc[i];
+            dc[i] = pred;
+        }
     }
+}
 
-    // there's definately a faster way to do this, but I didn't want to prematurely optimize.
-    // look into __builtin_ffs when the time comes.
-    int min_less1 = 0;
-    int max       = 1;
-    *bitlen = 1;
-    int16_t coeff_abs = (coefficient_value < 0) ? (-coefficient_value) : (coefficient_value);
-    for (; *bitlen < 13; (*bitlen)++) {
-        if ((coeff_abs > min_less1) && (coeff_abs <= max)) {
-            break;
+/**
+ * Inverse of dc_prefix_sum: writes the DC differences of the n absolute values in dc to diff.
+ */
+static void dc_difference(const int16_t* dc, int16_t* diff, uint32_t n, uint32_t segment_len)
+{
+    for (uint32_t start = 0; start < n; start += segment_len) {
+        const uint32_t end = ((n - start) < segment_len) ? n : (start + segment_len);
+        diff[start] = dc[start];
+        uint32_t i = start + 1;
+#ifdef __SSE2__
+        for (; (i + 8) <= end; i += 8) {
+            const __m128i cur = _mm_loadu_si128((const __m128i*)&dc[i]);
+            const __m128i prev = _mm_loadu_si128((const __m128i*)&dc[i - 1]);
+            _mm_storeu_si128((__m128i*)&diff[i], _mm_sub_epi16(cur, prev));
+        }
+#endif
+        for (; i < end; i++) {
+            diff[i] = dc[i] - dc[i - 1];
         }
-        min_less1 = max;
-        max <<= 1;
-        max |= 1;
     }
+}
 
-    if (*bitlen == 13) {
-        return 0;
+/**
+ * Returns a newly allocated array of component c's DC differences in coding order, which is what
+ * the entropy coder needs. If intervals isn't NULL, only the restart intervals set in it are
+ * filled in.
+ */
+static int16_t* component_dc_differences(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                         const jpeg_image_t* jpeg, int c, const bool* intervals)
+{
+    const jpeg_mcu_map_t* map = decoded_scan->mcu_map;
+    const int per_mcu = mcu_map_component_blocks(map, c);
+    const uint32_t n = map->num_mcus * per_mcu;
+    const int interval_mcus = mcus_per_interval(jpeg, map);
+
+    int16_t* dc = malloc(n * sizeof(int16_t));
+    int16_t* diff = malloc(n * sizeof(int16_t));
+    for (int first = 0; first < map->num_mcus; first += interval_mcus) {
+        if ((intervals != NULL) && !intervals[first / interval_mcus]) {
+            continue;
+        }
+        const int end = ((map->num_mcus - first) < interval_mcus) ? map->num_mcus :
+                                                                    (first + interval_mcus);
+        const uint32_t offset = first * per_mcu;
+        const uint32_t segment_len = (end - first) * per_mcu;
+        dc_plane_gather(decoded_scan, c, first, end, &dc[offset]);
+        dc_difference(&dc[offset], &diff[offset], segment_len, segment_len);
     }
+    free(dc);
 
-    if (coefficient_value < 0) {
-        result = coefficient_value + max;
+    return diff;
+}
+
+
+const uint8_t jpeg_zigzag_to_natural[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+const uint8_t jpeg_natural_to_zigzag[64] = {
+     0,  1,  5,  6, 14, 15, 27, 28,
+     2,  4,  7, 13, 16, 26, 29, 42,
+     3,  8, 12, 17, 25, 30, 41, 43,
+     9, 11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54,
+    20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61,
+    35, 36, 48, 49, 57, 58, 62, 63
+};
+
+// the decoder writes coefficient k of the coded order to index k of a zigzag order block.
+static const uint8_t zigzag_to_zigzag[64] = {
+     0,  1,  2,  3,  4,  5,  6,  7,
+     8,  9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23,
+    24, 25, 26, 27, 28, 29, 30, 31,
+    32, 33, 34, 35, 36, 37, 38, 39,
+    40, 41, 42, 43, 44, 45, 46, 47,
+    48, 49, 50, 51, 52, 53, 54, 55,
+    56, 57, 58, 59, 60, 61, 62, 63
+};
+
+/**
+ * dst[k] = src[source_index[k]] for all 64 coefficients.
+ */
+static void block_permute(const jpeg_block_t* src, jpeg_block_t* dst, const uint8_t* source_index)
+{
+    const int16_t* in = (const int16_t*)src;
+    int16_t* out = (int16_t*)dst;
+    for (int k = 0; k < 64; k++) {
+        out[k] = in[source_index[k]];
+    }
+}
+
+void jpeg_block_zigzag_to_natural(const jpeg_block_t* src, jpeg_block_t* dst)
+{
+    block_permute(src, dst, jpeg_natural_to_zigzag);
+}
+
+void jpeg_block_natural_to_zigzag(const jpeg_block_t* src, jpeg_block_t* dst)
+{
+    block_permute(src, dst, jpeg_zigzag_to_natural);
+}
+
+#ifdef JPEG_SSSE3_SHUFFLES
+/**
+ * One pshufb of a block permutation: coefficient register s of the source block is shuffled with
+ * mask and or-ed into register r of the result, eight coefficients to a register. Mask bytes of
+ * 128 zero their lane.
+ */
+typedef struct block_shuffle
+{
+    uint8_t r;
+    uint8_t s;
+    uint8_t mask[16];
+} block_shuffle_t;
+
+// generated from jpeg_natural_to_zigzag and jpeg_zigzag_to_natural; only the (r, s) pairs that
+// move at least one coefficient are listed.
+static const block_shuffle_t to_natural_shuffles[36] = {
+    { 0, 0, {   0,   1,   2,   3,  10,  11,  12,  13, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 0, 1, { 128, 128, 128, 128, 128, 128, 128, 128,  12,  13,  14,  15, 128, 128, 128, 128 } },
+    { 0, 3, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   6,   7,   8,   9 } },
+    { 1, 0, {   4,   5,   8,   9,  14,  15, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 1, 1, { 128, 128, 128, 128, 128, 128,  10,  11, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 1, 2, { 128, 128, 128, 128, 128, 128, 128, 128,   0,   1, 128, 128, 128, 128, 128, 128 } },
+    { 1, 3, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   4,   5,  10,  11, 128, 128 } },
+    { 1, 5, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   4,   5 } },
+    { 2, 0, {   6,   7, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 2, 1, { 128, 128,   0,   1,   8,   9, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 2, 2, { 128, 128, 128, 128, 128, 128,   2,   3, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 2, 3, { 128, 128, 128, 128, 128, 128, 128, 128,   2,   3,  12,  13, 128, 128, 128, 128 } },
+    { 2, 5, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   2,   3,   6,   7 } },
+    { 3, 1, {   2,   3,   6,   7, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 3, 2, { 128, 128, 128, 128,   4,   5, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 3, 3, { 128, 128, 128, 128, 128, 128,   0,   1,  14,  15, 128, 128, 128, 128, 128, 128 } },
+    { 3, 5, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   0,   1,   8,   9, 128, 128 } },
+    { 3, 6, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  10,  11 } },
+    { 4, 1, {   4,   5, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 4, 2, { 128, 128,   6,   7,  14,  15, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 4, 4, { 128, 128, 128, 128, 128, 128,   0,   1,  14,  15, 128, 128, 128, 128, 128, 128 } },
+    { 4, 5, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  10,  11, 128, 128, 128, 128 } },
+    { 4, 6, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   8,   9,  12,  13 } },
+    { 5, 2, {   8,   9,  12,  13, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 5, 4, { 128, 128, 128, 128,   2,   3,  12,  13, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 5, 5, { 128, 128, 128, 128, 128, 128, 128, 128,  12,  13, 128, 128, 128, 128, 128, 128 } },
+    { 5, 6, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   6,   7,  14,  15, 128, 128 } },
+    { 5, 7, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   8,   9 } },
+    { 6, 2, {  10,  11, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 6, 4, { 128, 128,   4,   5,  10,  11, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 6, 5, { 128, 128, 128, 128, 128, 128,  14,  15, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 6, 6, { 128, 128, 128, 128, 128, 128, 128, 128,   4,   5, 128, 128, 128, 128, 128, 128 } },
+    { 6, 7, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   0,   1,   6,   7,  10,  11 } },
+    { 7, 4, {   6,   7,   8,   9, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 7, 6, { 128, 128, 128, 128,   0,   1,   2,   3, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 7, 7, { 128, 128, 128, 128, 128, 128, 128, 128,   2,   3,   4,   5,  12,  13,  14,  15 } },
+};
+
+static const block_shuffle_t to_zigzag_shuffles[36] = {
+    { 0, 0, {   0,   1,   2,   3, 128, 128, 128, 128, 128, 128,   4,   5,   6,   7, 128, 128 } },
+    { 0, 1, { 128, 128, 128, 128,   0,   1, 128, 128,   2,   3, 128, 128, 128, 128,   4,   5 } },
+    { 0, 2, { 128, 128, 128, 128, 128, 128,   0,   1, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 1, 0, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   8,   9,  10,  11 } },
+    { 1, 1, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   6,   7, 128, 128, 128, 128 } },
+    { 1, 2, {   2,   3, 128, 128, 128, 128, 128, 128,   4,   5, 128, 128, 128, 128, 128, 128 } },
+    { 1, 3, { 128, 128,   0,   1, 128, 128,   2,   3, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 1, 4, { 128, 128, 128, 128,   0,   1, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 2, 1, {   8,   9, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 2, 2, { 128, 128,   6,   7, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 2, 3, { 128, 128, 128, 128,   4,   5, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 2, 4, { 128, 128, 128, 128, 128, 128,   2,   3, 128, 128, 128, 128, 128, 128,   4,   5 } },
+    { 2, 5, { 128, 128, 128, 128, 128, 128, 128, 128,   0,   1, 128, 128,   2,   3, 128, 128 } },
+    { 2, 6, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   0,   1, 128, 128, 128, 128 } },
+    { 3, 0, { 128, 128, 128, 128, 128, 128,  12,  13,  14,  15, 128, 128, 128, 128, 128, 128 } },
+    { 3, 1, { 128, 128, 128, 128,  10,  11, 128, 128, 128, 128,  12,  13, 128, 128, 128, 128 } },
+    { 3, 2, { 128, 128,   8,   9, 128, 128, 128, 128, 128, 128, 128, 128,  10,  11, 128, 128 } },
+    { 3, 3, {   6,   7, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   8,   9 } },
+    { 4, 4, {   6,   7, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   8,   9 } },
+    { 4, 5, { 128, 128,   4,   5, 128, 128, 128, 128, 128, 128, 128, 128,   6,   7, 128, 128 } },
+    { 4, 6, { 128, 128, 128, 128,   2,   3, 128, 128, 128, 128,   4,   5, 128, 128, 128, 128 } },
+    { 4, 7, { 128, 128, 128, 128, 128, 128,   0,   1,   2,   3, 128, 128, 128, 128, 128, 128 } },
+    { 5, 1, { 128, 128, 128, 128,  14,  15, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 5, 2, { 128, 128,  12,  13, 128, 128,  14,  15, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 5, 3, {  10,  11, 128, 128, 128, 128, 128, 128,  12,  13, 128, 128, 128, 128, 128, 128 } },
+    { 5, 4, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  10,  11, 128, 128, 128, 128 } },
+    { 5, 5, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   8,   9, 128, 128 } },
+    { 5, 6, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,   6,   7 } },
+    { 6, 3, { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  14,  15, 128, 128, 128, 128 } },
+    { 6, 4, { 128, 128, 128, 128, 128, 128, 128, 128,  12,  13, 128, 128,  14,  15, 128, 128 } },
+    { 6, 5, { 128, 128, 128, 128, 128, 128,  10,  11, 128, 128, 128, 128, 128, 128,  12,  13 } },
+    { 6, 6, { 128, 128, 128, 128,   8,   9, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 6, 7, {   4,   5,   6,   7, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 } },
+    { 7, 5, { 128, 128, 128, 128, 128, 128, 128, 128,  14,  15, 128, 128, 128, 128, 128, 128 } },
+    { 7, 6, {  10,  11, 128, 128, 128, 128,  12,  13, 128, 128,  14,  15, 128, 128, 128, 128 } },
+    { 7, 7, { 128, 128,   8,   9,  10,  11, 128, 128, 128, 128, 128, 128,  12,  13,  14,  15 } },
+};
+/**
+ * Applies a shuffle table to n blocks in place. Inlined with a constant table, the loop over the
+ * shuffles unrolls into straight-line pshufb and por with every block held in registers.
+ */
+static inline __attribute__((always_inline, target("ssse3")))
+void blocks_shuffle(jpeg_block_t* blocks, uint32_t n, const block_shuffle_t* shuffles,
+                    const int num_shuffles)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        __m128i* block = (__m128i*)&blocks[i];
+        __m128i in[8];
+        __m128i out[8];
+        for (int r = 0; r < 8; r++) {
+            in[r] = _mm_loadu_si128(&block[r]);
+            out[r] = _mm_setzero_si128();
+        }
+
+#pragma GCC unroll 36
+        for (int p = 0; p < num_shuffles; p++) {
+            const __m128i mask = _mm_loadu_si128((const __m128i*)shuffles[p].mask);
+            out[shuffles[p].r] = _mm_or_si128(out[shuffles[p].r],
+                                              _mm_shuffle_epi8(in[shuffles[p].s], mask));
+        }
+
+        for (int r = 0; r < 8; r++) {
+            _mm_storeu_si128(&block[r], out[r]);
+        }
+    }
+}
+
+__attribute__((target("ssse3")))
+static void blocks_shuffle_to_natural(jpeg_block_t* blocks, uint32_t n)
+{
+    blocks_shuffle(blocks, n, to_natural_shuffles,
+                   sizeof(to_natural_shuffles) / sizeof(to_natural_shuffles[0]));
+}
+
+__attribute__((target("ssse3")))
+static void blocks_shuffle_to_zigzag(jpeg_block_t* blocks, uint32_t n)
+{
+    blocks_shuffle(blocks, n, to_zigzag_shuffles,
+                   sizeof(to_zigzag_shuffles) / sizeof(to_zigzag_shuffles[0]));
+}
+
+/**
+ * Returns true if the CPU has SSSE3 and both shuffle tables give the same result as
+ * block_permute() on a block whose coefficients are all different. Worked out once per process.
+ */
+static bool blocks_shuffle_usable()
+{
+    // 0 until it's been worked out, then 1 or -1.
+    static int usable = 0;
+    int state = __atomic_load_n(&usable, __ATOMIC_RELAXED);
+    if (state == 0) {
+        state = -1;
+        if (__builtin_cpu_supports("ssse3")) {
+            jpeg_block_t probe;
+            int16_t* coefficients = (int16_t*)&probe;
+            for (int k = 0; k < 64; k++) {
+                coefficients[k] = (int16_t)((k * 0x0101) ^ 0x5a00);
+            }
+
+            jpeg_block_t simd = probe;
+            jpeg_block_t scalar;
+            blocks_shuffle_to_natural(&simd, 1);
+            block_permute(&probe, &scalar, jpeg_natural_to_zigzag);
+            bool match = (memcmp(&simd, &scalar, sizeof(jpeg_block_t)) == 0);
+
+            blocks_shuffle_to_zigzag(&simd, 1);
+            match = match && (memcmp(&simd, &probe, sizeof(jpeg_block_t)) == 0);
+
+            state = match ? 1 : -1;
+        }
+        __atomic_store_n(&usable, state, __ATOMIC_RELAXED);
+    }
+    return (state > 0);
+}
+#endif
+
+/**
+ * Converts n blocks in place to the given order, with SSSE3 shuffles when the CPU has them.
+ */
+static void blocks_reorder(jpeg_block_t* blocks, uint32_t n, jpeg_coefficient_order_t order)
+{
+#ifdef JPEG_SSSE3_SHUFFLES
+    if (blocks_shuffle_usable()) {
+        if (order == JPEG_COEFFICIENT_ORDER_NATURAL) {
+            blocks_shuffle_to_natural(blocks, n);
+        } else {
+            blocks_shuffle_to_zigzag(blocks, n);
+        }
+        return;
+    }
+#endif
+
+    const uint8_t* source_index = (order == JPEG_COEFFICIENT_ORDER_NATURAL) ?
+                                  jpeg_natural_to_zigzag : jpeg_zigzag_to_natural;
+    for (uint32_t i = 0; i < n; i++) {
+        const jpeg_block_t source = blocks[i];
+        block_permute(&source, &blocks[i], source_index);
+    }
+}
+
+void huffman_decoded_jpeg_scan_reorder(huffman_decoded_jpeg_scan_t* decoded_scan,
+                                       jpeg_coefficient_order_t order)
+{
+    if (decoded_scan->order == order) {
+        return;
+    }
+
+    for (int c = 0; c < 3; c++) {
+        huffman_decoded_jpeg_component_t* component = &decoded_scan->components[c];
+        if (component->blocks != NULL) {
+            blocks_reorder(component->blocks, component->num_blocks, order);
+        }
+    }
+    decoded_scan->order = order;
+}
+
+/**
+ * The values coded into the file need to be converted as described in tables F.1 and F.2 of T.81.
+ */
+static int16_t coded_value_to_coefficient_value(uint16_t coded_value, int bitlen)
+{
+    int16_t result = 0;
+    if (bitlen == 0) {
+        return 0;
+    }
+
+    // "split" between negative and positive values happens depending on msb.
+    uint16_t msb = (coded_value & (1 << (bitlen - 1)));
+
+    // once we have the msb, we should delete it.
+    coded_value &= (1 << (bitlen - 1)) - 1;
+
+    if (msb) {
+        int16_t basis = (1 << (bitlen - 1));
+        result = basis + coded_value;
+    } else {
+        int16_t basis = 1 - (1 << bitlen);
+        result = basis + coded_value;
+    }
+
+    return result;
+}
+
+/**
+ * Codes up to this long are resolved with a single lookup in huffman_lookup_table_t; longer ones,
+ * which are rare in real images, fall back to the canonical code walk of F.2.2.3 of T.81.
+ */
+#define HUFFMAN_LOOKUP_BITS 9
+#define HUFFMAN_FAST_AC_EOB 0x100
+
+/**
+ * Decoding tables for one huffman table, made once per scan.
+ */
+typedef struct huffman_lookup_table
+{
+    // (code length << 8) | symbol for every HUFFMAN_LOOKUP_BITS-bit prefix that starts with a
+    // code no longer than that, and 0 for the others.
+    uint16_t fast[1 << HUFFMAN_LOOKUP_BITS];
+
+    // for AC tables, (value << 16) | (run << 4) | length for every prefix that holds both a code
+    // for a coefficient and all of its magnitude bits, length being the two together, with a ZRL
+    // being a run of 15 before a 0. An EOB is HUFFMAN_FAST_AC_EOB | length. 0 for the others.
+    uint32_t fast_ac[1 << HUFFMAN_LOOKUP_BITS];
+
+    // largest code of each length, or -1 if there are none, and what to add to a code of that
+    // length to get the index of its symbol in huffman_codes.
+    int32_t maxcode[17];
+    int32_t valoffset[17];
+    const uint8_t* huffman_codes;
+} huffman_lookup_table_t;
+
+static void huffman_lookup_table_init(const jpeg_huffman_table_t* htable, bool ac,
+                                      huffman_lookup_table_t* lut)
+{
+    memset(lut->fast, 0, sizeof(lut->fast));
+    lut->huffman_codes = htable->huffman_codes;
+
+    // codes are assigned in canonical order, as in C.2 of T.81.
+    int32_t code = 0;
+    int index = 0;
+    for (int length = 1; length <= 16; length++) {
+        const int count = htable->number_of_codes_with_length[length - 1];
+        lut->valoffset[length] = index - code;
+        lut->maxcode[length] = (count > 0) ? (code + count - 1) : -1;
+        for (int i = 0; i < count; i++, code++, index++) {
+            // a table with more codes than fit in their lengths is broken; its extra codes are
+            // left for the slow path to reject.
+            if ((length <= HUFFMAN_LOOKUP_BITS) && (code < (1 << length)) && (index < 256)) {
+                const int shift = HUFFMAN_LOOKUP_BITS - length;
+                const uint16_t entry = (length << 8) | htable->huffman_codes[index];
+                for (int j = code << shift; j < ((code + 1) << shift); j++) {
+                    lut->fast[j] = entry;
+                }
+            }
+        }
+        code <<= 1;
+    }
+
+    memset(lut->fast_ac, 0, sizeof(lut->fast_ac));
+    for (int prefix = 0; ac && (prefix < (1 << HUFFMAN_LOOKUP_BITS)); prefix++) {
+        const int length = lut->fast[prefix] >> 8;
+        const int run = (lut->fast[prefix] >> 4) & 0x0f;
+        const int size = lut->fast[prefix] & 0x0f;
+        if ((length == 0) || ((length + size) > HUFFMAN_LOOKUP_BITS)) {
+            continue;
+        }
+        if (size == 0) {
+            if (run == 0) {
+                lut->fast_ac[prefix] = HUFFMAN_FAST_AC_EOB | length;
+            } else if (run == 15) {
+                lut->fast_ac[prefix] = (15 << 4) | length;
+            }
+            continue;
+        }
+        const uint16_t magnitude = (prefix >> (HUFFMAN_LOOKUP_BITS - length - size)) &
+                                   ((1 << size) - 1);
+        const int16_t value = coded_value_to_coefficient_value(magnitude, size);
+        lut->fast_ac[prefix] = ((uint32_t)(uint16_t)value << 16) | (run << 4) | (length + size);
+    }
+}
+
+/**
+ * Valid return values are in the range [0, 255]. A return value of -1 signifies a decoding error.
+ *
+ * Leaves at least 41 bits in bd's buffer, enough for the magnitude bits that follow the symbol.
+ */
+static inline int decode_one_huffman(const huffman_lookup_table_t* lut, bit_dispenser_t* bd)
+{
+    bit_dispenser_refill(bd);
+
+    int length;
+    int symbol;
+    const uint16_t entry = lut->fast[bit_dispenser_peek(bd, HUFFMAN_LOOKUP_BITS)];
+    if (entry != 0) {
+        length = entry >> 8;
+        symbol = entry & 0xff;
+    } else {
+        int32_t code = 0;
+        for (length = HUFFMAN_LOOKUP_BITS + 1; length <= 16; length++) {
+            code = bit_dispenser_peek(bd, length);
+            if (code <= lut->maxcode[length]) {
+                break;
+            }
+        }
+        if (length > 16) {
+            return -1;
+        }
+        const int index = code + lut->valoffset[length];
+        if ((index < 0) || (index > 255)) {
+            return -1;
+        }
+        symbol = lut->huffman_codes[index];
+    }
+
+    // the zeros past the end of the data can't finish a code.
+    if ((bd->curidx > bd->datalen) && (bit_dispenser_bits_left(bd) < length)) {
+        return -1;
+    }
+    bit_dispenser_consume(bd, length);
+    return symbol;
+}
+
+/**
+ * Takes the n magnitude bits that follow a symbol decoded by decode_one_huffman() from bd.
+ */
+static inline uint16_t dispense_magnitude(int n, bit_dispenser_t* bd)
+{
+    if (n == 0) {
+        return 0;
+    }
+    const uint16_t bits = bit_dispenser_peek(bd, n);
+    bit_dispenser_consume(bd, n);
+    return bits;
+}
+
+/**
+ * Huffman decodes one block, writing its DC difference to dc_diff and its AC coefficients to
+ * target_block, in the order given by coefficient_index. If target_block is NULL, AC symbols are
+ * still decoded to stay in step with the bitstream, but their magnitude bits are skipped over.
+ *
+ * Returns 0 on success, or -1 on a decoding error.
+ */
+static inline __attribute__((always_inline))
+int decode_block(const huffman_lookup_table_t* dc_huff_table,
+                 const huffman_lookup_table_t* ac_huff_table, jpeg_block_t* target_block,
+                 const uint8_t* coefficient_index, const coefficient_limits_t* limits,
+                 int16_t* dc_diff, bit_dispenser_t* bd, uint64_t* symbols_decoded)
+{
+    // coefficient k of the coded order goes to coefficients[coefficient_index[k]].
+    int16_t* coefficients = (int16_t*)target_block;
+
+    // DC value
+    int dc_raw_length = decode_one_huffman(dc_huff_table, bd);
+    (*symbols_decoded)++;
+    if (dc_raw_length == -1) {
+        return -1;
+    }
+    if (dc_raw_length > limits->max_dc_bits) {
+        printf("jpeg decoding error:    %i-bit DC difference is too long.\n", dc_raw_length);
+        return -1;
+    }
+
+    // a DC difference of 0 has no magnitude bits.
+    if (dc_raw_length != 0) {
+        const uint16_t dc_raw_value = dispense_magnitude(dc_raw_length, bd);
+
+        *dc_diff = coded_value_to_coefficient_value(dc_raw_value, dc_raw_length);
+    }
+
+    // ac block decode
+    int ac_values_decoded = 0;
+    while (ac_values_decoded < 63) {
+        // most coefficients are short enough to come out of a single lookup, code, magnitude and
+        // all; the zeros past the end of the data take the long way, which checks for them.
+        bit_dispenser_refill(bd);
+        const uint32_t fast = ac_huff_table->fast_ac[bit_dispenser_peek(bd, HUFFMAN_LOOKUP_BITS)];
+        if ((fast != 0) && (bd->curidx <= bd->datalen)) {
+            bit_dispenser_consume(bd, fast & 0x0f);
+            (*symbols_decoded)++;
+            if (fast & HUFFMAN_FAST_AC_EOB) {
+                break;
+            }
+
+            const int run = (fast >> 4) & 0x0f;
+            if ((ac_values_decoded + run) >= 63) {
+                printf("jpeg decoding error:    AC run overflows block.\n");
+                return -1;
+            }
+            if (target_block != NULL) {
+                const uint8_t* index = &coefficient_index[ac_values_decoded + 1];
+                for (int i = 0; i < run; i++) {
+                    coefficients[index[i]] = 0;
+                }
+                coefficients[index[run]] = (int16_t)(fast >> 16);
+            }
+            ac_values_decoded += run + 1;
+            continue;
+        }
+
+        // read in RRRRSSSS byte as described in section F.1.2.2.1 of T.81.
+        int ac_huffman_decode = decode_one_huffman(ac_huff_table, bd);
+        (*symbols_decoded)++;
+        if (ac_huffman_decode == -1) {
+            printf("jpeg decoding error:    error decoding AC huffman value.\n");
+            return -1;
+        }
+        uint8_t rrrrssss = (uint8_t)ac_huffman_decode;
+
+        // special EOB case
+        if (rrrrssss == 0x00) {
+            break;
+        }
+
+        uint8_t zeros_before_next_coeff = (rrrrssss >> 4) & 0x0f;
+
+        if ((ac_values_decoded + zeros_before_next_coeff) >= 63) {
+            printf("jpeg decoding error:    AC run overflows block.\n");
+            return -1;
+        }
+
+        uint8_t ac_coefficient_len = (rrrrssss >> 0) & 0x0f;
+        if (ac_coefficient_len > limits->max_ac_bits) {
+            printf("jpeg decoding error:    %i-bit AC coefficient is too long.\n",
+                   ac_coefficient_len);
+            return -1;
+        }
+        if (target_block == NULL) {
+            dispense_magnitude(ac_coefficient_len, bd);
+            ac_values_decoded += zeros_before_next_coeff + 1;
+            continue;
+        }
+
+        for (int i = 0; i < zeros_before_next_coeff; i++) {
+            coefficients[coefficient_index[ac_values_decoded + 1]] = 0;
+            ac_values_decoded += 1;
+        }
+
+        // read next AC coefficient
+        const uint16_t ac_raw_value = dispense_magnitude(ac_coefficient_len, bd);
+        int ac_val = coded_value_to_coefficient_value(ac_raw_value, ac_coefficient_len);
+        coefficients[coefficient_index[ac_values_decoded + 1]] = ac_val;
+        ac_values_decoded += 1;
+    }
+
+    return 0;
+}
+
+/**
+ * State shared by the MCU loops of huffman_decode_scan_data().
+ */
+typedef struct scan_decoder
+{
+    // decoding tables for each block of an MCU.
+    const huffman_lookup_table_t* dc_huff_tables[JPEG_MAX_BLOCKS_PER_MCU];
+    const huffman_lookup_table_t* ac_huff_tables[JPEG_MAX_BLOCKS_PER_MCU];
+
+    huffman_decoded_jpeg_component_t* components;
+    const uint8_t* coefficient_index;
+    coefficient_limits_t limits;
+    int16_t* dc_cursors[3];
+    uint64_t symbols_decoded;
+} scan_decoder_t;
+
+/**
+ * Decodes MCUs [first_mcu, end_mcu) from bd. Every specialized variant below inlines this with a
+ * constant blocks_per_mcu and block_component, so the compiler can unroll the block loop and
+ * resolve each block's component and tables at compile time.
+ */
+static inline __attribute__((always_inline))
+int decode_mcus(scan_decoder_t* d, const jpeg_mcu_map_t* map, bit_dispenser_t* bd,
+                int first_mcu, int end_mcu, const int blocks_per_mcu,
+                const uint8_t* block_component)
+{
+    int16_t* dc_cursors[3] = { d->dc_cursors[0], d->dc_cursors[1], d->dc_cursors[2] };
+    int retval = 0;
+
+    // the bit reader and the symbol count are worked on in local copies, which the compiler can
+    // keep in registers; through pointers, every coefficient store could alias them.
+    bit_dispenser_t bits = *bd;
+    uint64_t symbols_decoded = d->symbols_decoded;
+
+    const uint32_t* mcu_blocks = &map->block_index[first_mcu * blocks_per_mcu];
+    for (int i = first_mcu; i < end_mcu; i++, mcu_blocks += blocks_per_mcu) {
+        for (int k = 0; k < blocks_per_mcu; k++) {
+            const int j = block_component[k];
+            jpeg_block_t* target_block = (d->components != NULL) ?
+                                         &d->components[j].blocks[mcu_blocks[k]] : NULL;
+            if (decode_block(d->dc_huff_tables[k], d->ac_huff_tables[k], target_block,
+                             d->coefficient_index, &d->limits, dc_cursors[j]++, &bits,
+                             &symbols_decoded)) {
+                retval = -1;
+                goto done;
+            }
+        }
+    }
+
+done:
+    for (int j = 0; j < 3; j++) {
+        d->dc_cursors[j] = dc_cursors[j];
+    }
+    *bd = bits;
+    d->symbols_decoded = symbols_decoded;
+    return retval;
+}
+
+/**
+ * Block to component assignments of the common MCU layouts. 4:4:0 shares 4:2:2's, since the
+ * order of the luma blocks within an MCU is already taken care of by the MCU map.
+ */
+static const uint8_t mcu_layout_gray[1] = { 0 };
+static const uint8_t mcu_layout_444[3] = { 0, 1, 2 };
+static const uint8_t mcu_layout_422[4] = { 0, 0, 1, 2 };
+static const uint8_t mcu_layout_420[6] = { 0, 0, 0, 0, 1, 2 };
+
+typedef enum mcu_layout
+{
+    MCU_LAYOUT_GENERIC = 0,
+    MCU_LAYOUT_GRAY,
+    MCU_LAYOUT_444,
+    MCU_LAYOUT_422,
+    MCU_LAYOUT_420
+} mcu_layout_t;
+
+static bool mcu_map_has_layout(const jpeg_mcu_map_t* map, const uint8_t* layout, int n)
+{
+    return (map->blocks_per_mcu == n) && (memcmp(map->block_component, layout, n) == 0);
+}
+
+/**
+ * Picks the specialized MCU loop that matches map, if there is one.
+ */
+static mcu_layout_t mcu_map_layout(const jpeg_mcu_map_t* map)
+{
+    if (mcu_map_has_layout(map, mcu_layout_gray, sizeof(mcu_layout_gray))) {
+        return MCU_LAYOUT_GRAY;
+    } else if (mcu_map_has_layout(map, mcu_layout_444, sizeof(mcu_layout_444))) {
+        return MCU_LAYOUT_444;
+    } else if (mcu_map_has_layout(map, mcu_layout_422, sizeof(mcu_layout_422))) {
+        return MCU_LAYOUT_422;
+    } else if (mcu_map_has_layout(map, mcu_layout_420, sizeof(mcu_layout_420))) {
+        return MCU_LAYOUT_420;
+    }
+    return MCU_LAYOUT_GENERIC;
+}
+
+static int decode_mcus_gray(scan_decoder_t* d, const jpeg_mcu_map_t* map, bit_dispenser_t* bd,
+                            int first_mcu, int end_mcu)
+{
+    return decode_mcus(d, map, bd, first_mcu, end_mcu, 1, mcu_layout_gray);
+}
+
+static int decode_mcus_444(scan_decoder_t* d, const jpeg_mcu_map_t* map, bit_dispenser_t* bd,
+                           int first_mcu, int end_mcu)
+{
+    return decode_mcus(d, map, bd, first_mcu, end_mcu, 3, mcu_layout_444);
+}
+
+static int decode_mcus_422(scan_decoder_t* d, const jpeg_mcu_map_t* map, bit_dispenser_t* bd,
+                           int first_mcu, int end_mcu)
+{
+    return decode_mcus(d, map, bd, first_mcu, end_mcu, 4, mcu_layout_422);
+}
+
+static int decode_mcus_420(scan_decoder_t* d, const jpeg_mcu_map_t* map, bit_dispenser_t* bd,
+                           int first_mcu, int end_mcu)
+{
+    return decode_mcus(d, map, bd, first_mcu, end_mcu, 6, mcu_layout_420);
+}
+
+static int decode_mcus_generic(scan_decoder_t* d, const jpeg_mcu_map_t* map, bit_dispenser_t* bd,
+                               int first_mcu, int end_mcu)
+{
+    return decode_mcus(d, map, bd, first_mcu, end_mcu, map->blocks_per_mcu, map->block_component);
+}
+
+/**
+ * State of the QM coder's probability estimation state machine, from table D.2 of T.81.
+ */
+typedef struct qm_state
+{
+    uint16_t qe;
+    uint8_t next_lps;
+    uint8_t next_mps;
+    uint8_t switch_mps;
+} qm_state_t;
+
+// extra state after the 113 of table D.2 that never adapts, for decisions coded with a fixed
+// probability of one half such as the signs of AC coefficients.
+#define QM_FIXED_STATE 113
+
+static const qm_state_t qm_states[QM_FIXED_STATE + 1] = {
+    { 0x5a1d,   1,   1, 1 }, { 0x2586,  14,   2, 0 }, { 0x1114,  16,   3, 0 },
+    { 0x080b,  18,   4, 0 }, { 0x03d8,  20,   5, 0 }, { 0x01da,  23,   6, 0 },
+    { 0x00e5,  25,   7, 0 }, { 0x006f,  28,   8, 0 }, { 0x0036,  30,   9, 0 },
+    { 0x001a,  33,  10, 0 }, { 0x000d,  35,  11, 0 }, { 0x0006,   9,  12, 0 },
+    { 0x0003,  10,  13, 0 }, { 0x0001,  12,  13, 0 }, { 0x5a7f,  15,  15, 1 },
+    { 0x3f25,  36,  16, 0 }, { 0x2cf2,  38,  17, 0 }, { 0x207c,  39,  18, 0 },
+    { 0x17b9,  40,  19, 0 }, { 0x1182,  42,  20, 0 }, { 0x0cef,  43,  21, 0 },
+    { 0x09a1,  45,  22, 0 }, { 0x072f,  46,  23, 0 }, { 0x055c,  48,  24, 0 },
+    { 0x0406,  49,  25, 0 }, { 0x0303,  51,  26, 0 }, { 0x0240,  52,  27, 0 },
+    { 0x01b1,  54,  28, 0 }, { 0x0144,  56,  29, 0 }, { 0x00f5,  57,  30, 0 },
+    { 0x00b7,  59,  31, 0 }, { 0x008a,  60,  32, 0 }, { 0x0068,  62,  33, 0 },
+    { 0x004e,  63,  34, 0 }, { 0x003b,  32,  35, 0 }, { 0x002c,  33,   9, 0 },
+    { 0x5ae1,  37,  37, 1 }, { 0x484c,  64,  38, 0 }, { 0x3a0d,  65,  39, 0 },
+    { 0x2ef1,  67,  40, 0 }, { 0x261f,  68,  41, 0 }, { 0x1f33,  69,  42, 0 },
+    { 0x19a8,  70,  43, 0 }, { 0x1518,  72,  44, 0 }, { 0x1177,  73,  45, 0 },
+    { 0x0e74,  74,  46, 0 }, { 0x0bfb,  75,  47, 0 }, { 0x09f8,  77,  48, 0 },
+    { 0x0861,  78,  49, 0 }, { 0x0706,  79,  50, 0 }, { 0x05cd,  48,  51, 0 },
+    { 0x04de,  50,  52, 0 }, { 0x040f,  50,  53, 0 }, { 0x0363,  51,  54, 0 },
+    { 0x02d4,  52,  55, 0 }, { 0x025c,  53,  56, 0 }, { 0x01f8,  54,  57, 0 },
+    { 0x01a4,  55,  58, 0 }, { 0x0160,  56,  59, 0 }, { 0x0125,  57,  60, 0 },
+    { 0x00f6,  58,  61, 0 }, { 0x00cb,  59,  62, 0 }, { 0x00ab,  61,  63, 0 },
+    { 0x008f,  61,  32, 0 }, { 0x5b12,  65,  65, 1 }, { 0x4d04,  80,  66, 0 },
+    { 0x412c,  81,  67, 0 }, { 0x37d8,  82,  68, 0 }, { 0x2fe8,  83,  69, 0 },
+    { 0x293c,  84,  70, 0 }, { 0x2379,  86,  71, 0 }, { 0x1edf,  87,  72, 0 },
+    { 0x1aa9,  87,  73, 0 }, { 0x174e,  72,  74, 0 }, { 0x1424,  72,  75, 0 },
+    { 0x119c,  74,  76, 0 }, { 0x0f6b,  74,  77, 0 }, { 0x0d51,  75,  78, 0 },
+    { 0x0bb6,  77,  79, 0 }, { 0x0a40,  77,  48, 0 }, { 0x5832,  80,  81, 1 },
+    { 0x4d1c,  88,  82, 0 }, { 0x438e,  89,  83, 0 }, { 0x3bdd,  90,  84, 0 },
+    { 0x34ee,  91,  85, 0 }, { 0x2eae,  92,  86, 0 }, { 0x299a,  93,  87, 0 },
+    { 0x2516,  86,  71, 0 }, { 0x5570,  88,  89, 1 }, { 0x4ca9,  95,  90, 0 },
+    { 0x44d9,  96,  91, 0 }, { 0x3e22,  97,  92, 0 }, { 0x3824,  99,  93, 0 },
+    { 0x32b4,  99,  94, 0 }, { 0x2e17,  93,  86, 0 }, { 0x56a8,  95,  96, 1 },
+    { 0x4f46, 101,  97, 0 }, { 0x47e5, 102,  98, 0 }, { 0x41cf, 103,  99, 0 },
+    { 0x3c3d, 104, 100, 0 }, { 0x375e,  99,  93, 0 }, { 0x5231, 105, 102, 0 },
+    { 0x4c0f, 106, 103, 0 }, { 0x4639, 107, 104, 0 }, { 0x415e, 103,  99, 0 },
+    { 0x5627, 105, 106, 1 }, { 0x50e7, 108, 107, 0 }, { 0x4b85, 109, 103, 0 },
+    { 0x5597, 110, 109, 0 }, { 0x504f, 111, 107, 0 }, { 0x5a10, 110, 111, 1 },
+    { 0x5522, 112, 109, 0 }, { 0x59eb, 112, 111, 1 }, { 0x5a1d, 113, 113, 0 }
+};
+
+/**
+ * QM decoder for one entropy coded segment, as in D.2 of T.81.
+ *
+ * Statistics bins are a byte each: the index of the bin's state in the low 7 bits and its more
+ * probable symbol in the top bit. Reading past the end of the segment yields zeros, which is what
+ * the standard has a decoder do when it runs into a marker.
+ */
+typedef struct qm_decoder
+{
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t pos;
+
+    // code register, interval size, and the number of bits left in the code register's low byte.
+    uint32_t c;
+    uint32_t a;
+    int ct;
+} qm_decoder_t;
+
+static void qm_decoder_init(qm_decoder_t* qm, const uint8_t* data, uint32_t size)
+{
+    qm->data = data;
+    qm->size = size;
+    qm->pos = 0;
+
+    // the first decision reads two bytes into the code register before anything else.
+    qm->c = 0;
+    qm->a = 0;
+    qm->ct = -16;
+}
+
+/**
+ * Decodes one binary decision with the statistics in bin, updating them.
+ */
+static inline int qm_decode(qm_decoder_t* qm, uint8_t* bin)
+{
+    // renormalization and byte input, D.2.6 of T.81.
+    while (qm->a < 0x8000) {
+        if (--qm->ct < 0) {
+            const uint32_t byte = (qm->pos < qm->size) ? qm->data[qm->pos++] : 0;
+            qm->c = (qm->c << 8) | byte;
+            qm->ct += 8;
+            if ((qm->ct < 0) && (++qm->ct == 0)) {
+                // both initial bytes are in; this makes A 0x10000 once it's shifted below.
+                qm->a = 0x8000;
+            }
+        }
+        qm->a <<= 1;
+    }
+
+    // decoding and probability estimation, D.2.4 and D.2.5, with the conditional exchanges that
+    // swap the meaning of the two sub-intervals whenever the LPS one is the larger.
+    const uint8_t sv = *bin;
+    const qm_state_t* state = &qm_states[sv & 0x7f];
+    const uint8_t after_mps = (sv & 0x80) | state->next_mps;
+    const uint8_t after_lps = ((sv & 0x80) ^ (state->switch_mps << 7)) | state->next_lps;
+    const int mps = sv >> 7;
+
+    qm->a -= state->qe;
+    const uint32_t boundary = qm->a << qm->ct;
+    if (qm->c >= boundary) {
+        qm->c -= boundary;
+        const bool exchange = (qm->a < state->qe);
+        qm->a = state->qe;
+        *bin = exchange ? after_mps : after_lps;
+        return exchange ? mps : !mps;
+    } else if (qm->a < 0x8000) {
+        const bool exchange = (qm->a < state->qe);
+        *bin = exchange ? after_lps : after_mps;
+        return exchange ? !mps : mps;
+    }
+
+    return mps;
+}
+
+/**
+ * State shared by the MCU loop of arithmetic_decode_scan_data().
+ */
+typedef struct arithmetic_decoder
+{
+    qm_decoder_t qm;
+    const uint8_t* coefficient_index;
+    coefficient_limits_t limits;
+    uint64_t symbols_decoded;
+
+    // statistics bins of every conditioning table, which start over with each restart interval.
+    uint8_t dc_stats[4][64];
+    uint8_t ac_stats[4][256];
+    uint8_t fixed_bin;
+
+    // for every component: the conditioning tables that the scan selects, their parameters, and
+    // the DC context that its previous block left behind.
+    int dc_table[3];
+    int ac_table[3];
+    int dc_L[3];
+    int dc_U[3];
+    int ac_K[3];
+    int dc_context[3];
+} arithmetic_decoder_t;
+
+/**
+ * Decodes a DC difference, as in F.2.4.1 of T.81. Returns 0 on success, or -1 on a decoding
+ * error.
+ */
+static int arithmetic_decode_dc(arithmetic_decoder_t* d, int j, int16_t* dc_diff)
+{
+    uint8_t* stats = d->dc_stats[d->dc_table[j]];
+    uint8_t* st = &stats[d->dc_context[j]];
+    d->symbols_decoded++;
+
+    if (!qm_decode(&d->qm, st)) {
+        d->dc_context[j] = 0;
+        *dc_diff = 0;
+        return 0;
+    }
+
+    const int sign = qm_decode(&d->qm, st + 1);
+    st += 2 + sign;
+
+    // magnitude category, then the bits below its leading one.
+    int m = qm_decode(&d->qm, st);
+    if (m != 0) {
+        st = &stats[20];
+        while (qm_decode(&d->qm, st)) {
+            m <<= 1;
+            if (m == (1 << d->limits.max_dc_bits)) {
+                printf("jpeg decoding error:    DC difference is too long.\n");
+                return -1;
+            }
+            st++;
+        }
+    }
+
+    // the next block of this component is conditioned on how large this difference is,
+    // F.1.4.4.1.2.
+    if (m < ((1 << d->dc_L[j]) >> 1)) {
+        d->dc_context[j] = 0;
+    } else if (m > ((1 << d->dc_U[j]) >> 1)) {
+        d->dc_context[j] = 12 + (sign * 4);
+    } else {
+        d->dc_context[j] = 4 + (sign * 4);
+    }
+
+    int v = m;
+    st += 14;
+    while (m >>= 1) {
+        if (qm_decode(&d->qm, st)) {
+            v |= m;
+        }
+    }
+    v += 1;
+    *dc_diff = sign ? -v : v;
+
+    return 0;
+}
+
+/**
+ * Decodes the AC coefficients of a block into target_block, in the order given by
+ * d->coefficient_index, as in F.2.4.2 of T.81. If target_block is NULL they're decoded only to
+ * stay in step with the data.
+ *
+ * Returns 0 on success, or -1 on a decoding error.
+ */
+static int arithmetic_decode_ac(arithmetic_decoder_t* d, int j, jpeg_block_t* target_block)
+{
+    int16_t* coefficients = (int16_t*)target_block;
+    uint8_t* stats = d->ac_stats[d->ac_table[j]];
+
+    int k = 0;
+    while (k < 63) {
+        uint8_t* st = &stats[3 * k];
+        d->symbols_decoded++;
+        if (qm_decode(&d->qm, st)) {
+            // EOB
+            break;
+        }
+
+        // zeros up to the next nonzero coefficient.
+        while (1) {
+            k++;
+            if (qm_decode(&d->qm, st + 1)) {
+                break;
+            }
+            if (target_block != NULL) {
+                coefficients[d->coefficient_index[k]] = 0;
+            }
+            st += 3;
+            if (k >= 63) {
+                printf("jpeg decoding error:    AC run overflows block.\n");
+                return -1;
+            }
+        }
+
+        const int sign = qm_decode(&d->qm, &d->fixed_bin);
+        st += 2;
+
+        int m = qm_decode(&d->qm, st);
+        if ((m != 0) && qm_decode(&d->qm, st)) {
+            m <<= 1;
+            st = &stats[(k <= d->ac_K[j]) ? 189 : 217];
+            while (qm_decode(&d->qm, st)) {
+                m <<= 1;
+                if (m == (1 << d->limits.max_ac_bits)) {
+                    printf("jpeg decoding error:    AC coefficient is too long.\n");
+                    return -1;
+                }
+                st++;
+            }
+        }
+
+        int v = m;
+        st += 14;
+        while (m >>= 1) {
+            if (qm_decode(&d->qm, st)) {
+                v |= m;
+            }
+        }
+        v += 1;
+        if (target_block != NULL) {
+            coefficients[d->coefficient_index[k]] = sign ? -v : v;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Same as huffman_decode_scan_data(), for arithmetic coded frames. The DAC conditioning stored in
+ * jpeg takes the place of the huffman tables.
+ */
+static int arithmetic_decode_scan_data(const jpeg_image_t* jpeg, const jpeg_mcu_map_t* map,
+                                       const bool* intervals,
+                                       huffman_decoded_jpeg_component_t* components,
+                                       jpeg_coefficient_order_t order,
+                                       int16_t* const* dc_diffs, uint64_t* symbols_decoded)
+{
+    arithmetic_decoder_t d = { .symbols_decoded = 0 };
+    d.coefficient_index = (order == JPEG_COEFFICIENT_ORDER_NATURAL) ? jpeg_zigzag_to_natural :
+                                                                      zigzag_to_zigzag;
+    coefficient_limits_for_frame(jpeg, &d.limits);
+
+    int16_t* dc_cursors[3] = { NULL, NULL, NULL };
+    int per_mcu[3];
+    for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+        const uint8_t tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
+        d.dc_table[j] = (tables >> 4) & 0x03;
+        d.ac_table[j] = (tables >> 0) & 0x03;
+        d.dc_L[j] = jpeg->arithmetic_dc_conditioning[d.dc_table[j]] & 0x0f;
+        d.dc_U[j] = jpeg->arithmetic_dc_conditioning[d.dc_table[j]] >> 4;
+        d.ac_K[j] = jpeg->arithmetic_ac_conditioning[d.ac_table[j]];
+        dc_cursors[j] = dc_diffs[j];
+        per_mcu[j] = mcu_map_component_blocks(map, j);
+    }
+
+    // every restart interval is in its own entropy coded segment, and starts from fresh
+    // statistics.
+    const int interval_mcus = mcus_per_interval(jpeg, map);
+    for (int first = 0; first < map->num_mcus; first += interval_mcus) {
+        const int ecs_idx = first / interval_mcus;
+        const int end = ((map->num_mcus - first) < interval_mcus) ? map->num_mcus :
+                                                                    (first + interval_mcus);
+        if (ecs_idx >= jpeg->scan.num_ecs) {
+            printf("jpeg decoding error:    missing restart interval %i.\n", ecs_idx);
+            return -1;
+        }
+
+        if ((intervals != NULL) && !intervals[ecs_idx]) {
+            for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+                dc_cursors[j] += (end - first) * per_mcu[j];
+            }
+            continue;
+        }
+
+        const entropy_coded_segment_t* ecs = jpeg->scan.entropy_coded_segments[ecs_idx];
+        qm_decoder_init(&d.qm, ecs->data, ecs->size);
+        memset(d.dc_stats, 0, sizeof(d.dc_stats));
+        memset(d.ac_stats, 0, sizeof(d.ac_stats));
+        d.fixed_bin = QM_FIXED_STATE;
+        memset(d.dc_context, 0, sizeof(d.dc_context));
+
+        const uint32_t* mcu_blocks = &map->block_index[first * map->blocks_per_mcu];
+        for (int i = first; i < end; i++, mcu_blocks += map->blocks_per_mcu) {
+            for (int k = 0; k < map->blocks_per_mcu; k++) {
+                const int j = map->block_component[k];
+                jpeg_block_t* target_block = (components != NULL) ?
+                                             &components[j].blocks[mcu_blocks[k]] : NULL;
+                if (arithmetic_decode_dc(&d, j, dc_cursors[j]++) ||
+                    arithmetic_decode_ac(&d, j, target_block)) {
+                    *symbols_decoded = d.symbols_decoded;
+                    return -1;
+                }
+            }
+        }
+        *symbols_decoded = d.symbols_decoded;
+    }
+
+    return 0;
+}
+
+/**
+ * Huffman decodes jpeg's entropy coded data in coding order, writing each block's DC difference to
+ * dc_diffs[component] and its AC coefficients to the block that map places it at in components.
+ *
+ * If components is NULL, only the DC differences are kept: AC symbols are still decoded to stay in
+ * step with the bitstream, but their magnitude bits are skipped over. Otherwise the blocks are
+ * written in the given coefficient order.
+ *
+ * If intervals isn't NULL, restart intervals that aren't set in it are skipped entirely.
+ *
+ * NB: this assumes that components are in the same order in the scan as they are in the
+ * frame header, which is probably true most of the time.
+ */
+static int huffman_decode_scan_data(const jpeg_image_t* jpeg, const jpeg_mcu_map_t* map,
+                                    const bool* intervals,
+                                    huffman_decoded_jpeg_component_t* components,
+                                    jpeg_coefficient_order_t order,
+                                    int16_t* const* dc_diffs, uint64_t* symbols_decoded)
+{
+    scan_decoder_t d = { .components = components, .symbols_decoded = 0 };
+    d.coefficient_index = (order == JPEG_COEFFICIENT_ORDER_NATURAL) ? jpeg_zigzag_to_natural :
+                                                                      zigzag_to_zigzag;
+    coefficient_limits_for_frame(jpeg, &d.limits);
+
+    if (!frame_is_supported(&jpeg->frame_header)) {
+        printf("jpeg decoding error:    unsupported frame type %02x with %i-bit samples.\n",
+               jpeg->frame_header.header.segment_marker, jpeg->frame_header.sample_precision);
+        return -1;
+    }
+    if (jpeg_image_is_arithmetic_coded(jpeg)) {
+        return arithmetic_decode_scan_data(jpeg, map, intervals, components, order, dc_diffs,
+                                           symbols_decoded);
+    }
+
+    // make decoding tables for the huffman tables of each block of an MCU once, up front.
+    huffman_lookup_table_t dc_luts[4];
+    huffman_lookup_table_t ac_luts[4];
+    bool dc_lut_made[4] = { false };
+    bool ac_lut_made[4] = { false };
+    for (int k = 0; k < map->blocks_per_mcu; k++) {
+        const int j = map->block_component[k];
+        uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
+        int dc_huff_idx = (huff_tables >> 4) & 0x03;
+        int ac_huff_idx = (huff_tables >> 0) & 0x03;
+        if (!dc_lut_made[dc_huff_idx]) {
+            huffman_lookup_table_init(&jpeg->dc_huffman_tables[dc_huff_idx], false,
+                                      &dc_luts[dc_huff_idx]);
+            dc_lut_made[dc_huff_idx] = true;
+        }
+        if (!ac_lut_made[ac_huff_idx]) {
+            huffman_lookup_table_init(&jpeg->ac_huffman_tables[ac_huff_idx], true,
+                                      &ac_luts[ac_huff_idx]);
+            ac_lut_made[ac_huff_idx] = true;
+        }
+        d.dc_huff_tables[k] = &dc_luts[dc_huff_idx];
+        d.ac_huff_tables[k] = &ac_luts[ac_huff_idx];
+    }
+
+    int per_mcu[3];
+    for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+        d.dc_cursors[j] = dc_diffs[j];
+        per_mcu[j] = mcu_map_component_blocks(map, j);
+    }
+
+    // the MCU loop is picked once per image.
+    int (*decode_interval)(scan_decoder_t*, const jpeg_mcu_map_t*, bit_dispenser_t*, int, int);
+    switch (mcu_map_layout(map)) {
+        case MCU_LAYOUT_GRAY: decode_interval = decode_mcus_gray; break;
+        case MCU_LAYOUT_444:  decode_interval = decode_mcus_444;  break;
+        case MCU_LAYOUT_422:  decode_interval = decode_mcus_422;  break;
+        case MCU_LAYOUT_420:  decode_interval = decode_mcus_420;  break;
+        default:              decode_interval = decode_mcus_generic; break;
+    }
+
+    // every restart interval is in its own entropy coded segment.
+    const int interval_mcus = mcus_per_interval(jpeg, map);
+    for (int first = 0; first < map->num_mcus; first += interval_mcus) {
+        const int ecs_idx = first / interval_mcus;
+        const int end = ((map->num_mcus - first) < interval_mcus) ? map->num_mcus :
+                                                                    (first + interval_mcus);
+        if (ecs_idx >= jpeg->scan.num_ecs) {
+            printf("jpeg decoding error:    missing restart interval %i.\n", ecs_idx);
+            return -1;
+        }
+
+        if ((intervals != NULL) && !intervals[ecs_idx]) {
+            for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+                d.dc_cursors[j] += (end - first) * per_mcu[j];
+            }
+            continue;
+        }
+
+        const entropy_coded_segment_t* ecs = jpeg->scan.entropy_coded_segments[ecs_idx];
+        bit_dispenser_t* bd = bit_dispenser_create(ecs->data, ecs->size);
+        const int retval = decode_interval(&d, map, bd, first, end);
+        bit_dispenser_destroy(bd);
+        *symbols_decoded = d.symbols_decoded;
+        if (retval) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Allocates one DC difference per block of every component, for huffman_decode_scan_data().
+ */
+static void dc_diffs_alloc(const jpeg_image_t* jpeg, const jpeg_mcu_map_t* map,
+                           int16_t* dc_diffs[3])
+{
+    for (int j = 0; j < 3; j++) {
+        dc_diffs[j] = NULL;
+    }
+    for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+        dc_diffs[j] = calloc(map->num_mcus * mcu_map_component_blocks(map, j), sizeof(int16_t));
+    }
+}
+
+/**
+ * Turns component c's DC differences into absolute DC values in place.
+ */
+static void component_dc_prefix_sum(const jpeg_image_t* jpeg, const jpeg_mcu_map_t* map, int c,
+                                    int16_t* dc)
+{
+    const int per_mcu = mcu_map_component_blocks(map, c);
+    const uint32_t n = map->num_mcus * per_mcu;
+    dc_prefix_sum(dc, n, (jpeg->restart_interval != 0) ? (jpeg->restart_interval * per_mcu) : n);
+}
+
+/**
+ * Turns component c's DC differences into absolute values and stores them in decoded_scan, for
+ * the restart intervals set in intervals, or for all of them if it's NULL.
+ */
+static void component_dc_store(const jpeg_image_t* jpeg, huffman_decoded_jpeg_scan_t* decoded_scan,
+                               int c, int16_t* dc, const bool* intervals)
+{
+    const jpeg_mcu_map_t* map = decoded_scan->mcu_map;
+    const int per_mcu = mcu_map_component_blocks(map, c);
+    const int interval_mcus = mcus_per_interval(jpeg, map);
+    for (int first = 0; first < map->num_mcus; first += interval_mcus) {
+        if ((intervals != NULL) && !intervals[first / interval_mcus]) {
+            continue;
+        }
+        const int end = ((map->num_mcus - first) < interval_mcus) ? map->num_mcus :
+                                                                    (first + interval_mcus);
+        int16_t* segment = &dc[first * per_mcu];
+        const uint32_t segment_len = (end - first) * per_mcu;
+        dc_prefix_sum(segment, segment_len, segment_len);
+        dc_plane_scatter(decoded_scan, c, first, end, segment);
+    }
+}
+
+/**
+ * Huffman decodes the restart intervals of jpeg set in intervals, or all of them if it's NULL, into
+ * decoded_scan.
+ */
+static int huffman_decode_blocks(const jpeg_image_t* jpeg, const bool* intervals,
+                                 huffman_decoded_jpeg_scan_t* decoded_scan)
+{
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    uint64_t symbols_decoded = 0;
+
+    if (jpeg->scan.num_ecs == 0) {
+        return -1;
+    }
+
+    // DC differences are collected in coding order and turned into absolute values afterwards, so
+    // the huffman loop doesn't carry the predictors.
+    const jpeg_mcu_map_t* map = decoded_scan->mcu_map;
+    int16_t* dc_diffs[3];
+    dc_diffs_alloc(jpeg, map, dc_diffs);
+    if (huffman_decode_scan_data(jpeg, map, intervals, decoded_scan->components,
+                                 decoded_scan->order, dc_diffs,
+                                 &symbols_decoded)) {
+        for (int j = 0; j < 3; j++) {
+            free(dc_diffs[j]);
+        }
+        return -1;
+    }
+
+    for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+        component_dc_store(jpeg, decoded_scan, j, dc_diffs[j], intervals);
+        free(dc_diffs[j]);
+    }
+
+    if (JPEG_STATS_ENABLED()) {
+        const int interval_mcus = mcus_per_interval(jpeg, map);
+        uint64_t mcus_decoded = 0;
+        for (int first = 0; first < map->num_mcus; first += interval_mcus) {
+            if ((intervals == NULL) || intervals[first / interval_mcus]) {
+                mcus_decoded += ((map->num_mcus - first) < interval_mcus) ?
+                                (map->num_mcus - first) : interval_mcus;
+            }
+        }
+        JPEG_STATS_ADD(symbols_decoded, symbols_decoded);
+        JPEG_STATS_ADD(blocks_decoded, mcus_decoded * map->blocks_per_mcu);
+    }
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_DECODE, t0);
+    return 0;
+}
+
+huffman_decoded_jpeg_scan_t* jpeg_image_huffman_decode(const jpeg_image_t* jpeg)
+{
+    // allocate new structure
+    huffman_decoded_jpeg_scan_t* result = huffman_decoded_jpeg_scan_create(jpeg);
+
+    if (result == NULL) {
+        return NULL;
+    }
+    if (huffman_decode_blocks(jpeg, NULL, result)) {
+        huffman_decoded_jpeg_scan_destroy(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+huffman_decoded_jpeg_scan_t* jpeg_image_huffman_decode_natural(const jpeg_image_t* jpeg)
+{
+    huffman_decoded_jpeg_scan_t* result = huffman_decoded_jpeg_scan_create(jpeg);
+
+    if (result == NULL) {
+        return NULL;
+    }
+    result->order = JPEG_COEFFICIENT_ORDER_NATURAL;
+    if (huffman_decode_blocks(jpeg, NULL, result)) {
+        huffman_decoded_jpeg_scan_destroy(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+int jpeg_image_huffman_decode_intervals(const jpeg_image_t* jpeg, const bool* intervals,
+                                        huffman_decoded_jpeg_scan_t* decoded_scan)
+{
+    return huffman_decode_blocks(jpeg, intervals, decoded_scan);
+}
+
+huffman_decoded_jpeg_dc_t* jpeg_image_huffman_decode_dc(const jpeg_image_t* jpeg)
+{
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    uint64_t symbols_decoded = 0;
+
+    // the scan only provides the plane geometry and MCU map; its blocks are never allocated.
+    huffman_decoded_jpeg_scan_t* geometry = scan_create(jpeg, false);
+    if (geometry == NULL) {
+        return NULL;
+    }
+    if (jpeg->scan.num_ecs == 0) {
+        huffman_decoded_jpeg_scan_destroy(geometry);
+        return NULL;
+    }
+
+    const jpeg_mcu_map_t* map = geometry->mcu_map;
+    int16_t* dc_diffs[3];
+    dc_diffs_alloc(jpeg, map, dc_diffs);
+    if (huffman_decode_scan_data(jpeg, map, NULL, NULL, JPEG_COEFFICIENT_ORDER_ZIGZAG, dc_diffs,
+                                 &symbols_decoded)) {
+        for (int j = 0; j < 3; j++) {
+            free(dc_diffs[j]);
+        }
+        huffman_decoded_jpeg_scan_destroy(geometry);
+        return NULL;
+    }
+
+    huffman_decoded_jpeg_dc_t* result = calloc(1, sizeof(huffman_decoded_jpeg_dc_t));
+    result->num_components = jpeg->frame_header.num_components;
+    result->H_max = geometry->H_max;
+    result->V_max = geometry->V_max;
+    for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+        const huffman_decoded_jpeg_component_t* component = &geometry->components[j];
+        jpeg_dc_plane_t* plane = &result->components[j];
+        plane->width_in_blocks = component->width_in_blocks;
+        plane->height_in_blocks = component->height_in_blocks;
+        plane->blocks_per_line = component->blocks_per_line;
+        plane->block_lines = component->block_lines;
+        plane->values = malloc(component->num_blocks * sizeof(int16_t));
+
+        component_dc_prefix_sum(jpeg, map, j, dc_diffs[j]);
+        dc_values_scatter(map, j, dc_diffs[j], plane->values);
+        free(dc_diffs[j]);
+    }
+
+    if (JPEG_STATS_ENABLED()) {
+        JPEG_STATS_ADD(symbols_decoded, symbols_decoded);
+        for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+            JPEG_STATS_ADD(blocks_decoded, geometry->components[j].num_blocks);
+        }
+    }
+    huffman_decoded_jpeg_scan_destroy(geometry);
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_DECODE, t0);
+    return result;
+}
+
+void huffman_decoded_jpeg_dc_destroy(huffman_decoded_jpeg_dc_t* decoded_dc)
+{
+    for (int i = 0; i < 3; i++) {
+        free(decoded_dc->components[i].values);
+    }
+    free(decoded_dc);
+}
+
+/**
+ * The values coded into the file need to be converted as described in tables F.1 and F.2 of T.81.
+ *
+ * @param[in]     coefficient_value
+ * @param[out]    bitlen              Bitlength of the returned coded value, in [0, 16]. Callers
+ *                                    check it against the limits for the frame's precision.
+ */
+static inline uint16_t coefficient_value_to_coded_value(int16_t coefficient_value, int* bitlen)
+{
+    if (coefficient_value == 0) {
+        *bitlen = 0;
+        return 0;
+    }
+
+    const int coeff_abs = (coefficient_value < 0) ? -coefficient_value : coefficient_value;
+    *bitlen = 32 - __builtin_clz(coeff_abs);
+
+    // negative values are coded as the one's complement of their magnitude.
+    return (coefficient_value < 0) ? (coefficient_value + ((1 << *bitlen) - 1)) :
+                                     coefficient_value;
+}
+
+typedef struct huffman_reverse_lookup_entry
+{
+    // bit length of 0 means that there is no entry for that value.
+    int bit_length;
+    uint32_t value;
+} huffman_reverse_lookup_entry_t;
+
+// largest AC magnitude that has a combined code; anything bigger is coded from the entries.
+#define HUFFMAN_COMBINED_AC_MAX 255
+#define HUFFMAN_COMBINED_AC_PER_RUN ((2 * HUFFMAN_COMBINED_AC_MAX) + 1)
+
+// DC differences in a baseline scan are at most 11 bits, so every one has a combined code.
+#define HUFFMAN_COMBINED_DC_MAX 2047
+
+/**
+ * A combined code is a huffman code with the magnitude bits of its coefficient already appended,
+ * stored as (bit length << 27) | bits so it can be packed with a single call. A DC code is at most
+ * 16 + 11 bits long, which is what sets the split.
+ */
+#define HUFFMAN_COMBINED_LENGTH(code) ((code) >> 27)
+#define HUFFMAN_COMBINED_BITS(code) ((code) & ((1u << 27) - 1))
+
+typedef struct huffman_reverse_lookup_table
+{
+    huffman_reverse_lookup_entry_t entries[256];
+
+    // combined codes, 0 where the symbol has no huffman code. DC tables are indexed by
+    // difference + HUFFMAN_COMBINED_DC_MAX. AC tables are indexed by
+    // (run * HUFFMAN_COMBINED_AC_PER_RUN) + value + HUFFMAN_COMBINED_AC_MAX; a value of 0 is only
+    // filled in for EOB (run 0) and ZRL (run 15).
+    uint32_t combined[];
+} huffman_reverse_lookup_table_t;
+
+/**
+ * Combined code for a coefficient of value v with the given run of zeros in front of it, or 0 if
+ * the table has no code for its symbol.
+ */
+static uint32_t huffman_combined_code(const huffman_reverse_lookup_table_t* hrlt, int run, int v)
+{
+    int bitlen = 0;
+    const uint16_t magnitude = (v == 0) ? 0 : coefficient_value_to_coded_value(v, &bitlen);
+    const huffman_reverse_lookup_entry_t* code = &hrlt->entries[(run << 4) | bitlen];
+    if (code->bit_length == 0) {
+        return 0;
+    }
+    return ((uint32_t)(code->bit_length + bitlen) << 27) | (code->value << bitlen) | magnitude;
+}
+
+/**
+ * Builds the reverse lookup for t, along with its combined codes. table_class is 0 for DC and 1 for
+ * AC.
+ *
+ * The huffman table returned by this function can be safely destroyed with free().
+ */
+huffman_reverse_lookup_table_t* huffman_reverse_lookup_table_create(const jpeg_huffman_table_t* t,
+                                                                    int table_class)
+{
+    const size_t num_combined = (table_class == 0) ? ((2 * HUFFMAN_COMBINED_DC_MAX) + 1) :
+                                                     (16 * HUFFMAN_COMBINED_AC_PER_RUN);
+    huffman_reverse_lookup_table_t* hrlt = calloc(1, sizeof(huffman_reverse_lookup_table_t) +
+                                                  (num_combined * sizeof(uint32_t)));
+
+    uint32_t codedval = 0;
+    int entryidx = 0;
+    for (int bits = 0; bits < 16; bits++) {
+        codedval <<= 1;
+        for (int i = 0; i < t->number_of_codes_with_length[bits]; i++, entryidx++) {
+            uint8_t uncodedval = t->huffman_codes[entryidx];
+
+            hrlt->entries[uncodedval].bit_length = bits + 1;
+            hrlt->entries[uncodedval].value = codedval;
+            codedval++;
+        }
+    }
+
+    if (table_class == 0) {
+        for (int v = -HUFFMAN_COMBINED_DC_MAX; v <= HUFFMAN_COMBINED_DC_MAX; v++) {
+            hrlt->combined[v + HUFFMAN_COMBINED_DC_MAX] = huffman_combined_code(hrlt, 0, v);
+        }
     } else {
-        result = coefficient_value;
+        for (int run = 0; run < 16; run++) {
+            uint32_t* combined = &hrlt->combined[(run * HUFFMAN_COMBINED_AC_PER_RUN) +
+                                                 HUFFMAN_COMBINED_AC_MAX];
+            for (int v = 1; v <= HUFFMAN_COMBINED_AC_MAX; v++) {
+                combined[v] = huffman_combined_code(hrlt, run, v);
+                combined[-v] = huffman_combined_code(hrlt, run, -v);
+            }
+        }
+        hrlt->combined[HUFFMAN_COMBINED_AC_MAX] = huffman_combined_code(hrlt, 0, 0);
+        hrlt->combined[(15 * HUFFMAN_COMBINED_AC_PER_RUN) + HUFFMAN_COMBINED_AC_MAX] =
+            huffman_combined_code(hrlt, 15, 0);
+    }
+
+    return hrlt;
+}
+
+/**
+ * Packs a combined code; returns -1 if it's 0, i.e. the symbol can't be coded.
+ */
+static inline int pack_combined_code(uint32_t code, bit_packer_t* bp)
+{
+    if (code == 0) {
+        return -1;
+    }
+    bit_packer_pack_u32(HUFFMAN_COMBINED_BITS(code), HUFFMAN_COMBINED_LENGTH(code), bp);
+    return 0;
+}
+
+/**
+ * Pads out the bit packer's last byte, moves its contents into a new entropy coded segment at the
+ * end of scan, and resets the bit packer.
+ */
+static void scan_append_ecs_from_bit_packer(jpeg_scan_t* scan, bit_packer_t* bp)
+{
+    bit_packer_fill_endbits(bp);
+
+    entropy_coded_segment_t* ecs = scan_append_ecs(scan);
+    ecs->size = bp->curidx;
+    ecs->data = malloc(ecs->size);
+    memcpy(ecs->data, bp->data, ecs->size);
+
+    bit_packer_reset(bp);
+}
+
+/**
+ * Codes a coefficient of value v after run zeros straight from the symbol entries, for values
+ * that the combined tables don't cover. The code and magnitude bits still go out in one pack.
+ *
+ * Returns -1 if v needs more than max_bits magnitude bits or the table has no code for it.
+ */
+static int pack_uncombined_code(const huffman_reverse_lookup_table_t* hrlt, int run, int16_t v,
+                                int max_bits, bit_packer_t* bp)
+{
+    int bitlen;
+    const uint16_t magnitude = coefficient_value_to_coded_value(v, &bitlen);
+    if (bitlen > max_bits) {
+        return -1;
+    }
+
+    const huffman_reverse_lookup_entry_t* huffman_code = &hrlt->entries[(run << 4) | bitlen];
+    if (huffman_code->bit_length == 0) {
+        return -1;
+    }
+    bit_packer_pack_u32((huffman_code->value << bitlen) | magnitude,
+                        huffman_code->bit_length + bitlen, bp);
+    return 0;
+}
+
+/**
+ * Returns a mask of block's nonzero AC coefficients, with bit i set if ac_values[i] isn't 0, so
+ * that runs of zeros can be skipped over without looking at them one by one.
+ */
+static inline uint64_t block_ac_nonzero_mask(const jpeg_block_t* block)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i* v = (const __m128i*)block;
+    uint64_t zeros = 0;
+    for (int i = 0; i < 8; i += 2) {
+        const __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128(&v[i]), zero);
+        const __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128(&v[i + 1]), zero);
+        zeros |= (uint64_t)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << (i * 8);
+    }
+    // bit 0 is the DC value.
+    return ~zeros >> 1;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < 63; i++) {
+        mask |= (uint64_t)(block->ac_values[i] != 0) << i;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Huffman encodes one block with DC difference dc_diff into bp. Each coefficient is a single
+ * combined code lookup and pack. Values outside the combined range, at any precision, fall back
+ * to a category code and magnitude bits from the symbol entries, checked against the limits for
+ * the frame's precision: AC magnitudes over HUFFMAN_COMBINED_AC_MAX, and DC differences over
+ * HUFFMAN_COMBINED_DC_MAX, which only 12-bit frames have.
+ *
+ * Returns 0 on success, or -1 if the huffman tables can't code one of its symbols.
+ */
+static inline __attribute__((always_inline))
+int encode_block(const huffman_reverse_lookup_table_t* dc_hrlt,
+                 const huffman_reverse_lookup_table_t* ac_hrlt, const jpeg_block_t* source_block,
+                 int16_t dc_diff, const coefficient_limits_t* limits, bit_packer_t* bp)
+{
+    // ======= DC length and DC coefficient =======
+    if ((dc_diff >= -HUFFMAN_COMBINED_DC_MAX) && (dc_diff <= HUFFMAN_COMBINED_DC_MAX)) {
+        if (pack_combined_code(dc_hrlt->combined[dc_diff + HUFFMAN_COMBINED_DC_MAX], bp)) {
+            return -1;
+        }
+    } else if (pack_uncombined_code(dc_hrlt, 0, dc_diff, limits->max_dc_bits, bp)) {
+        return -1;
+    }
+
+    // ======= AC coefficients =======
+    const uint32_t* ac_combined = &ac_hrlt->combined[HUFFMAN_COMBINED_AC_MAX];
+    unsigned int ac_coeff_idx = 0;
+
+    // only the nonzero coefficients are visited; the zeros before each are its run.
+    uint64_t nonzero = block_ac_nonzero_mask(source_block);
+    while (nonzero != 0) {
+        const unsigned int l = __builtin_ctzll(nonzero);
+        nonzero &= nonzero - 1;
+
+        int zeroes_to_rle = l - ac_coeff_idx;
+        while (zeroes_to_rle > 15) {
+            // if there are 16 or more zeroes that need to be RLE'd before the coefficient, we
+            // may only pack 16 of them at a time.
+            if (pack_combined_code(ac_combined[15 * HUFFMAN_COMBINED_AC_PER_RUN], bp)) {
+                return -1;
+            }
+            zeroes_to_rle -= 16;
+        }
+
+        // pack AC coefficient normally
+        const int16_t value = source_block->ac_values[l];
+        int failed;
+        if ((value >= -HUFFMAN_COMBINED_AC_MAX) && (value <= HUFFMAN_COMBINED_AC_MAX)) {
+            failed = pack_combined_code(ac_combined[(zeroes_to_rle *
+                                                     HUFFMAN_COMBINED_AC_PER_RUN) + value], bp);
+        } else {
+            failed = pack_uncombined_code(ac_hrlt, zeroes_to_rle, value, limits->max_ac_bits, bp);
+        }
+        if (failed) {
+            return -1;
+        }
+
+        ac_coeff_idx = l + 1;
+    }
+
+    if (ac_coeff_idx < 63) {
+        // we made it all the way to the end; slap an EOB in there.
+        if (pack_combined_code(ac_combined[0], bp)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * State shared by the MCU loops of huffman_recode().
+ */
+typedef struct scan_encoder
+{
+    // huffman reverse lookup tables for each block of an MCU.
+    const huffman_reverse_lookup_table_t* dc_block_hrlts[JPEG_MAX_BLOCKS_PER_MCU];
+    const huffman_reverse_lookup_table_t* ac_block_hrlts[JPEG_MAX_BLOCKS_PER_MCU];
+
+    const huffman_decoded_jpeg_component_t* components;
+    const int16_t* dc_cursors[3];
+    coefficient_limits_t limits;
+} scan_encoder_t;
+
+/**
+ * Encodes MCUs [first_mcu, end_mcu) into bp; the counterpart of decode_mcus().
+ */
+static inline __attribute__((always_inline))
+int encode_mcus(scan_encoder_t* e, const jpeg_mcu_map_t* map, bit_packer_t* bp,
+                int first_mcu, int end_mcu, const int blocks_per_mcu,
+                const uint8_t* block_component)
+{
+    const int16_t* dc_cursors[3] = { e->dc_cursors[0], e->dc_cursors[1], e->dc_cursors[2] };
+    int retval = 0;
+
+    // huffman encode!
+    const uint32_t* mcu_blocks = &map->block_index[first_mcu * blocks_per_mcu];
+    for (int i = first_mcu; i < end_mcu; i++, mcu_blocks += blocks_per_mcu) {
+        for (int k = 0; k < blocks_per_mcu; k++) {
+            const int j = block_component[k];
+            if (encode_block(e->dc_block_hrlts[k], e->ac_block_hrlts[k],
+                             &e->components[j].blocks[mcu_blocks[k]], *dc_cursors[j]++,
+                             &e->limits, bp)) {
+                retval = -1;
+                goto done;
+            }
+        }
+    }
+
+done:
+    for (int j = 0; j < 3; j++) {
+        e->dc_cursors[j] = dc_cursors[j];
+    }
+    return retval;
+}
+
+static int encode_mcus_gray(scan_encoder_t* e, const jpeg_mcu_map_t* map, bit_packer_t* bp,
+                            int first_mcu, int end_mcu)
+{
+    return encode_mcus(e, map, bp, first_mcu, end_mcu, 1, mcu_layout_gray);
+}
+
+static int encode_mcus_444(scan_encoder_t* e, const jpeg_mcu_map_t* map, bit_packer_t* bp,
+                           int first_mcu, int end_mcu)
+{
+    return encode_mcus(e, map, bp, first_mcu, end_mcu, 3, mcu_layout_444);
+}
+
+static int encode_mcus_422(scan_encoder_t* e, const jpeg_mcu_map_t* map, bit_packer_t* bp,
+                           int first_mcu, int end_mcu)
+{
+    return encode_mcus(e, map, bp, first_mcu, end_mcu, 4, mcu_layout_422);
+}
+
+static int encode_mcus_420(scan_encoder_t* e, const jpeg_mcu_map_t* map, bit_packer_t* bp,
+                           int first_mcu, int end_mcu)
+{
+    return encode_mcus(e, map, bp, first_mcu, end_mcu, 6, mcu_layout_420);
+}
+
+static int encode_mcus_generic(scan_encoder_t* e, const jpeg_mcu_map_t* map, bit_packer_t* bp,
+                               int first_mcu, int end_mcu)
+{
+    return encode_mcus(e, map, bp, first_mcu, end_mcu, map->blocks_per_mcu, map->block_component);
+}
+
+/**
+ * Huffman encodes the restart intervals of decoded_scan set in intervals, or all of them if it's
+ * NULL, into a copy of jpeg. Intervals that aren't set keep jpeg's entropy coded segments.
+ */
+static jpeg_image_t* huffman_recode(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                    const jpeg_image_t* jpeg, const bool* intervals)
+{
+    if (decoded_scan->order != JPEG_COEFFICIENT_ORDER_ZIGZAG) {
+        printf("jpeg recoding error:    scan isn't in zigzag order.\n");
+        return NULL;
+    }
+
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    jpeg_image_t* result = jpeg_image_copy_headers(jpeg);
+
+    // make huffman reverse lookup tables, once for each table that the scan uses.
+    huffman_reverse_lookup_table_t* dc_hrlts[4] = { NULL, NULL, NULL, NULL };
+    huffman_reverse_lookup_table_t* ac_hrlts[4] = { NULL, NULL, NULL, NULL };
+
+    const jpeg_mcu_map_t* map = decoded_scan->mcu_map;
+    scan_encoder_t e = { .components = decoded_scan->components };
+    coefficient_limits_for_frame(jpeg, &e.limits);
+
+    // look up the huffman tables for each block of an MCU once, up front.
+    for (int k = 0; k < map->blocks_per_mcu; k++) {
+        const int j = map->block_component[k];
+        uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
+        const int dc_idx = (huff_tables >> 4) & 0x03;
+        const int ac_idx = (huff_tables >> 0) & 0x03;
+        if (dc_hrlts[dc_idx] == NULL) {
+            dc_hrlts[dc_idx] = huffman_reverse_lookup_table_create(&jpeg->dc_huffman_tables[dc_idx],
+                                                                   0);
+        }
+        if (ac_hrlts[ac_idx] == NULL) {
+            ac_hrlts[ac_idx] = huffman_reverse_lookup_table_create(&jpeg->ac_huffman_tables[ac_idx],
+                                                                   1);
+        }
+        e.dc_block_hrlts[k] = dc_hrlts[dc_idx];
+        e.ac_block_hrlts[k] = ac_hrlts[ac_idx];
+    }
+
+    // the predictors are taken care of in a separate pass over each component's DC values.
+    int16_t* dc_diffs[3] = { NULL, NULL, NULL };
+    for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+        dc_diffs[j] = component_dc_differences(decoded_scan, jpeg, j, intervals);
+        e.dc_cursors[j] = dc_diffs[j];
+    }
+
+    // the MCU loop is picked once per image.
+    int (*encode_interval)(scan_encoder_t*, const jpeg_mcu_map_t*, bit_packer_t*, int, int);
+    switch (mcu_map_layout(map)) {
+        case MCU_LAYOUT_GRAY: encode_interval = encode_mcus_gray; break;
+        case MCU_LAYOUT_444:  encode_interval = encode_mcus_444;  break;
+        case MCU_LAYOUT_422:  encode_interval = encode_mcus_422;  break;
+        case MCU_LAYOUT_420:  encode_interval = encode_mcus_420;  break;
+        default:              encode_interval = encode_mcus_generic; break;
+    }
+
+    bit_packer_t* bp = bit_packer_create();
+
+    // result starts without entropy coded segments; one is appended per restart interval.
+    const int interval_mcus = mcus_per_interval(jpeg, map);
+    for (int first = 0; first < map->num_mcus; first += interval_mcus) {
+        const int ecs_idx = first / interval_mcus;
+        const int end = ((map->num_mcus - first) < interval_mcus) ? map->num_mcus :
+                                                                    (first + interval_mcus);
+
+        if ((intervals != NULL) && !intervals[ecs_idx]) {
+            // the interval is spliced in from jpeg byte for byte, skipping its MCUs.
+            if (ecs_idx >= jpeg->scan.num_ecs) {
+                goto fail_cleanup;
+            }
+            const entropy_coded_segment_t* source = jpeg->scan.entropy_coded_segments[ecs_idx];
+            entropy_coded_segment_t* ecs = scan_append_ecs(&result->scan);
+            ecs->size = source->size;
+            ecs->data = malloc(ecs->size);
+            memcpy(ecs->data, source->data, ecs->size);
+
+            for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+                e.dc_cursors[j] += (end - first) * mcu_map_component_blocks(map, j);
+            }
+            continue;
+        }
+
+        if (encode_interval(&e, map, bp, first, end)) {
+            goto fail_cleanup;
+        }
+
+        // every restart interval goes in its own entropy coded segment.
+        scan_append_ecs_from_bit_packer(&result->scan, bp);
+    }
+
+    bit_packer_destroy(bp);
+
+    for (int i = 0; i < 4; i++) {
+        free(dc_hrlts[i]);
+        free(ac_hrlts[i]);
+    }
+    for (int j = 0; j < 3; j++) {
+        free(dc_diffs[j]);
     }
 
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_RECODE, t0);
     return result;
+
+fail_cleanup:
+    bit_packer_destroy(bp);
+    for (int j = 0; j < 3; j++) {
+        free(dc_diffs[j]);
+    }
+    for (int i = 0; i < 4; i++) {
+        free(dc_hrlts[i]);
+        free(ac_hrlts[i]);
+    }
+    jpeg_image_destroy(result);
+    return NULL;
 }
 
-typedef struct huffman_reverse_lookup_entry
+jpeg_image_t* jpeg_image_huffman_recode_with_tables(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                    const jpeg_image_t* jpeg)
 {
-    // bit length of 0 means that there is no entry for that value.
-    int bit_length;
-    uint32_t value;
-} huffman_reverse_lookup_entry_t;
+    return huffman_recode(decoded_scan, jpeg, NULL);
+}
 
-typedef struct huffman_reverse_lookup_table
+jpeg_image_t* jpeg_image_huffman_recode_intervals(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                  const jpeg_image_t* jpeg, const bool* intervals)
 {
-    huffman_reverse_lookup_entry_t entries[256];
-} huffman_reverse_lookup_table_t;
+    return huffman_recode(decoded_scan, jpeg, intervals);
+}
+
+jpeg_image_t* jpeg_image_create(uint16_t width, uint16_t height, int num_components,
+                                const uint8_t* sampling_factors)
+{
+    if ((num_components != 1) && (num_components != 3)) {
+        return NULL;
+    }
+
+    jpeg_image_t* jpeg = calloc(1, sizeof(jpeg_image_t));
+
+    jpeg->frame_header.header.segment_marker = SOF_0;
+    jpeg->frame_header.header.Ls = 8 + (3 * num_components);
+    jpeg->frame_header.sample_precision = 8;
+    jpeg->frame_header.number_of_lines = height;
+    jpeg->frame_header.samples_per_line = width;
+    jpeg->frame_header.num_components = num_components;
+    jpeg->frame_header.csps = calloc(num_components, sizeof(*jpeg->frame_header.csps));
+
+    jpeg_scan_header_t* scan_header = &jpeg->scan.jpeg_scan_header;
+    scan_header->header.segment_marker = SOS;
+    scan_header->header.Ls = 6 + (2 * num_components);
+    scan_header->num_components = num_components;
+    scan_header->selection_start = 0;
+    scan_header->selection_end = 63;
+    scan_header->approximation_high_approximation_low = 0;
+
+    for (int i = 0; i < num_components; i++) {
+        const int table = (i == 0) ? 0 : 1;
+        frame_component_specification_parameters_t* csp = &jpeg->frame_header.csps[i];
+        csp->component_identifier = i + 1;
+        csp->horizontal_sampling_factor = (sampling_factors[i] >> 4) & 0x0f;
+        csp->vertical_sampling_factor = sampling_factors[i] & 0x0f;
+        csp->quantization_table_selector = table;
+
+        scan_header->csps[i].scan_component_selector = i + 1;
+        scan_header->csps[i].dc_ac_entropy_coding_table = (table << 4) | table;
+    }
+
+    return jpeg;
+}
+
+////////////////////////////////////////////////////////////////
+// Huffman table construction
+////////////////////////////////////////////////////////////////
 
 /**
- * The huffman table returned by this function can be safely destroyed with free().
+ * Example huffman tables from section K.3 of T.81.
  */
-huffman_reverse_lookup_table_t* huffman_reverse_lookup_table_create(const jpeg_huffman_table_t* t)
+static const uint8_t annex_k_dc_luminance_bits[16] = {
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+static const uint8_t annex_k_dc_chrominance_bits[16] = {
+    0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+static const uint8_t annex_k_dc_values[12] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b
+};
+
+static const uint8_t annex_k_ac_luminance_bits[16] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+static const uint8_t annex_k_ac_luminance_values[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61,
+    0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52,
+    0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25,
+    0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64,
+    0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+    0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99,
+    0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3,
+    0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8,
+    0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+static const uint8_t annex_k_ac_chrominance_bits[16] = {
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77
+};
+static const uint8_t annex_k_ac_chrominance_values[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61,
+    0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33,
+    0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18,
+    0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+    0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63,
+    0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+    0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca,
+    0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+    0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+void jpeg_huffman_table_annex_k(int table_class, bool chrominance, uint8_t table_dest,
+                                jpeg_huffman_table_t* table)
 {
-    huffman_reverse_lookup_table_t* hrlt = calloc(1, sizeof(huffman_reverse_lookup_table_t));
+    const uint8_t* bits;
+    const uint8_t* values;
+    if (table_class == 0) {
+        bits = chrominance ? annex_k_dc_chrominance_bits : annex_k_dc_luminance_bits;
+        values = annex_k_dc_values;
+    } else {
+        bits = chrominance ? annex_k_ac_chrominance_bits : annex_k_ac_luminance_bits;
+        values = chrominance ? annex_k_ac_chrominance_values : annex_k_ac_luminance_values;
+    }
 
-    uint32_t codedval = 0;
-    int entryidx = 0;
-    for (int bits = 0; bits < 16; bits++) {
-        codedval <<= 1;
-        for (int i = 0; i < t->number_of_codes_with_length[bits]; i++, entryidx++) {
-            uint8_t uncodedval = t->huffman_codes[entryidx];
+    memset(table, 0, sizeof(*table));
+    table->header.segment_marker = DHT;
+    table->tc_td = ((table_class & 0x0f) << 4) | (table_dest & 0x0f);
+    memcpy(table->number_of_codes_with_length, bits, 16);
 
-            hrlt->entries[uncodedval].bit_length = bits + 1;
-            hrlt->entries[uncodedval].value = codedval;
-            codedval++;
+    int num_codes = 0;
+    for (int i = 0; i < 16; i++) {
+        num_codes += bits[i];
+    }
+    memcpy(table->huffman_codes, values, num_codes);
+    table->header.Ls = 2 + 1 + 16 + num_codes;
+}
+
+void jpeg_huffman_table_build_optimal(const uint32_t freq[256], uint8_t tc_td,
+                                      jpeg_huffman_table_t* table)
+{
+    // This is the procedure from section K.2 of T.81. Symbol 256 is a reserved symbol with a
+    // frequency of 1; it guarantees that no real symbol gets a code consisting of all 1 bits.
+    uint64_t f[257];
+    int codesize[257] = { 0 };
+    int others[257];
+    for (int i = 0; i < 256; i++) {
+        f[i] = freq[i];
+        others[i] = -1;
+    }
+    f[256] = 1;
+    others[256] = -1;
+
+    while (1) {
+        // find the two least frequent symbols, preferring the larger symbol value in a tie.
+        int c1 = -1;
+        uint64_t v = UINT64_MAX;
+        for (int i = 0; i <= 256; i++) {
+            if ((f[i] != 0) && (f[i] <= v)) {
+                v = f[i];
+                c1 = i;
+            }
+        }
+        int c2 = -1;
+        v = UINT64_MAX;
+        for (int i = 0; i <= 256; i++) {
+            if ((f[i] != 0) && (f[i] <= v) && (i != c1)) {
+                v = f[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+
+        // merge c2's tree into c1's.
+        f[c1] += f[c2];
+        f[c2] = 0;
+
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
         }
     }
 
-    return hrlt;
+    // count the number of codes of each length, then limit code lengths to 16 bits.
+    int bits[33] = { 0 };
+    for (int i = 0; i <= 256; i++) {
+        if (codesize[i]) {
+            bits[codesize[i]]++;
+        }
+    }
+    for (int i = 32; i > 16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // drop the reserved symbol's code, which is one of the longest ones.
+    int longest = 16;
+    while (bits[longest] == 0) {
+        longest--;
+    }
+    bits[longest]--;
+
+    memset(table, 0, sizeof(*table));
+    table->header.segment_marker = DHT;
+    table->tc_td = tc_td;
+    int num_codes = 0;
+    for (int i = 0; i < 16; i++) {
+        table->number_of_codes_with_length[i] = bits[i + 1];
+        num_codes += bits[i + 1];
+    }
+
+    // symbols are assigned in order of increasing code size.
+    int p = 0;
+    for (int size = 1; size <= 32; size++) {
+        for (int i = 0; i < 256; i++) {
+            if (codesize[i] == size) {
+                table->huffman_codes[p++] = i;
+            }
+        }
+    }
+    table->header.Ls = 2 + 1 + 16 + num_codes;
 }
 
-jpeg_image_t* jpeg_image_huffman_recode_with_tables(const huffman_decoded_jpeg_scan_t* decoded_scan,
-                                                    const jpeg_image_t* jpeg)
+/**
+ * Tallies the AC huffman symbols that the recoder would emit for one block.
+ */
+static void count_block_ac_symbols(const jpeg_block_t* block, uint32_t ac_freq[256])
+{
+    int bitlen;
+    int next = 0;
+    uint64_t nonzero = block_ac_nonzero_mask(block);
+    while (nonzero != 0) {
+        const int i = __builtin_ctzll(nonzero);
+        nonzero &= nonzero - 1;
+
+        int run = i - next;
+        while (run > 15) {
+            ac_freq[0xf0]++;
+            run -= 16;
+        }
+        coefficient_value_to_coded_value(block->ac_values[i], &bitlen);
+        ac_freq[(run << 4) | bitlen]++;
+        next = i + 1;
+    }
+
+    if (next != 63) {
+        ac_freq[0x00]++;
+    }
+}
+
+void huffman_decoded_jpeg_scan_symbol_histogram(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                const jpeg_image_t* jpeg,
+                                                uint32_t dc_freq[4][256],
+                                                uint32_t ac_freq[4][256])
+{
+    memset(dc_freq, 0, 4 * 256 * sizeof(uint32_t));
+    memset(ac_freq, 0, 4 * 256 * sizeof(uint32_t));
+
+    for (int j = 0; j < jpeg->frame_header.num_components; j++) {
+        uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
+        int dc_huff_idx = (huff_tables >> 4) & 0x03;
+        int ac_huff_idx = (huff_tables >> 0) & 0x03;
+
+        const huffman_decoded_jpeg_component_t* component = &decoded_scan->components[j];
+        int16_t* dc_diffs = component_dc_differences(decoded_scan, jpeg, j, NULL);
+        for (int i = 0; i < component->num_blocks; i++) {
+            int bitlen;
+            coefficient_value_to_coded_value(dc_diffs[i], &bitlen);
+            dc_freq[dc_huff_idx][bitlen]++;
+
+            count_block_ac_symbols(&component->blocks[i], ac_freq[ac_huff_idx]);
+        }
+        free(dc_diffs);
+    }
+}
+
+void jpeg_image_optimize_huffman_tables(jpeg_image_t* jpeg,
+                                        const huffman_decoded_jpeg_scan_t* decoded_scan)
+{
+    uint32_t dc_freq[4][256];
+    uint32_t ac_freq[4][256];
+    huffman_decoded_jpeg_scan_symbol_histogram(decoded_scan, jpeg, dc_freq, ac_freq);
+
+    bool dc_used[4] = { false };
+    bool ac_used[4] = { false };
+    for (int j = 0; j < jpeg->scan.jpeg_scan_header.num_components; j++) {
+        uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
+        dc_used[(huff_tables >> 4) & 0x03] = true;
+        ac_used[(huff_tables >> 0) & 0x03] = true;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (dc_used[i]) {
+            jpeg_huffman_table_build_optimal(dc_freq[i], 0x00 | i, &jpeg->dc_huffman_tables[i]);
+        }
+        if (ac_used[i]) {
+            jpeg_huffman_table_build_optimal(ac_freq[i], 0x10 | i, &jpeg->ac_huffman_tables[i]);
+        }
+    }
+}
+
+bool jpeg_image_huffman_tables_can_code(const jpeg_image_t* jpeg,
+                                        const huffman_decoded_jpeg_scan_t* decoded_scan)
 {
-    jpeg_image_t* result = jpeg_image_copy(jpeg);
+    uint32_t dc_freq[4][256];
+    uint32_t ac_freq[4][256];
+    huffman_decoded_jpeg_scan_symbol_histogram(decoded_scan, jpeg, dc_freq, ac_freq);
 
-    // make huffman reverse lookup tables.
-    huffman_reverse_lookup_table_t* dc_hrlts[4];
-    huffman_reverse_lookup_table_t* ac_hrlts[4];
     for (int i = 0; i < 4; i++) {
-        dc_hrlts[i] = huffman_reverse_lookup_table_create(&jpeg->dc_huffman_tables[i]);
-        ac_hrlts[i] = huffman_reverse_lookup_table_create(&jpeg->ac_huffman_tables[i]);
+        uint8_t dc_code_length[256];
+        uint8_t ac_code_length[256];
+        jpeg_huffman_table_code_lengths(&jpeg->dc_huffman_tables[i], dc_code_length);
+        jpeg_huffman_table_code_lengths(&jpeg->ac_huffman_tables[i], ac_code_length);
+        for (int s = 0; s < 256; s++) {
+            if ((dc_freq[i][s] && !dc_code_length[s]) || (ac_freq[i][s] && !ac_code_length[s])) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+jpeg_image_t* jpeg_image_huffman_recode(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                        const jpeg_image_t* jpeg)
+{
+    if (jpeg_image_huffman_tables_can_code(jpeg, decoded_scan)) {
+        return jpeg_image_huffman_recode_with_tables(decoded_scan, jpeg);
+    }
+
+    jpeg_image_t* tables = jpeg_image_copy_headers(jpeg);
+    jpeg_image_optimize_huffman_tables(tables, decoded_scan);
+    jpeg_image_t* result = jpeg_image_huffman_recode_with_tables(decoded_scan, tables);
+    jpeg_image_destroy(tables);
+
+    return result;
+}
+
+void jpeg_image_arithmetic_to_huffman(jpeg_image_t* jpeg,
+                                      const huffman_decoded_jpeg_scan_t* decoded_scan)
+{
+    if (!jpeg_image_is_arithmetic_coded(jpeg)) {
+        return;
     }
 
-    // huffman code
-    // num of MCUs is the min of the number of blocks
-    int num_mcus = decoded_scan->components[0].num_blocks;
-    for (int i = 1; i < jpeg->frame_header.num_components; i++) {
-        if (decoded_scan->components[i].num_blocks < num_mcus) {
-            num_mcus = decoded_scan->components[i].num_blocks;
+    // baseline frames have 8-bit samples and at most two huffman tables of each class.
+    bool baseline = (jpeg->frame_header.sample_precision == 8);
+    for (int j = 0; j < jpeg->scan.jpeg_scan_header.num_components; j++) {
+        if (jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table & 0x22) {
+            baseline = false;
         }
     }
+    jpeg->frame_header.header.segment_marker = baseline ? SOF_0 : SOF_1;
 
-    bit_packer_t* bp = bit_packer_create();
+    jpeg_image_optimize_huffman_tables(jpeg, decoded_scan);
+}
 
-    for (int i = 0; i < num_mcus; i++) {
-        for (int j = 0; j < jpeg->frame_header.num_components; j++) {
-            int blocks_per_mcu = (jpeg->frame_header.csps[j].horizontal_sampling_factor *
-                                  jpeg->frame_header.csps[j].vertical_sampling_factor);
-            int block_idx      = blocks_per_mcu * i;
-
-            uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
-            int dc_huff_idx = (huff_tables >> 4) & 0x0f;
-            int ac_huff_idx = (huff_tables >> 0) & 0x0f;
-            const huffman_reverse_lookup_table_t* dc_hrlt = (dc_hrlts[dc_huff_idx]);
-            const huffman_reverse_lookup_table_t* ac_hrlt = (ac_hrlts[ac_huff_idx]);
-
-            // huffman encode!
-            for (int k = 0; k < blocks_per_mcu; k++) {
-                //printf("jpeg recoding trace:    recoding block %i of component %i of MCU %i.\n",
-                //k, j, i);
-                jpeg_block_t* source_block = &decoded_scan->components[j].blocks[block_idx + k];
-
-                // ======= DC length and DC coefficient =======
-                int dc_raw_length;
-                uint16_t coded_coefficient_value =
-                    coefficient_value_to_coded_value(source_block->dc_value, &dc_raw_length);
-                //printf("jpeg recoding trace:    Coding %i bits for DC value %i.\n", dc_raw_length,
-                //source_block->dc_value);
-
-                if ((dc_raw_length < 0) || (dc_raw_length > 11)) {
-                    //printf("jpeg recoding error:    Trying to pack dc coefficient with length of "
-                    //"%i bits.\n", dc_raw_length);
-                    return NULL;
-                }
+void jpeg_image_strip_unused_tables(jpeg_image_t* jpeg)
+{
+    bool qt_used[4] = { false };
+    for (int c = 0; c < jpeg->frame_header.num_components; c++) {
+        qt_used[jpeg->frame_header.csps[c].quantization_table_selector & 0x03] = true;
+    }
 
-                const huffman_reverse_lookup_entry_t* huffman_code = &dc_hrlt->entries[dc_raw_length];
-                if (huffman_code->bit_length == 0) {
-                    //printf("jpeg recoding error:    No huffman code found for %02x.\n",
-                    //dc_raw_length);
-                    return NULL;
-                }
-                bit_packer_pack_u32(huffman_code->value, huffman_code->bit_length, bp);
-                bit_packer_pack_u16(coded_coefficient_value, dc_raw_length, bp);
-
-                // ======= AC coefficients =======
-                unsigned int ac_coeff_idx = 0;
-
-                while (ac_coeff_idx < 63) {
-                    // find next non-zero coefficient
-                    unsigned int l;
-                    for (l = ac_coeff_idx; (source_block->ac_values[l] == 0) && (l < 63); l++);
-
-                    int zeroes_to_rle = l - ac_coeff_idx;
-
-                    if (l == 63) {
-                        // we made it all the way to the end; slap an EOB in there.
-                        const huffman_reverse_lookup_entry_t* huffman_code = &ac_hrlt->entries[0];
-                        if (huffman_code->bit_length == 0) {
-                            //printf("jpeg recoding error:    No huffman code found for %02x.\n", 0);
-                            return NULL;
-                        }
-                        bit_packer_pack_u32(huffman_code->value, huffman_code->bit_length, bp);
-                    } else if ((zeroes_to_rle >= 0) && (zeroes_to_rle < 16)) {
-                        // pack AC coefficient normally
-                        int cidx = ac_coeff_idx + zeroes_to_rle;
-                        int ac_raw_length;
-                        uint16_t coded_coefficient_value =
-                            coefficient_value_to_coded_value(source_block->ac_values[cidx],
-                                                             &ac_raw_length);
-
-                        if ((ac_raw_length < 0) || (ac_raw_length > 10)) {
-                            //printf("jpeg recoding error:    "
-                            //"Trying to pack ac coefficient with length of %i bits.\n",
-                            //ac_raw_length);
-                            return NULL;
-                        }
-                        //printf("jpeg recoding trace:    Coding %i bits for AC value.\n",
-                        //ac_raw_length);
-
-                        uint8_t rrrrssss = ((uint8_t)zeroes_to_rle << 4) | (ac_raw_length);
-                        const huffman_reverse_lookup_entry_t* huffman_code =
-                            &ac_hrlt->entries[rrrrssss];
-                        if (huffman_code->bit_length == 0) {
-                            printf("jpeg recoding error:    No huffman code found for %02x.\n", 0);
-                            return NULL;
-                        }
-                        bit_packer_pack_u32(huffman_code->value, huffman_code->bit_length, bp);
-                        bit_packer_pack_u16(coded_coefficient_value, ac_raw_length, bp);
-                    } else {
-                        // if there are 17 or more zeroes that need to be RLE'd before another
-                        // coefficient is reached, we may only pack only 16 of them.
-                        uint8_t rrrrssss = 0xf0;
-                        const huffman_reverse_lookup_entry_t* huffman_code =
-                            &ac_hrlt->entries[rrrrssss];
-                        if (huffman_code->bit_length == 0) {
-                            printf("jpeg recoding error:    No huffman code found for %02x.\n", 0);
-                            return NULL;
-                        }
-                        bit_packer_pack_u32(huffman_code->value, huffman_code->bit_length, bp);
-
-                        l = ac_coeff_idx + 15;
-                    }
+    bool dc_used[4] = { false };
+    bool ac_used[4] = { false };
+    for (int j = 0; j < jpeg->scan.jpeg_scan_header.num_components; j++) {
+        uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
+        dc_used[(huff_tables >> 4) & 0x03] = true;
+        ac_used[(huff_tables >> 0) & 0x03] = true;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (!qt_used[i]) {
+            jpeg->jpeg_quantization_tables[i].table_valid = false;
+        }
+        if (!dc_used[i]) {
+            memset(&jpeg->dc_huffman_tables[i], 0, sizeof(jpeg->dc_huffman_tables[i]));
+        }
+        if (!ac_used[i]) {
+            memset(&jpeg->ac_huffman_tables[i], 0, sizeof(jpeg->ac_huffman_tables[i]));
+        }
+    }
+}
 
-                    ac_coeff_idx = l + 1;
+/**
+ * Number of bytes jpeg_image_store_to_file() writes for everything but the entropy coded data and
+ * the restart markers, if jpeg's huffman tables were replaced by dc_tables and ac_tables.
+ */
+static uint64_t jpeg_image_header_bytes(const jpeg_image_t* jpeg,
+                                        const jpeg_huffman_table_t* dc_tables,
+                                        const jpeg_huffman_table_t* ac_tables)
+{
+    // SOI and EOI
+    uint64_t bytes = 2 + 2;
+
+    for (int i = 0; i < jpeg->num_misc_segments; i++) {
+        bytes += 2 + jpeg->misc_segments[i]->header.Ls;
+    }
+
+    // all quantization tables share one DQT segment.
+    bytes += 2 + 2;
+    for (int i = 0; i < 4; i++) {
+        if (jpeg->jpeg_quantization_tables[i].table_valid) {
+            bytes += quantization_table_bytes(&jpeg->jpeg_quantization_tables[i]);
+        }
+    }
+
+    // one DHT segment per table.
+    for (int i = 0; i < 8; i++) {
+        const jpeg_huffman_table_t* table = (i < 4) ? &dc_tables[i] : &ac_tables[i - 4];
+        if (table->header.segment_marker == DHT) {
+            bytes += 2 + 2 + 1 + 16;
+            for (int j = 0; j < 16; j++) {
+                bytes += table->number_of_codes_with_length[j];
+            }
+        }
+    }
+
+    bytes += 2 + jpeg->frame_header.header.Ls;
+    if (jpeg->restart_interval != 0) {
+        bytes += 6;
+    }
+    bytes += 2 + jpeg->scan.jpeg_scan_header.header.Ls;
+
+    return bytes;
+}
+
+void jpeg_huffman_table_code_lengths(const jpeg_huffman_table_t* table, uint8_t code_length[256])
+{
+    memset(code_length, 0, 256);
+    int idx = 0;
+    for (int bits = 0; bits < 16; bits++) {
+        for (int i = 0; i < table->number_of_codes_with_length[bits]; i++, idx++) {
+            code_length[table->huffman_codes[idx]] = bits + 1;
+        }
+    }
+}
+
+/**
+ * Bits needed to code the symbols counted in freq with table, including the magnitude bits that
+ * follow each symbol. Returns UINT64_MAX if a symbol with a nonzero count has no code.
+ *
+ * Also adds an estimate of how many stuffed bytes those codes cause to stuffed_eighths, in
+ * eighths of a byte. A run of L >= 8 ones lands on a whole byte in (L - 7) of the 8 possible
+ * alignments, and a run that touches either end of a code is assumed to pick up one more one from
+ * its neighbour.
+ */
+static uint64_t huffman_coded_bits(const uint32_t freq[256], const jpeg_huffman_table_t* table,
+                                   uint64_t* stuffed_eighths)
+{
+    uint8_t code_length[256] = { 0 };
+    uint8_t code_stuffing[256] = { 0 };
+    uint32_t codedval = 0;
+    int idx = 0;
+    for (int bits = 0; bits < 16; bits++) {
+        codedval <<= 1;
+        for (int i = 0; i < table->number_of_codes_with_length[bits]; i++, idx++, codedval++) {
+            const uint8_t s = table->huffman_codes[idx];
+            code_length[s] = bits + 1;
+
+            int run = 0;
+            for (int b = bits; b >= -1; b--) {
+                if ((b >= 0) && ((codedval >> b) & 1)) {
+                    run++;
+                    continue;
                 }
-                //printf("jpeg recoding trace:    ========================================\n");
+                const int touches_ends = (run == (bits - b)) + (b == -1);
+                if ((run + touches_ends) > 7) {
+                    code_stuffing[s] += (run + touches_ends) - 7;
+                }
+                run = 0;
             }
         }
     }
 
-    bit_packer_fill_endbits(bp);
+    uint64_t bits = 0;
+    for (int s = 0; s < 256; s++) {
+        if (freq[s] == 0) {
+            continue;
+        }
+        if (code_length[s] == 0) {
+            return UINT64_MAX;
+        }
+        // the low nibble of both DC and AC symbols is the number of magnitude bits.
+        bits += (uint64_t)freq[s] * (code_length[s] + (s & 0x0f));
+        *stuffed_eighths += (uint64_t)freq[s] * code_stuffing[s];
+    }
 
-    entropy_coded_segment_t* target_ecs = result->scan.entropy_coded_segments[0];
-    target_ecs->size = bp->curidx;
-    target_ecs->data = malloc(target_ecs->size);
-    memcpy(target_ecs->data, bp->data, target_ecs->size);
+    return bits;
+}
 
-    bit_packer_destroy(bp);
+uint64_t jpeg_image_estimate_coded_size(const jpeg_image_t* jpeg,
+                                        const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                        bool optimize_huffman_tables)
+{
+    uint32_t dc_freq[4][256];
+    uint32_t ac_freq[4][256];
+    huffman_decoded_jpeg_scan_symbol_histogram(decoded_scan, jpeg, dc_freq, ac_freq);
+
+    jpeg_huffman_table_t dc_tables[4];
+    jpeg_huffman_table_t ac_tables[4];
+    memcpy(dc_tables, jpeg->dc_huffman_tables, sizeof(dc_tables));
+    memcpy(ac_tables, jpeg->ac_huffman_tables, sizeof(ac_tables));
+
+    bool dc_used[4] = { false };
+    bool ac_used[4] = { false };
+    for (int j = 0; j < jpeg->scan.jpeg_scan_header.num_components; j++) {
+        uint8_t huff_tables = jpeg->scan.jpeg_scan_header.csps[j].dc_ac_entropy_coding_table;
+        dc_used[(huff_tables >> 4) & 0x03] = true;
+        ac_used[(huff_tables >> 0) & 0x03] = true;
+    }
 
+    uint64_t bits = 0;
+    uint64_t stuffed_eighths = 0;
     for (int i = 0; i < 4; i++) {
-        free(dc_hrlts[i]);
-        free(ac_hrlts[i]);
+        if (dc_used[i]) {
+            if (optimize_huffman_tables) {
+                jpeg_huffman_table_build_optimal(dc_freq[i], 0x00 | i, &dc_tables[i]);
+            }
+            const uint64_t dc_bits = huffman_coded_bits(dc_freq[i], &dc_tables[i],
+                                                        &stuffed_eighths);
+            if (dc_bits == UINT64_MAX) {
+                return UINT64_MAX;
+            }
+            bits += dc_bits;
+        }
+        if (ac_used[i]) {
+            if (optimize_huffman_tables) {
+                jpeg_huffman_table_build_optimal(ac_freq[i], 0x10 | i, &ac_tables[i]);
+            }
+            const uint64_t ac_bits = huffman_coded_bits(ac_freq[i], &ac_tables[i],
+                                                        &stuffed_eighths);
+            if (ac_bits == UINT64_MAX) {
+                return UINT64_MAX;
+            }
+            bits += ac_bits;
+        }
     }
 
-    return result;
+    const int num_mcus = decoded_scan->mcu_map->num_mcus;
+    const int num_intervals = (jpeg->restart_interval != 0) ?
+                              ((num_mcus + jpeg->restart_interval - 1) / jpeg->restart_interval) : 1;
+
+    // every interval is padded out to a byte, which costs half a byte on average. Runs of ones
+    // that span magnitude bits and code boundaries add roughly another byte in 512; erring high
+    // keeps callers that fit a byte budget on the safe side.
+    uint64_t ecs_bytes = ((bits + 7) / 8) + (num_intervals / 2) + (stuffed_eighths / 8);
+    ecs_bytes += ecs_bytes / 512;
+
+    return jpeg_image_header_bytes(jpeg, dc_tables, ac_tables) + ecs_bytes +
+           (2 * (num_intervals - 1));
 }
 
 void jpeg_image_destroy(jpeg_image_t* jpeg)
@@ -1071,14 +3527,126 @@ void jpeg_image_destroy(jpeg_image_t* jpeg)
 
     free(jpeg->frame_header.csps);
 
+    for (int i = 0; i < jpeg->scan.num_ecs; i++) {
+        free(jpeg->scan.entropy_coded_segments[i]->data);
+        free(jpeg->scan.entropy_coded_segments[i]);
+    }
+    free(jpeg->scan.entropy_coded_segments);
+
     free(jpeg);
 }
 
+huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg_scan_copy(const huffman_decoded_jpeg_scan_t* s)
+{
+    huffman_decoded_jpeg_scan_t* result = calloc(1, sizeof(huffman_decoded_jpeg_scan_t));
+    memcpy(result, s, sizeof(huffman_decoded_jpeg_scan_t));
+    if (result->mcu_map != NULL) {
+        __atomic_add_fetch(&result->mcu_map->refcount, 1, __ATOMIC_RELAXED);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (s->components[i].blocks == NULL) {
+            continue;
+        }
+        result->components[i].blocks = malloc(s->components[i].num_blocks * sizeof(jpeg_block_t));
+        memcpy(result->components[i].blocks, s->components[i].blocks,
+               s->components[i].num_blocks * sizeof(jpeg_block_t));
+    }
+
+    return result;
+}
+
+/**
+ * Returns the index of the first coefficient that differs between two blocks, with 0 being the DC
+ * coefficient, or -1 if the blocks are identical.
+ */
+static int block_first_difference(const jpeg_block_t* a, const jpeg_block_t* b)
+{
+#ifdef __SSE2__
+    const __m128i* va = (const __m128i*)a;
+    const __m128i* vb = (const __m128i*)b;
+    for (int i = 0; i < (sizeof(jpeg_block_t) / sizeof(__m128i)); i++) {
+        const __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128(&va[i]), _mm_loadu_si128(&vb[i]));
+        const int mask = _mm_movemask_epi8(eq);
+        if (mask != 0xffff) {
+            // two mask bits per coefficient.
+            return (i * 8) + (__builtin_ctz(~mask) / 2);
+        }
+    }
+    return -1;
+#else
+    if (a->dc_value != b->dc_value) {
+        return 0;
+    }
+    for (int i = 0; i < 63; i++) {
+        if (a->ac_values[i] != b->ac_values[i]) {
+            return i + 1;
+        }
+    }
+    return -1;
+#endif
+}
+
+int huffman_decoded_jpeg_scan_compare(const huffman_decoded_jpeg_scan_t* a,
+                                      const huffman_decoded_jpeg_scan_t* b, int num_components,
+                                      huffman_decoded_jpeg_scan_mismatch_t* mismatch)
+{
+    // blocks are compared in chunks with memcmp, and only a chunk that differs is searched for
+    // the exact coefficient.
+    const uint32_t chunk_blocks = 256;
+
+    for (int c = 0; c < num_components; c++) {
+        const huffman_decoded_jpeg_component_t* ca = &a->components[c];
+        const huffman_decoded_jpeg_component_t* cb = &b->components[c];
+        if (ca->num_blocks != cb->num_blocks) {
+            if (mismatch != NULL) {
+                mismatch->component = c;
+                mismatch->block = (ca->num_blocks < cb->num_blocks) ? ca->num_blocks :
+                                                                      cb->num_blocks;
+                mismatch->coefficient = -1;
+                mismatch->expected = 0;
+                mismatch->actual = 0;
+            }
+            return -1;
+        }
+
+        for (uint32_t start = 0; start < ca->num_blocks; start += chunk_blocks) {
+            uint32_t n = ca->num_blocks - start;
+            if (n > chunk_blocks) {
+                n = chunk_blocks;
+            }
+            if (memcmp(&ca->blocks[start], &cb->blocks[start], n * sizeof(jpeg_block_t)) == 0) {
+                continue;
+            }
+
+            for (uint32_t i = start; i < (start + n); i++) {
+                const int k = block_first_difference(&ca->blocks[i], &cb->blocks[i]);
+                if (k < 0) {
+                    continue;
+                }
+                if (mismatch != NULL) {
+                    mismatch->component = c;
+                    mismatch->block = i;
+                    mismatch->coefficient = k;
+                    mismatch->expected = (k == 0) ? ca->blocks[i].dc_value :
+                                                    ca->blocks[i].ac_values[k - 1];
+                    mismatch->actual = (k == 0) ? cb->blocks[i].dc_value :
+                                                  cb->blocks[i].ac_values[k - 1];
+                }
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
 void huffman_decoded_jpeg_scan_destroy(huffman_decoded_jpeg_scan_t* decoded_scan)
 {
     for (int i = 0; i < 3; i++) {
         free(decoded_scan->components[i].blocks);
     }
+    jpeg_mcu_map_release(decoded_scan->mcu_map);
     free(decoded_scan);
 }
 
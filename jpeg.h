@@ -10,6 +10,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 ////////////////////////////////////////////////////////////////
 // miscellaneous, non-nesting jpeg segment types
@@ -147,6 +148,16 @@ typedef struct jpeg_image
 
     jpeg_frame_header_t frame_header;
 
+    // conditioning of arithmetic coded frames from the DAC segments, indexed by table
+    // destination: (U << 4) | L for the DC tables and Kx for the AC tables, as in B.2.4.3 of
+    // T.81. Tables that no DAC segment mentions keep the defaults of L = 0, U = 1 and Kx = 5.
+    uint8_t arithmetic_dc_conditioning[4];
+    uint8_t arithmetic_ac_conditioning[4];
+
+    // Number of MCUs per restart interval as given by the DRI segment; 0 if restart markers
+    // aren't used.
+    uint16_t restart_interval;
+
     // This software only supports a single scan
     jpeg_scan_t scan;
 } jpeg_image_t;
@@ -154,24 +165,122 @@ typedef struct jpeg_image
 
 typedef struct jpeg_block
 {
+    // absolute DC coefficient; the DPCM differences only exist in the entropy coded data.
     int16_t dc_value;
     int16_t ac_values[63];
 } jpeg_block_t;
 
+/**
+ * Maps between the zigzag order that coefficients are coded in and natural order, where index
+ * (v * 8) + u holds horizontal frequency u and vertical frequency v. Index 0 is the DC coefficient
+ * in both orders.
+ */
+extern const uint8_t jpeg_zigzag_to_natural[64];
+extern const uint8_t jpeg_natural_to_zigzag[64];
+
+typedef enum jpeg_coefficient_order
+{
+    JPEG_COEFFICIENT_ORDER_ZIGZAG = 0,
+    JPEG_COEFFICIENT_ORDER_NATURAL
+} jpeg_coefficient_order_t;
+
+/**
+ * Copy a block's 64 coefficients, DC included, from one order to the other. src and dst must not
+ * be the same block.
+ */
+void jpeg_block_zigzag_to_natural(const jpeg_block_t* src, jpeg_block_t* dst);
+void jpeg_block_natural_to_zigzag(const jpeg_block_t* src, jpeg_block_t* dst);
+
+/**
+ * Blocks of a component are stored as a raster-ordered plane. The plane is padded out to a whole
+ * number of MCUs, so it can be larger than the width_in_blocks x height_in_blocks blocks that
+ * actually hold image data.
+ */
 typedef struct huffman_decoded_jpeg_component
 {
+    // blocks that cover the component's samples, as in A.2.4 of T.81.
+    int width_in_blocks;
+    int height_in_blocks;
+
+    // dimensions of the padded plane.
+    int blocks_per_line;
+    int block_lines;
+
     uint32_t num_blocks;
     jpeg_block_t* blocks;
 } huffman_decoded_jpeg_component_t;
 
+#define JPEG_MAX_BLOCKS_PER_MCU 10
+
+/**
+ * Maps the scan's coding order onto the component planes. The k-th block of MCU m belongs to
+ * component block_component[k] and lives at index block_index[(m * blocks_per_mcu) + k] of that
+ * component's plane.
+ *
+ * The map only depends on the frame geometry, so it's built once per decoded scan and shared
+ * between copies.
+ */
+typedef struct jpeg_mcu_map
+{
+    int mcus_per_line;
+    int mcu_lines;
+    int num_mcus;
+
+    int blocks_per_mcu;
+    uint8_t block_component[JPEG_MAX_BLOCKS_PER_MCU];
+    uint32_t* block_index;
+
+    int refcount;
+} jpeg_mcu_map_t;
+
+/**
+ * One DC coefficient per block of a component, laid out like the component's block plane.
+ */
+typedef struct jpeg_dc_plane
+{
+    int width_in_blocks;
+    int height_in_blocks;
+    int blocks_per_line;
+    int block_lines;
+
+    int16_t* values;
+} jpeg_dc_plane_t;
+
+typedef struct huffman_decoded_jpeg_dc
+{
+    int num_components;
+    jpeg_dc_plane_t components[3];
+
+    int H_max;
+    int V_max;
+} huffman_decoded_jpeg_dc_t;
+
 typedef struct huffman_decoded_jpeg_scan
 {
     huffman_decoded_jpeg_component_t components[3];
 
     int H_max;
     int V_max;
+
+    // order of every block's coefficients. Recoding, requantizing and transforming all expect
+    // zigzag order, which is what jpeg_image_huffman_decode() produces.
+    jpeg_coefficient_order_t order;
+
+    jpeg_mcu_map_t* mcu_map;
 } huffman_decoded_jpeg_scan_t;
 
+/**
+ * Allocates a new baseline jpeg_image_t with a frame header and an interleaved scan header for
+ * the given dimensions. Component i uses quantization table min(i, 1) and huffman tables
+ * min(i, 1), but none of those tables are filled in, and the scan has no entropy coded data.
+ *
+ * sampling_factors holds one (H << 4) | V byte per component.
+ *
+ * Only 1 or 3 components are supported; returns NULL for any other count.
+ */
+jpeg_image_t* jpeg_image_create(uint16_t width, uint16_t height, int num_components,
+                                const uint8_t* sampling_factors);
+
 /**
  * Given a file path, decodes the jpeg's parts into a newly allocated jpeg_t struct.
  *
@@ -181,6 +290,12 @@ typedef struct huffman_decoded_jpeg_scan
  */
 jpeg_image_t* jpeg_image_load_from_file(const char* file);
 
+/**
+ * Same as jpeg_image_load_from_file(), but reads from the current position of an open stream,
+ * which is left just past the EOI marker.
+ */
+jpeg_image_t* jpeg_image_load_from_stream(FILE* fp);
+
 /**
  * Writes the given jpeg image to a file, first inserting all of the miscallenous segments, then
  * quantization tables, then huffman tables, then SOF, then SOS.
@@ -190,27 +305,222 @@ jpeg_image_t* jpeg_image_load_from_file(const char* file);
  */
 int jpeg_image_store_to_file(const char* filepath, const jpeg_image_t* jpeg);
 
+/**
+ * Same as jpeg_image_store_to_file(), but writes to an open stream.
+ */
+int jpeg_image_store_to_stream(FILE* fp, const jpeg_image_t* jpeg);
+
 jpeg_image_t* jpeg_image_copy(const jpeg_image_t* jpeg);
 
+/**
+ * Like jpeg_image_copy(), but only the headers, tables and misc segments are copied; the copy's
+ * scan has no entropy coded segments.
+ */
+jpeg_image_t* jpeg_image_copy_headers(const jpeg_image_t* jpeg);
+
+/**
+ * Allocates a new huffman_decoded_jpeg_scan_t with appropriately sized, zeroed block tables given
+ * the width, height, and sampling factors of the given jpeg, along with its MCU map.
+ *
+ * Returns NULL if the jpeg doesn't have 1 or 3 components, if a sampling factor is outside of
+ * [1, 4], or if an MCU would hold more than JPEG_MAX_BLOCKS_PER_MCU blocks.
+ */
+huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg_scan_create(const jpeg_image_t* jpeg);
+
 /**
  * Given a loaded jpeg_image_t, this undoes huffman, RLE, and DPCT coding on the AC and DC
  * components of the loaded jpeg, dumping the result into a newly allocated struct.
  */
 huffman_decoded_jpeg_scan_t* jpeg_image_huffman_decode(const jpeg_image_t* jpeg);
 
+/**
+ * Same as jpeg_image_huffman_decode(), but the decoder writes every coefficient straight to its
+ * natural order position, for callers that work on frequencies by row and column.
+ */
+huffman_decoded_jpeg_scan_t* jpeg_image_huffman_decode_natural(const jpeg_image_t* jpeg);
+
+/**
+ * Converts every block of decoded_scan to the given coefficient order in place. Does nothing if
+ * decoded_scan is already in that order.
+ */
+void huffman_decoded_jpeg_scan_reorder(huffman_decoded_jpeg_scan_t* decoded_scan,
+                                       jpeg_coefficient_order_t order);
+
+/**
+ * Returns the number of restart intervals in the scans of jpeg, which is 1 if jpeg has no restart
+ * markers. Each restart interval is stored in its own entropy coded segment.
+ */
+uint32_t huffman_decoded_jpeg_scan_num_intervals(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                 const jpeg_image_t* jpeg);
+
+/**
+ * Huffman decodes only the restart intervals of jpeg that are set in intervals, which has one
+ * entry per huffman_decoded_jpeg_scan_num_intervals(), into decoded_scan, an existing scan created
+ * for jpeg. The blocks of the other intervals are left as they were.
+ *
+ * Returns 0 on success, or -1 on a decoding error.
+ */
+int jpeg_image_huffman_decode_intervals(const jpeg_image_t* jpeg, const bool* intervals,
+                                        huffman_decoded_jpeg_scan_t* decoded_scan);
+
+/**
+ * Like jpeg_image_huffman_decode(), but only keeps the absolute DC coefficient of every block. AC
+ * symbols are huffman decoded to stay in sync with the bitstream, but their magnitudes are skipped
+ * and nothing is stored for them, which makes this a cheap way to get a 1/8-scale image.
+ */
+huffman_decoded_jpeg_dc_t* jpeg_image_huffman_decode_dc(const jpeg_image_t* jpeg);
+
+void huffman_decoded_jpeg_dc_destroy(huffman_decoded_jpeg_dc_t* decoded_dc);
+
 /**
  * Given a quantized, zigzagged huffman decoded jpeg scan and a jpeg_image_t containing coding
  * information like horizontal and vertical sampling factor, produces a newly allocated jpeg_image_t
  * with that information coded using the huffman tables provided in the jpeg_image_t.
  *
  * Of course, it's possible that the given huffman tables are incapable of coding either the new
- * DC or AC components. In the DC case, recoding is aborted. In the AC case, an error is printed and
- * that AC block is terminated prematurely with an EOB.
+ * DC or AC components, in which case NULL is returned. Requantized
+ * coefficients of an image whose tables were optimized for it regularly need such codes; see
+ * jpeg_image_huffman_recode().
+ *
+ * decoded_scan has to be in zigzag order; recoding a natural order scan fails.
  */
 jpeg_image_t* jpeg_image_huffman_recode_with_tables(const huffman_decoded_jpeg_scan_t* decoded_scan,
                                                     const jpeg_image_t* jpeg);
 
+/**
+ * Like jpeg_image_huffman_recode_with_tables(), but only the restart intervals set in intervals are
+ * coded from decoded_scan. Every other interval's entropy coded segment is copied from jpeg byte
+ * for byte, so those blocks of decoded_scan are never read and needn't have been decoded.
+ *
+ * Each restart interval resets the DC predictors and starts on a byte boundary, so the copied
+ * intervals stay valid as long as jpeg's huffman tables are kept.
+ */
+jpeg_image_t* jpeg_image_huffman_recode_intervals(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                  const jpeg_image_t* jpeg, const bool* intervals);
+
+/**
+ * Fills table with one of the example huffman tables from section K.3 of T.81.
+ *
+ * table_class is 0 for DC and 1 for AC.
+ */
+void jpeg_huffman_table_annex_k(int table_class, bool chrominance, uint8_t table_dest,
+                                jpeg_huffman_table_t* table);
+
+/**
+ * Fills table with a huffman table that optimally codes symbols with the given frequencies, as
+ * described in section K.2 of T.81. Code lengths are limited to 16 bits.
+ */
+void jpeg_huffman_table_build_optimal(const uint32_t freq[256], uint8_t tc_td,
+                                      jpeg_huffman_table_t* table);
+
+/**
+ * Fills code_length with the length in bits of table's code for every symbol, or 0 for symbols
+ * that the table has no code for.
+ */
+void jpeg_huffman_table_code_lengths(const jpeg_huffman_table_t* table, uint8_t code_length[256]);
+
+/**
+ * Counts how many times jpeg_image_huffman_recode_with_tables() would emit each DC and AC symbol
+ * when coding decoded_scan, indexed by [table destination][symbol].
+ */
+void huffman_decoded_jpeg_scan_symbol_histogram(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                const jpeg_image_t* jpeg,
+                                                uint32_t dc_freq[4][256],
+                                                uint32_t ac_freq[4][256]);
+
+/**
+ * Replaces every huffman table that jpeg's scan uses with one that's optimal for decoded_scan.
+ */
+void jpeg_image_optimize_huffman_tables(jpeg_image_t* jpeg,
+                                        const huffman_decoded_jpeg_scan_t* decoded_scan);
+
+/**
+ * Returns true if jpeg's huffman tables have a code for every DC and AC symbol that
+ * jpeg_image_huffman_recode_with_tables() would emit when coding decoded_scan.
+ */
+bool jpeg_image_huffman_tables_can_code(const jpeg_image_t* jpeg,
+                                        const huffman_decoded_jpeg_scan_t* decoded_scan);
+
+/**
+ * Like jpeg_image_huffman_recode_with_tables(), but if jpeg's huffman tables can't code
+ * decoded_scan, the result gets tables that are optimal for decoded_scan instead. jpeg isn't
+ * modified either way.
+ */
+jpeg_image_t* jpeg_image_huffman_recode(const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                        const jpeg_image_t* jpeg);
+
+/**
+ * Returns true if jpeg's frame is arithmetic coded. Sequential arithmetic coded frames decode into
+ * the same coefficient buffers as huffman coded ones, but can only be recoded once they've been
+ * through jpeg_image_arithmetic_to_huffman().
+ */
+bool jpeg_image_is_arithmetic_coded(const jpeg_image_t* jpeg);
+
+/**
+ * Turns the headers of an arithmetic coded jpeg into those of the equivalent huffman coded frame,
+ * with huffman tables that are optimal for decoded_scan. The frame becomes baseline if its sample
+ * precision and table selectors allow it, and extended sequential otherwise. Its entropy coded
+ * data is left alone, so the image has to be recoded from decoded_scan afterwards.
+ *
+ * Does nothing to huffman coded images.
+ */
+void jpeg_image_arithmetic_to_huffman(jpeg_image_t* jpeg,
+                                      const huffman_decoded_jpeg_scan_t* decoded_scan);
+
+/**
+ * Drops the quantization tables that jpeg's frame doesn't use and the huffman tables that its
+ * scan doesn't use, so that they aren't written out with it.
+ */
+void jpeg_image_strip_unused_tables(jpeg_image_t* jpeg);
+
+/**
+ * Estimates how many bytes jpeg_image_store_to_file() would write if decoded_scan were recoded
+ * with jpeg's huffman tables, or with optimal ones if optimize_huffman_tables is set. No
+ * entropy coding happens: the estimate is built from the symbol histogram plus the magnitude bits
+ * that follow each symbol.
+ *
+ * The entropy coded bit count is exact. Only byte stuffing and the padding at the end of each
+ * restart interval are approximated.
+ *
+ * Returns UINT64_MAX if jpeg's own tables have no code for a symbol the scan needs.
+ */
+uint64_t jpeg_image_estimate_coded_size(const jpeg_image_t* jpeg,
+                                        const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                        bool optimize_huffman_tables);
+
 void jpeg_image_destroy(jpeg_image_t* jpeg_image);
 
+/**
+ * Returns a newly allocated deep copy of the given decoded scan.
+ */
+huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg_scan_copy(const huffman_decoded_jpeg_scan_t* s);
+
+/**
+ * Location of the first coefficient that differs between two decoded scans.
+ */
+typedef struct huffman_decoded_jpeg_scan_mismatch
+{
+    int component;
+    uint32_t block;
+
+    // zigzag index, with 0 being the DC coefficient. -1 if the components have different block
+    // counts, in which case block is the smaller count.
+    int coefficient;
+
+    int16_t expected;
+    int16_t actual;
+} huffman_decoded_jpeg_scan_mismatch_t;
+
+/**
+ * Compares the first num_components component planes of two decoded scans coefficient for
+ * coefficient.
+ *
+ * Returns 0 if they're identical. Otherwise returns -1 and, if mismatch isn't NULL, fills it in
+ * with the first difference found.
+ */
+int huffman_decoded_jpeg_scan_compare(const huffman_decoded_jpeg_scan_t* a,
+                                      const huffman_decoded_jpeg_scan_t* b, int num_components,
+                                      huffman_decoded_jpeg_scan_mismatch_t* mismatch);
+
 void huffman_decoded_jpeg_scan_destroy(huffman_decoded_jpeg_scan_t* decoded_scan);
 #endif
@@ -0,0 +1,465 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jpeg_cache.h"
+#include "jpeg_stats.h"
+
+static const char* entry_suffix = ".jcoef";
+
+/**
+ * Pads the stream with zeros up to the next JPEG_COEFFICIENT_FILE_ALIGNMENT boundary and returns
+ * the new offset.
+ */
+static uint64_t write_alignment_padding(FILE* fp)
+{
+    static const uint8_t zeros[JPEG_COEFFICIENT_FILE_ALIGNMENT] = { 0 };
+    const uint64_t offset = ftell(fp);
+    const uint64_t padding = (JPEG_COEFFICIENT_FILE_ALIGNMENT -
+                              (offset % JPEG_COEFFICIENT_FILE_ALIGNMENT)) %
+                             JPEG_COEFFICIENT_FILE_ALIGNMENT;
+    fwrite(zeros, 1, padding, fp);
+    return offset + padding;
+}
+
+int jpeg_coefficient_file_store(const char* path, const jpeg_image_t* jpeg,
+                                const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                uint64_t content_hash)
+{
+    const int num_components = jpeg->frame_header.num_components;
+    if ((num_components < 1) || (num_components > 3)) {
+        return -1;
+    }
+
+    // the marker segments are written exactly as they'd appear in a jpeg with an empty scan. That
+    // isn't output the caller asked for, so it stays out of their stats.
+    char* segments = NULL;
+    size_t segments_size = 0;
+    FILE* segments_fp = open_memstream(&segments, &segments_size);
+    if (segments_fp == NULL) {
+        return -1;
+    }
+    jpeg_image_t headers = *jpeg;
+    headers.scan.num_ecs = 0;
+    jpeg_stats_t* stats = jpeg_stats_active;
+    jpeg_stats_attach(NULL);
+    int retval = jpeg_image_store_to_stream(segments_fp, &headers);
+    jpeg_stats_attach(stats);
+    fclose(segments_fp);
+    if (retval) {
+        free(segments);
+        return -1;
+    }
+
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        free(segments);
+        return -1;
+    }
+
+    jpeg_coefficient_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JPEG_COEFFICIENT_FILE_MAGIC, sizeof(header.magic));
+    header.version = JPEG_COEFFICIENT_FILE_VERSION;
+    header.num_components = num_components;
+    header.content_hash = content_hash;
+
+    // the header is written twice; the second time with the offsets filled in.
+    fwrite(&header, sizeof(header), 1, fp);
+    header.segments_offset = write_alignment_padding(fp);
+    header.segments_size = segments_size;
+    fwrite(segments, 1, segments_size, fp);
+    free(segments);
+
+    for (int c = 0; c < num_components; c++) {
+        const huffman_decoded_jpeg_component_t* component = &decoded_scan->components[c];
+        jpeg_coefficient_plane_header_t* plane = &header.planes[c];
+        plane->num_blocks = component->num_blocks;
+
+        plane->masks_offset = write_alignment_padding(fp);
+        for (uint32_t i = 0; i < component->num_blocks; i++) {
+            const int16_t* coefficients = (const int16_t*)&component->blocks[i];
+            uint64_t mask = 0;
+            for (int j = 0; j < 64; j++) {
+                mask |= (uint64_t)(coefficients[j] != 0) << j;
+            }
+            fwrite(&mask, sizeof(mask), 1, fp);
+            plane->num_values += __builtin_popcountll(mask);
+        }
+
+        plane->values_offset = write_alignment_padding(fp);
+        for (uint32_t i = 0; i < component->num_blocks; i++) {
+            const int16_t* coefficients = (const int16_t*)&component->blocks[i];
+            int16_t values[64];
+            int n = 0;
+            for (int j = 0; j < 64; j++) {
+                if (coefficients[j] != 0) {
+                    values[n++] = coefficients[j];
+                }
+            }
+            fwrite(values, sizeof(int16_t), n, fp);
+        }
+    }
+    write_alignment_padding(fp);
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+
+    retval = ferror(fp) ? -1 : 0;
+    if (fclose(fp) != 0) {
+        retval = -1;
+    }
+    return retval;
+}
+
+/**
+ * Expands one sparse plane into component's blocks, which must already be zeroed. Returns -1 if
+ * the masks call for more values than the plane holds.
+ */
+static int expand_plane(const uint64_t* masks, const int16_t* values, uint32_t num_values,
+                        huffman_decoded_jpeg_component_t* component)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < component->num_blocks; i++) {
+        int16_t* coefficients = (int16_t*)&component->blocks[i];
+        uint64_t mask = masks[i];
+        if ((n + __builtin_popcountll(mask)) > num_values) {
+            return -1;
+        }
+        while (mask != 0) {
+            coefficients[__builtin_ctzll(mask)] = values[n++];
+            mask &= mask - 1;
+        }
+    }
+
+    return (n == num_values) ? 0 : -1;
+}
+
+int jpeg_coefficient_file_load(const char* path, uint64_t content_hash, jpeg_image_t** jpeg,
+                               huffman_decoded_jpeg_scan_t** decoded_scan)
+{
+    const uint64_t t0 = JPEG_STATS_TIMER_START();
+    *jpeg = NULL;
+    *decoded_scan = NULL;
+
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < sizeof(jpeg_coefficient_file_header_t))) {
+        close(fd);
+        return -1;
+    }
+    const uint64_t file_size = st.st_size;
+    const uint8_t* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    int retval = -1;
+    const jpeg_coefficient_file_header_t* header = (const jpeg_coefficient_file_header_t*)data;
+    if ((memcmp(header->magic, JPEG_COEFFICIENT_FILE_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != JPEG_COEFFICIENT_FILE_VERSION) ||
+        (header->content_hash != content_hash) ||
+        (header->num_components < 1) || (header->num_components > 3) ||
+        (header->segments_offset > file_size) ||
+        (header->segments_size > (file_size - header->segments_offset))) {
+        goto cleanup;
+    }
+    for (int c = 0; c < header->num_components; c++) {
+        const jpeg_coefficient_plane_header_t* plane = &header->planes[c];
+        if ((plane->masks_offset > file_size) ||
+            (((uint64_t)plane->num_blocks * sizeof(uint64_t)) >
+             (file_size - plane->masks_offset)) ||
+            (plane->values_offset > file_size) ||
+            (((uint64_t)plane->num_values * sizeof(int16_t)) >
+             (file_size - plane->values_offset)) ||
+            ((plane->masks_offset % sizeof(uint64_t)) != 0) ||
+            ((plane->values_offset % sizeof(int16_t)) != 0)) {
+            goto cleanup;
+        }
+    }
+
+    FILE* segments_fp = fmemopen((void*)&data[header->segments_offset], header->segments_size,
+                                 "rb");
+    if (segments_fp == NULL) {
+        goto cleanup;
+    }
+    // the whole file counts as one load, below.
+    jpeg_stats_t* stats = jpeg_stats_active;
+    jpeg_stats_attach(NULL);
+    *jpeg = jpeg_image_load_from_stream(segments_fp);
+    jpeg_stats_attach(stats);
+    fclose(segments_fp);
+    if ((*jpeg == NULL) || ((*jpeg)->frame_header.num_components != header->num_components)) {
+        goto cleanup;
+    }
+
+    *decoded_scan = huffman_decoded_jpeg_scan_create(*jpeg);
+    if (*decoded_scan == NULL) {
+        goto cleanup;
+    }
+    for (int c = 0; c < header->num_components; c++) {
+        const jpeg_coefficient_plane_header_t* plane = &header->planes[c];
+        huffman_decoded_jpeg_component_t* component = &(*decoded_scan)->components[c];
+        if ((plane->num_blocks != component->num_blocks) ||
+            expand_plane((const uint64_t*)&data[plane->masks_offset],
+                         (const int16_t*)&data[plane->values_offset], plane->num_values,
+                         component)) {
+            goto cleanup;
+        }
+    }
+
+    retval = 0;
+    JPEG_STATS_ADD(bytes_read, file_size);
+    JPEG_STATS_TIMER_STOP(JPEG_STATS_LOAD, t0);
+
+cleanup:
+    if (retval) {
+        if (*decoded_scan != NULL) {
+            huffman_decoded_jpeg_scan_destroy(*decoded_scan);
+            *decoded_scan = NULL;
+        }
+        if (*jpeg != NULL) {
+            jpeg_image_destroy(*jpeg);
+            *jpeg = NULL;
+        }
+    }
+    munmap((void*)data, file_size);
+    return retval;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t jpeg_content_hash(const uint8_t* data, size_t size)
+{
+    const uint64_t k1 = 0x87c37b91114253d5ULL;
+    const uint64_t k2 = 0x4cf5ad432745937fULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+
+    size_t i = 0;
+    for (; (i + 8) <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, &data[i], sizeof(w));
+        h ^= rotl64(w * k1, 31) * k2;
+        h = (rotl64(h, 27) * 5) + 0x52dce729;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, &data[i], size - i);
+    h ^= rotl64(tail * k1, 31) * k2;
+
+    // final avalanche, as in MurmurHash3's fmix64.
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+jpeg_cache_t* jpeg_cache_open(const char* dir, uint64_t max_bytes)
+{
+    if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+        return NULL;
+    }
+
+    jpeg_cache_t* cache = calloc(1, sizeof(jpeg_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->dir = strdup(dir);
+    if (cache->dir == NULL) {
+        free(cache);
+        return NULL;
+    }
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void jpeg_cache_close(jpeg_cache_t* cache)
+{
+    free(cache->dir);
+    free(cache);
+}
+
+static void cache_entry_path(const jpeg_cache_t* cache, uint64_t content_hash, char* path,
+                             size_t size)
+{
+    snprintf(path, size, "%s/%016llx%s", cache->dir, (unsigned long long)content_hash,
+             entry_suffix);
+}
+
+int jpeg_cache_lookup(jpeg_cache_t* cache, uint64_t content_hash, jpeg_image_t** jpeg,
+                      huffman_decoded_jpeg_scan_t** decoded_scan)
+{
+    char path[4096];
+    cache_entry_path(cache, content_hash, path, sizeof(path));
+    if (jpeg_coefficient_file_load(path, content_hash, jpeg, decoded_scan)) {
+        return -1;
+    }
+
+    // bump the entry to most recently used.
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return 0;
+}
+
+typedef struct cache_entry
+{
+    char* name;
+    uint64_t size;
+    struct timespec mtime;
+} cache_entry_t;
+
+static int cache_entry_compare_mtime(const void* a, const void* b)
+{
+    const cache_entry_t* ea = a;
+    const cache_entry_t* eb = b;
+    if (ea->mtime.tv_sec != eb->mtime.tv_sec) {
+        return (ea->mtime.tv_sec < eb->mtime.tv_sec) ? -1 : 1;
+    }
+    if (ea->mtime.tv_nsec != eb->mtime.tv_nsec) {
+        return (ea->mtime.tv_nsec < eb->mtime.tv_nsec) ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Deletes the least recently used entries until the cache is no bigger than its limit.
+ */
+static void cache_evict(jpeg_cache_t* cache)
+{
+    DIR* dir = opendir(cache->dir);
+    if (dir == NULL) {
+        return;
+    }
+
+    cache_entry_t* entries = NULL;
+    int num_entries = 0;
+    uint64_t total = 0;
+    const size_t suffix_len = strlen(entry_suffix);
+
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        const size_t len = strlen(de->d_name);
+        if ((len <= suffix_len) || (strcmp(&de->d_name[len - suffix_len], entry_suffix) != 0)) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) != 0) {
+            continue;
+        }
+
+        // out of memory, the entries seen so far are all there is to evict from.
+        cache_entry_t* grown = realloc(entries, (num_entries + 1) * sizeof(cache_entry_t));
+        if (grown == NULL) {
+            break;
+        }
+        entries = grown;
+        entries[num_entries].name = strdup(de->d_name);
+        if (entries[num_entries].name == NULL) {
+            break;
+        }
+        entries[num_entries].size = st.st_size;
+        entries[num_entries].mtime = st.st_mtim;
+        num_entries++;
+        total += st.st_size;
+    }
+
+    qsort(entries, num_entries, sizeof(cache_entry_t), cache_entry_compare_mtime);
+    for (int i = 0; (i < num_entries) && (total > cache->max_bytes); i++) {
+        if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+            total -= entries[i].size;
+        }
+    }
+
+    for (int i = 0; i < num_entries; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+    closedir(dir);
+}
+
+int jpeg_cache_insert(jpeg_cache_t* cache, uint64_t content_hash, const jpeg_image_t* jpeg,
+                      const huffman_decoded_jpeg_scan_t* decoded_scan)
+{
+    // the counter keeps threads of one process that insert the same image from sharing a temp file.
+    static uint32_t tmp_counter = 0;
+    const uint32_t tmp_id = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+
+    char path[4096];
+    char tmp_path[4096];
+    cache_entry_path(cache, content_hash, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%016llx.%d.%u.tmp", cache->dir,
+             (unsigned long long)content_hash, (int)getpid(), (unsigned)tmp_id);
+
+    // entries appear atomically, so a concurrent reader never sees half of one.
+    if (jpeg_coefficient_file_store(tmp_path, jpeg, decoded_scan, content_hash) ||
+        rename(tmp_path, path)) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    cache_evict(cache);
+    return 0;
+}
+
+int jpeg_cache_load_file(jpeg_cache_t* cache, const char* path, jpeg_image_t** jpeg,
+                         huffman_decoded_jpeg_scan_t** decoded_scan)
+{
+    *jpeg = NULL;
+    *decoded_scan = NULL;
+
+    // the whole file has to be read to hash it, so on a miss it's parsed from memory as well.
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    const long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t* data = (size > 0) ? malloc(size) : NULL;
+    if ((data == NULL) || (fread(data, 1, size, fp) != size)) {
+        free(data);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    const uint64_t content_hash = jpeg_content_hash(data, size);
+    if (jpeg_cache_lookup(cache, content_hash, jpeg, decoded_scan) == 0) {
+        free(data);
+        return 0;
+    }
+
+    FILE* mem_fp = fmemopen(data, size, "rb");
+    if (mem_fp != NULL) {
+        *jpeg = jpeg_image_load_from_stream(mem_fp);
+        fclose(mem_fp);
+    }
+    free(data);
+    if (*jpeg == NULL) {
+        return -1;
+    }
+
+    *decoded_scan = jpeg_image_huffman_decode(*jpeg);
+    if (*decoded_scan == NULL) {
+        jpeg_image_destroy(*jpeg);
+        *jpeg = NULL;
+        return -1;
+    }
+
+    jpeg_cache_insert(cache, content_hash, *jpeg, *decoded_scan);
+    return 0;
+}
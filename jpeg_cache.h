@@ -0,0 +1,116 @@
+#ifndef JPEG_CACHE_H
+#define JPEG_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jpeg.h"
+
+/**
+ * On-disk cache of huffman decoded scans, so that an image that's requested again can skip
+ * parsing and huffman decoding.
+ *
+ * Each entry is one coefficient file. A coefficient file starts with a fixed header, followed by
+ * the image's marker segments (everything but the entropy coded data, exactly as
+ * jpeg_image_store_to_stream() writes them) and then one sparse coefficient plane per component.
+ * Every section starts on a JPEG_COEFFICIENT_FILE_ALIGNMENT byte boundary, and all fields are in
+ * host byte order, so files are meant to be mmap'd on the machine that wrote them.
+ *
+ * A plane holds a 64-bit mask per block, with bit i set if zigzag coefficient i (0 being DC) is
+ * nonzero, followed by the nonzero values of every block packed together as int16_t.
+ */
+
+#define JPEG_COEFFICIENT_FILE_MAGIC "JPEGCOEF"
+#define JPEG_COEFFICIENT_FILE_VERSION 1
+#define JPEG_COEFFICIENT_FILE_ALIGNMENT 64
+
+typedef struct jpeg_coefficient_plane_header
+{
+    uint64_t masks_offset;
+    uint64_t values_offset;
+    uint32_t num_blocks;
+    uint32_t num_values;
+} jpeg_coefficient_plane_header_t;
+
+typedef struct jpeg_coefficient_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_components;
+
+    uint64_t content_hash;
+
+    uint64_t segments_offset;
+    uint64_t segments_size;
+
+    jpeg_coefficient_plane_header_t planes[3];
+} jpeg_coefficient_file_header_t;
+
+/**
+ * Writes jpeg's marker segments and decoded_scan's coefficients to path. content_hash is stored
+ * alongside them so that readers can tell which image the file came from.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int jpeg_coefficient_file_store(const char* path, const jpeg_image_t* jpeg,
+                                const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                uint64_t content_hash);
+
+/**
+ * mmaps a coefficient file and rebuilds the jpeg_image_t and huffman_decoded_jpeg_scan_t that
+ * were stored in it. The returned image has no entropy coded data; it's only good for recoding.
+ *
+ * Returns 0 on success. Returns -1 if the file is missing, truncated, or doesn't match the
+ * expected content_hash, in which case nothing is allocated.
+ */
+int jpeg_coefficient_file_load(const char* path, uint64_t content_hash, jpeg_image_t** jpeg,
+                               huffman_decoded_jpeg_scan_t** decoded_scan);
+
+/**
+ * 64-bit hash of a buffer, used to key cache entries. Fast, but not cryptographic.
+ */
+uint64_t jpeg_content_hash(const uint8_t* data, size_t size);
+
+/**
+ * A directory of coefficient files named after the content hash of their source jpeg, holding at
+ * most max_bytes of them. Once an insert takes the directory over that limit, the least recently
+ * used entries are deleted. Recency is tracked with each file's modification time, which a hit
+ * refreshes.
+ */
+typedef struct jpeg_cache
+{
+    char* dir;
+    uint64_t max_bytes;
+} jpeg_cache_t;
+
+/**
+ * Returns NULL if dir doesn't exist and can't be created, or if out of memory.
+ */
+jpeg_cache_t* jpeg_cache_open(const char* dir, uint64_t max_bytes);
+
+void jpeg_cache_close(jpeg_cache_t* cache);
+
+/**
+ * Returns 0 and fills in jpeg and decoded_scan if the cache holds an entry for content_hash, or -1
+ * otherwise.
+ */
+int jpeg_cache_lookup(jpeg_cache_t* cache, uint64_t content_hash, jpeg_image_t** jpeg,
+                      huffman_decoded_jpeg_scan_t** decoded_scan);
+
+/**
+ * Adds an entry for content_hash, then evicts least recently used entries until the cache fits in
+ * its size limit again. Returns 0 on success and -1 on failure.
+ */
+int jpeg_cache_insert(jpeg_cache_t* cache, uint64_t content_hash, const jpeg_image_t* jpeg,
+                      const huffman_decoded_jpeg_scan_t* decoded_scan);
+
+/**
+ * Loads and huffman decodes the jpeg at path, going through the cache. On a miss, the file is
+ * decoded as usual and the result inserted.
+ *
+ * Returns 0 on success and -1 if the file can't be read or decoded.
+ */
+int jpeg_cache_load_file(jpeg_cache_t* cache, const char* path, jpeg_image_t** jpeg,
+                         huffman_decoded_jpeg_scan_t** decoded_scan);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jpeg_preview.h"
+
+static uint8_t clamp_sample(int v)
+{
+    return (v < 0) ? 0 : ((v > 255) ? 255 : v);
+}
+
+uint8_t* jpeg_dc_preview_render(const jpeg_image_t* jpeg,
+                                const huffman_decoded_jpeg_dc_t* decoded_dc, int* width,
+                                int* height)
+{
+    const int num_components = decoded_dc->num_components;
+    const int w = (jpeg->frame_header.samples_per_line + 7) / 8;
+    const int h = (jpeg->frame_header.number_of_lines + 7) / 8;
+
+    // samples are worked out at the frame's precision and then scaled to 8 bits.
+    const int precision = jpeg->frame_header.sample_precision;
+    if ((precision != 8) && (precision != 12)) {
+        return NULL;
+    }
+    const int level_shift = 1 << (precision - 1);
+    const int max_sample = (1 << precision) - 1;
+
+    const size_t num_pixels = (size_t)w * (size_t)h;
+    if ((num_components < 1) || (num_components > 3) ||
+        (num_pixels > (SIZE_MAX / (size_t)num_components))) {
+        return NULL;
+    }
+
+    int dc_step[3];
+    for (int c = 0; c < num_components; c++) {
+        const int qt_idx = jpeg->frame_header.csps[c].quantization_table_selector & 0x03;
+        const jpeg_quantization_table_t* qt = &jpeg->jpeg_quantization_tables[qt_idx];
+        if (!qt->table_valid) {
+            return NULL;
+        }
+        dc_step[c] = (((qt->pq_tq >> 4) & 0x0f) != 0) ? qt->Q[0]._16 : qt->Q[0]._8;
+    }
+
+    uint8_t* pixels = malloc(num_pixels * num_components);
+    if (pixels == NULL) {
+        return NULL;
+    }
+    for (int c = 0; c < num_components; c++) {
+        const jpeg_dc_plane_t* plane = &decoded_dc->components[c];
+
+        // a grayscale scan isn't interleaved, so its blocks map onto the image one to one.
+        const bool grayscale = (num_components == 1);
+        const int H = grayscale ? 1 : jpeg->frame_header.csps[c].horizontal_sampling_factor;
+        const int V = grayscale ? 1 : jpeg->frame_header.csps[c].vertical_sampling_factor;
+        const int H_max = grayscale ? 1 : decoded_dc->H_max;
+        const int V_max = grayscale ? 1 : decoded_dc->V_max;
+
+        for (int y = 0; y < h; y++) {
+            int by = (y * V) / V_max;
+            if (by >= plane->block_lines) {
+                by = plane->block_lines - 1;
+            }
+            const int16_t* row = &plane->values[by * plane->blocks_per_line];
+            uint8_t* out = &pixels[(y * w * num_components) + c];
+
+            for (int x = 0; x < w; x++, out += num_components) {
+                int bx = (x * H) / H_max;
+                if (bx >= plane->blocks_per_line) {
+                    bx = plane->blocks_per_line - 1;
+                }
+                const int v = row[bx] * dc_step[c];
+                int sample = level_shift + ((v + ((v < 0) ? -4 : 4)) / 8);
+                sample = (sample < 0) ? 0 : ((sample > max_sample) ? max_sample : sample);
+                *out = ((sample * 255) + (max_sample / 2)) / max_sample;
+            }
+        }
+    }
+
+    *width = w;
+    *height = h;
+    return pixels;
+}
+
+int jpeg_dc_preview_store_to_file(const char* path, const jpeg_image_t* jpeg,
+                                  const huffman_decoded_jpeg_dc_t* decoded_dc)
+{
+    int w, h;
+    uint8_t* pixels = jpeg_dc_preview_render(jpeg, decoded_dc, &w, &h);
+    if (pixels == NULL) {
+        return -1;
+    }
+
+    const int num_components = decoded_dc->num_components;
+    if (num_components == 3) {
+        // YCbCr to RGB as in JFIF, with 16.16 fixed point factors.
+        for (int i = 0; i < (w * h); i++) {
+            uint8_t* p = &pixels[i * 3];
+            const int y = p[0] << 16;
+            const int cb = p[1] - 128;
+            const int cr = p[2] - 128;
+            p[0] = clamp_sample((y + (91881 * cr) + (1 << 15)) >> 16);
+            p[1] = clamp_sample((y - (22554 * cb) - (46802 * cr) + (1 << 15)) >> 16);
+            p[2] = clamp_sample((y + (116130 * cb) + (1 << 15)) >> 16);
+        }
+    }
+
+    int retval = -1;
+    FILE* fp = fopen(path, "wb");
+    if (fp != NULL) {
+        fprintf(fp, "P%i\n%i %i\n255\n", (num_components == 1) ? 5 : 6, w, h);
+        fwrite(pixels, num_components, w * h, fp);
+        retval = ferror(fp) ? -1 : 0;
+        if (fclose(fp)) {
+            retval = -1;
+        }
+    }
+
+    free(pixels);
+    return retval;
+}
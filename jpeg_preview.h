@@ -0,0 +1,36 @@
+#ifndef JPEG_PREVIEW_H
+#define JPEG_PREVIEW_H
+
+#include "jpeg.h"
+
+/**
+ * 1/8-scale previews built from the DC coefficients alone.
+ *
+ * The DC coefficient of a block is 8 times the average of its 64 samples, less the level shift,
+ * so dequantizing it gives one pixel per 8x8 block of the full resolution image. Subsampled
+ * components are upsampled by repeating their pixels.
+ */
+
+/**
+ * Renders decoded_dc, which was decoded from jpeg, to a newly allocated image of
+ * ceil(width / 8) x ceil(height / 8) pixels. Pixels are stored row by row with num_components
+ * interleaved samples each, in the color space of the jpeg (normally Y or YCbCr). Frames with
+ * 12-bit samples are scaled down to 8 bits.
+ *
+ * Returns NULL if the frame's sample precision is neither 8 nor 12 bits, if a component references
+ * an undefined quantization table, or if the image can't be allocated.
+ */
+uint8_t* jpeg_dc_preview_render(const jpeg_image_t* jpeg,
+                                const huffman_decoded_jpeg_dc_t* decoded_dc, int* width,
+                                int* height);
+
+/**
+ * Writes the preview of decoded_dc to path as a binary PGM for grayscale images, or as a PPM for
+ * three-component ones, which are taken to be JFIF YCbCr and converted to RGB.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int jpeg_dc_preview_store_to_file(const char* path, const jpeg_image_t* jpeg,
+                                  const huffman_decoded_jpeg_dc_t* decoded_dc);
+
+#endif
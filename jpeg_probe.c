@@ -0,0 +1,222 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "jpeg_probe.h"
+#include "jpeg-requantizer.h"
+
+const static uint8_t SOF_0 = 0xc0;
+const static uint8_t DHT = 0xc4;
+const static uint8_t JPG = 0xc8;
+const static uint8_t DAC = 0xcc;
+const static uint8_t SOF_15 = 0xcf;
+const static uint8_t RST_0 = 0xd0;
+const static uint8_t RST_7 = 0xd7;
+const static uint8_t SOI = 0xd8;
+const static uint8_t EOI = 0xd9;
+const static uint8_t SOS = 0xda;
+const static uint8_t DQT = 0xdb;
+const static uint8_t DRI = 0xdd;
+const static uint8_t TEM = 0x01;
+
+// most files have their headers in the first few kilobytes, so an fd is read in chunks this big.
+#define PROBE_CHUNK_SIZE 4096
+
+/**
+ * Bytes are pulled from either a buffer or an fd through the same interface. An fd source keeps
+ * the most recently read chunk around and goes back to the file only for ranges outside of it.
+ */
+typedef struct probe_source
+{
+    const uint8_t* data;
+    uint64_t size;
+
+    int fd;
+    uint64_t chunk_offset;
+    uint64_t chunk_size;
+    uint8_t chunk[PROBE_CHUNK_SIZE];
+} probe_source_t;
+
+/**
+ * Copies n bytes at offset into dest. Returns 0 on success and -1 if they aren't all there.
+ */
+static int probe_read(probe_source_t* src, uint64_t offset, void* dest, size_t n)
+{
+    if (src->data != NULL) {
+        if ((offset > src->size) || (n > (src->size - offset))) {
+            return -1;
+        }
+        memcpy(dest, &src->data[offset], n);
+        return 0;
+    }
+
+    if (n > PROBE_CHUNK_SIZE) {
+        return (pread(src->fd, dest, n, offset) == (ssize_t)n) ? 0 : -1;
+    }
+    if ((offset < src->chunk_offset) || ((offset + n) > (src->chunk_offset + src->chunk_size))) {
+        const ssize_t got = pread(src->fd, src->chunk, PROBE_CHUNK_SIZE, offset);
+        if (got < 0) {
+            return -1;
+        }
+        src->chunk_offset = offset;
+        src->chunk_size = got;
+        if (n > src->chunk_size) {
+            return -1;
+        }
+    }
+    memcpy(dest, &src->chunk[offset - src->chunk_offset], n);
+    return 0;
+}
+
+static int probe_frame_header(const uint8_t* buf, uint16_t length, jpeg_probe_t* probe)
+{
+    if (length < 6) {
+        return -1;
+    }
+    probe->sample_precision = buf[0];
+    probe->height = (buf[1] << 8) | buf[2];
+    probe->width = (buf[3] << 8) | buf[4];
+    probe->num_components = buf[5];
+    if ((probe->num_components < 1) || (probe->num_components > 4) ||
+        (length != (6 + (3 * probe->num_components)))) {
+        return -1;
+    }
+
+    for (int i = 0; i < probe->num_components; i++) {
+        frame_component_specification_parameters_t* csp = &probe->csps[i];
+        csp->component_identifier = buf[6 + (3 * i)];
+        csp->horizontal_sampling_factor = buf[7 + (3 * i)] >> 4;
+        csp->vertical_sampling_factor = buf[7 + (3 * i)] & 0x0f;
+        csp->quantization_table_selector = buf[8 + (3 * i)];
+    }
+    return 0;
+}
+
+static int probe_quantization_tables(const uint8_t* buf, uint16_t length, jpeg_probe_t* probe)
+{
+    int idx = 0;
+    while (idx < length) {
+        const uint8_t pq_tq = buf[idx++];
+        const int table_precision = pq_tq >> 4;
+        const int table_dest = pq_tq & 0x0f;
+        if ((table_precision > 1) || (table_dest > 3) ||
+            ((idx + (64 << table_precision)) > length)) {
+            return -1;
+        }
+
+        jpeg_quantization_table_t* dest = &probe->quantization_tables[table_dest];
+        dest->table_valid = true;
+        dest->pq_tq = pq_tq;
+        for (int i = 0; i < 64; i++) {
+            if (table_precision == 0) {
+                dest->Q[i]._8 = buf[idx];
+                idx += 1;
+            } else {
+                dest->Q[i]._16 = (buf[idx] << 8) | buf[idx + 1];
+                idx += 2;
+            }
+        }
+    }
+    return 0;
+}
+
+static int probe_segments(probe_source_t* src, jpeg_probe_t* probe)
+{
+    memset(probe, 0, sizeof(*probe));
+
+    uint8_t buf[4];
+    if (probe_read(src, 0, buf, 2) || (buf[0] != 0xff) || (buf[1] != SOI)) {
+        return -1;
+    }
+
+    uint64_t offset = 2;
+    while (1) {
+        // markers may be preceded by any number of 0xff fill bytes.
+        if (probe_read(src, offset, buf, 2) || (buf[0] != 0xff)) {
+            return -1;
+        }
+        offset += 1;
+        while (buf[1] == 0xff) {
+            if (probe_read(src, ++offset, &buf[1], 1)) {
+                return -1;
+            }
+        }
+        const uint8_t marker = buf[1];
+        offset += 1;
+
+        // TEM and RSTn stand alone; nothing else before the first scan does.
+        if ((marker == TEM) || ((marker >= RST_0) && (marker <= RST_7))) {
+            continue;
+        }
+        if ((marker == 0x00) || (marker == SOI) || (marker == EOI)) {
+            return -1;
+        }
+
+        if (probe_read(src, offset, buf, 2)) {
+            return -1;
+        }
+        const uint16_t Ls = (buf[0] << 8) | buf[1];
+        if (Ls < 2) {
+            return -1;
+        }
+        const uint16_t length = Ls - 2;
+        const uint64_t payload = offset + 2;
+        offset = payload + length;
+
+        const bool is_sof = ((marker >= SOF_0) && (marker <= SOF_15) && (marker != DHT) &&
+                             (marker != JPG) && (marker != DAC));
+        if (marker == SOS) {
+            // the scan header has to be there in full too.
+            if ((probe->sof_marker == 0) || probe_read(src, offset - 1, buf, 1)) {
+                return -1;
+            }
+            probe->header_size = offset;
+            break;
+        } else if (is_sof || (marker == DQT) || (marker == DRI)) {
+            uint8_t segment[UINT16_MAX];
+            if (probe_read(src, payload, segment, length)) {
+                return -1;
+            }
+
+            if (is_sof) {
+                probe->sof_marker = marker;
+                if (probe_frame_header(segment, length, probe)) {
+                    return -1;
+                }
+            } else if (marker == DQT) {
+                if (probe_quantization_tables(segment, length, probe)) {
+                    return -1;
+                }
+            } else {
+                if (length != 2) {
+                    return -1;
+                }
+                probe->restart_interval = (segment[0] << 8) | segment[1];
+            }
+        }
+    }
+
+    for (int c = 0; c < probe->num_components; c++) {
+        const jpeg_quantization_table_t* table =
+            &probe->quantization_tables[probe->csps[c].quantization_table_selector & 0x03];
+        probe->component_quality[c] = !table->table_valid ? 0 :
+            jpeg_quantization_table_estimate_quality(c, probe->sample_precision, table);
+    }
+    probe->quality = probe->component_quality[0];
+
+    return 0;
+}
+
+int jpeg_probe_buffer(const uint8_t* data, size_t size, jpeg_probe_t* probe)
+{
+    if (data == NULL) {
+        return -1;
+    }
+    probe_source_t src = { .data = data, .size = size };
+    return probe_segments(&src, probe);
+}
+
+int jpeg_probe_fd(int fd, jpeg_probe_t* probe)
+{
+    probe_source_t src = { .fd = fd };
+    return probe_segments(&src, probe);
+}
@@ -0,0 +1,59 @@
+#ifndef JPEG_PROBE_H
+#define JPEG_PROBE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jpeg.h"
+
+/**
+ * What can be learned about a jpeg from its marker segments alone, without reading any entropy
+ * coded data. Meant for deciding how, or whether, to process an image before paying for a load.
+ */
+typedef struct jpeg_probe
+{
+    // the SOFn marker, which tells baseline (0xc0) from extended, progressive, arithmetic coded
+    // and lossless frames.
+    uint8_t sof_marker;
+
+    uint8_t sample_precision;
+    uint16_t width;
+    uint16_t height;
+
+    uint8_t num_components;
+    frame_component_specification_parameters_t csps[4];
+
+    uint16_t restart_interval;
+
+    // only tables defined before the first scan are seen.
+    jpeg_quantization_table_t quantization_tables[4];
+
+    // IJG quality estimated from each component's quantization table, or 0 if the table it
+    // selects isn't defined.
+    int component_quality[4];
+
+    // the estimated quality of the first component's table, which is what's usually meant by
+    // the quality of a jpeg.
+    int quality;
+
+    // offset of the first byte after the SOS segment, where the entropy coded data starts.
+    uint64_t header_size;
+} jpeg_probe_t;
+
+/**
+ * Parses the marker segments of the jpeg in data, stopping at the first SOS. Only as much of the
+ * buffer as the headers take up is looked at, so data may hold just a prefix of the file.
+ *
+ * Returns 0 on success and -1 if the headers are malformed, have no frame header, or run past the
+ * end of the buffer.
+ */
+int jpeg_probe_buffer(const uint8_t* data, size_t size, jpeg_probe_t* probe);
+
+/**
+ * Like jpeg_probe_buffer(), but reads from the start of an open file with pread(), so the file
+ * offset is left alone. Segments that aren't needed, like large APPn blocks, are skipped rather
+ * than read, so the cost doesn't grow with the file size.
+ */
+int jpeg_probe_fd(int fd, jpeg_probe_t* probe);
+
+#endif
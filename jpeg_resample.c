@@ -0,0 +1,281 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpeg_resample.h"
+
+/**
+ * One axis of a DCT-domain shrink by factor, folded into a matrix per source block: m[b][u][k] is
+ * how much frequency k of the b-th of factor neighbouring blocks adds to frequency u of the block
+ * they're merged into. Only the n = 8 / factor lowest frequencies of a source block are used.
+ */
+typedef struct axis_reduction
+{
+    int factor;
+    int n;
+    float m[8][8][8];
+} axis_reduction_t;
+
+static void axis_reduction_init(int factor, axis_reduction_t* r)
+{
+    r->factor = factor;
+    r->n = 8 / factor;
+    for (int b = 0; b < factor; b++) {
+        for (int u = 0; u < 8; u++) {
+            for (int k = 0; k < r->n; k++) {
+                // 8-point DCT of an n-point IDCT, both orthonormal like the ones in T.81. The IDCT
+                // input is scaled by sqrt(n / 8) so that a block's DC carries over as an average.
+                double sum = 0.0;
+                for (int x = 0; x < r->n; x++) {
+                    const int x8 = (b * r->n) + x;
+                    const double dct = ((u == 0) ? sqrt(1.0 / 8) : sqrt(2.0 / 8)) *
+                                       cos(((2 * x8) + 1) * u * M_PI / 16);
+                    const double idct = ((k == 0) ? sqrt(1.0 / r->n) : sqrt(2.0 / r->n)) *
+                                        cos(((2 * x) + 1) * k * M_PI / (2 * r->n));
+                    sum += dct * idct;
+                }
+                r->m[b][u][k] = sum * sqrt(r->n / 8.0);
+            }
+        }
+    }
+}
+
+/**
+ * Works out how much every component shrinks along each axis. Returns -1 if resample can't be done
+ * on jpeg's sampling factors.
+ */
+static int resample_factors(const jpeg_image_t* jpeg, const jpeg_resample_t* resample,
+                            int factor_x[3], int factor_y[3])
+{
+    const int denom = (resample->scale_denom == 0) ? 1 : resample->scale_denom;
+    if ((denom != 1) && (denom != 2) && (denom != 4) && (denom != 8)) {
+        return -1;
+    }
+
+    const int num_components = jpeg->frame_header.num_components;
+    for (int c = 0; c < num_components; c++) {
+        factor_x[c] = denom;
+        factor_y[c] = denom;
+    }
+    if (!resample->subsample_chroma || (num_components == 1)) {
+        return 0;
+    }
+
+    // the luma component ends up at 2x2; chroma has to start at 1x1 and gets halved along every
+    // axis where luma wasn't at 2 already.
+    const frame_component_specification_parameters_t* csps = jpeg->frame_header.csps;
+    const int H = csps[0].horizontal_sampling_factor;
+    const int V = csps[0].vertical_sampling_factor;
+    if ((H < 1) || (H > 2) || (V < 1) || (V > 2)) {
+        return -1;
+    }
+    for (int c = 1; c < num_components; c++) {
+        if ((csps[c].horizontal_sampling_factor != 1) || (csps[c].vertical_sampling_factor != 1)) {
+            return -1;
+        }
+        factor_x[c] *= 2 / H;
+        factor_y[c] *= 2 / V;
+        if ((factor_x[c] > 8) || (factor_y[c] > 8)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+jpeg_image_t* jpeg_resample_image(const jpeg_image_t* jpeg, const jpeg_resample_t* resample)
+{
+    int factor_x[3], factor_y[3];
+    if (resample_factors(jpeg, resample, factor_x, factor_y)) {
+        return NULL;
+    }
+
+    jpeg_image_t* result = jpeg_image_copy(jpeg);
+    const int denom = (resample->scale_denom == 0) ? 1 : resample->scale_denom;
+    result->frame_header.samples_per_line = (jpeg->frame_header.samples_per_line + denom - 1) /
+                                            denom;
+    result->frame_header.number_of_lines = (jpeg->frame_header.number_of_lines + denom - 1) /
+                                           denom;
+    if (resample->subsample_chroma && (result->frame_header.num_components > 1)) {
+        for (int c = 0; c < result->frame_header.num_components; c++) {
+            result->frame_header.csps[c].horizontal_sampling_factor = (c == 0) ? 2 : 1;
+            result->frame_header.csps[c].vertical_sampling_factor = (c == 0) ? 2 : 1;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Merges the factor_x by factor_y source blocks whose top left one is (sx0, sy0) into out, which
+ * receives the dequantized coefficients of the merged block in natural order. index maps natural
+ * order to the source's coefficient order and q holds the source quantization steps in that
+ * order.
+ *
+ * Blocks past the right or bottom edge of the source plane are taken from its last column or row.
+ */
+static void resample_block(const huffman_decoded_jpeg_component_t* source, int sx0, int sy0,
+                           const axis_reduction_t* rx, const axis_reduction_t* ry,
+                           const uint8_t* index, const float* q, float out[64])
+{
+    // horizontal pass: each band of factor_x blocks becomes a row of 8 horizontal frequencies
+    // for each of the ry->n vertical frequencies that the vertical pass needs.
+    float rows[8][8][8];
+    for (int a = 0; a < ry->factor; a++) {
+        const int sy = ((sy0 + a) < source->block_lines) ? (sy0 + a) : (source->block_lines - 1);
+        memset(rows[a], 0, sizeof(rows[a]));
+        for (int b = 0; b < rx->factor; b++) {
+            const int sx = ((sx0 + b) < source->blocks_per_line) ? (sx0 + b) :
+                                                                   (source->blocks_per_line - 1);
+            const int16_t* in = (const int16_t*)&source->blocks[(sy * source->blocks_per_line) +
+                                                                sx];
+            for (int v = 0; v < ry->n; v++) {
+                float coefficients[8];
+                for (int k = 0; k < rx->n; k++) {
+                    const int i = index[(v * 8) + k];
+                    coefficients[k] = in[i] * q[i];
+                }
+                for (int u = 0; u < 8; u++) {
+                    float sum = 0.0f;
+                    for (int k = 0; k < rx->n; k++) {
+                        sum += rx->m[b][u][k] * coefficients[k];
+                    }
+                    rows[a][v][u] += sum;
+                }
+            }
+        }
+    }
+
+    // vertical pass: the bands are merged into the 8 vertical frequencies of the output.
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            float sum = 0.0f;
+            for (int a = 0; a < ry->factor; a++) {
+                for (int k = 0; k < ry->n; k++) {
+                    sum += ry->m[a][v][k] * rows[a][k][u];
+                }
+            }
+            out[(v * 8) + u] = sum;
+        }
+    }
+}
+
+/**
+ * Quantizes a dequantized coefficient to the target step qt and expresses it in units of the
+ * source step qs, rounding the same way jpeg_requantize_block() does, and clamps it to limit.
+ */
+static inline int16_t quantize_coefficient(float value, uint16_t qs, uint16_t qt, int32_t limit)
+{
+    int32_t magnitude = (int32_t)((fabsf(value) / qt) + 0.5f);
+    if (qt != qs) {
+        magnitude = ((magnitude * qt) + (qs / 2)) / qs;
+    }
+    if (magnitude > limit) {
+        magnitude = limit;
+    }
+
+    return (value < 0.0f) ? -magnitude : magnitude;
+}
+
+huffman_decoded_jpeg_scan_t* jpeg_resample_scan(const jpeg_image_t* jpeg,
+                                                const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                const jpeg_resample_t* resample,
+                                                const jpeg_image_t* out_jpeg,
+                                                const jpeg_requantizer_t* rq,
+                                                const jpeg_roi_map_t* roi_map)
+{
+    int factor_x[3], factor_y[3];
+    if (resample_factors(jpeg, resample, factor_x, factor_y)) {
+        return NULL;
+    }
+
+    huffman_decoded_jpeg_scan_t* result = huffman_decoded_jpeg_scan_create(out_jpeg);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    // the merged blocks are read by frequency row and column, which natural order scans give
+    // directly; zigzag ones go through the usual table.
+    static const uint8_t natural_to_natural[64] = {
+         0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+        32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+        48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63
+    };
+    const bool natural = (decoded_scan->order == JPEG_COEFFICIENT_ORDER_NATURAL);
+    const uint8_t* index = natural ? natural_to_natural : jpeg_natural_to_zigzag;
+
+    // coded values are limited to what the frame's sample precision allows, as in F.1.2.1 of T.81.
+    const int P = jpeg->frame_header.sample_precision;
+    const int32_t dc_limit = (1 << (P + 3)) - 1;
+    const int32_t ac_limit = (1 << (P + 2)) - 1;
+
+    // indexed by log2 of the factor.
+    axis_reduction_t reductions[4];
+    for (int i = 0; i < 4; i++) {
+        axis_reduction_init(1 << i, &reductions[i]);
+    }
+
+    for (int c = 0; c < jpeg->frame_header.num_components; c++) {
+        const huffman_decoded_jpeg_component_t* source = &decoded_scan->components[c];
+        huffman_decoded_jpeg_component_t* dest = &result->components[c];
+        const int fx = factor_x[c];
+        const int fy = factor_y[c];
+        const axis_reduction_t* rx = &reductions[__builtin_ctz(fx)];
+        const axis_reduction_t* ry = &reductions[__builtin_ctz(fy)];
+
+        const int qt_idx = jpeg->frame_header.csps[c].quantization_table_selector & 0x03;
+        const jpeg_quantization_table_t* table = &jpeg->jpeg_quantization_tables[qt_idx];
+        const bool table_16bit = ((table->pq_tq >> 4) & 0x0f) != 0;
+        uint16_t q[64];
+        float q_in_order[64];
+        for (int k = 0; k < 64; k++) {
+            q[k] = table_16bit ? table->Q[k]._16 : table->Q[k]._8;
+            if (q[k] == 0) {
+                q[k] = 1;
+            }
+        }
+        for (int k = 0; k < 64; k++) {
+            q_in_order[natural ? jpeg_zigzag_to_natural[k] : k] = q[k];
+        }
+
+        for (int oy = 0; oy < dest->block_lines; oy++) {
+            for (int ox = 0; ox < dest->blocks_per_line; ox++) {
+                jpeg_block_t* block = &dest->blocks[(oy * dest->blocks_per_line) + ox];
+                const requantization_table_t* t = (rq == NULL) ? NULL :
+                    jpeg_requantizer_table_at(rq, out_jpeg, roi_map, result, c, ox, oy);
+
+                // components that keep their resolution only need their blocks moved to where
+                // the new MCU layout puts them.
+                if ((fx == 1) && (fy == 1)) {
+                    const int sx = (ox < source->blocks_per_line) ? ox :
+                                                                    (source->blocks_per_line - 1);
+                    const int sy = (oy < source->block_lines) ? oy : (source->block_lines - 1);
+                    const jpeg_block_t* source_block =
+                        &source->blocks[(sy * source->blocks_per_line) + sx];
+                    if (natural) {
+                        jpeg_block_natural_to_zigzag(source_block, block);
+                    } else {
+                        *block = *source_block;
+                    }
+                    if ((t != NULL) && !t->identity) {
+                        jpeg_requantize_block(t, block);
+                    }
+                    continue;
+                }
+
+                float merged[64];
+                resample_block(source, ox * fx, oy * fy, rx, ry, index, q_in_order, merged);
+
+                int16_t* out = (int16_t*)block;
+                for (int k = 0; k < 64; k++) {
+                    const uint16_t qt = (t != NULL) ? t->target_q[k] : q[k];
+                    out[k] = quantize_coefficient(merged[jpeg_zigzag_to_natural[k]], q[k], qt,
+                                                  (k == 0) ? dc_limit : ac_limit);
+                }
+            }
+        }
+    }
+
+    return result;
+}
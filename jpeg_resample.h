@@ -0,0 +1,58 @@
+#ifndef JPEG_RESAMPLE_H
+#define JPEG_RESAMPLE_H
+
+#include "jpeg.h"
+#include "jpeg-requantizer.h"
+
+/**
+ * Resampling done on huffman decoded coefficients, with no trip through the pixel domain.
+ *
+ * A component is shrunk by a factor f along an axis by merging every f neighbouring blocks into
+ * one: the lowest 8 / f frequencies of each block are taken as an (8 / f)-point DCT of that block
+ * shrunk by f, and the f short runs of samples that gives are brought back into a single 8-point
+ * DCT. Both steps are linear, so they're folded into one matrix per source block and applied to
+ * the dequantized coefficients directly.
+ *
+ * Unlike jpeg_transform.h, this is lossy: the highest frequencies of the source are dropped and
+ * the result is quantized again.
+ */
+
+typedef struct jpeg_resample
+{
+    // shrink the whole image by 1, 2, 4 or 8 in both directions, rounding its dimensions up. 0 is
+    // the same as 1. At 8, every output block is made from the DC coefficients of 64 blocks.
+    int scale_denom;
+
+    // halve the chroma resolution in both directions, turning a 4:4:4 or 4:2:2 image into 4:2:0.
+    // The luma component gets sampling factors of 2x2 and the chroma components 1x1. Grayscale
+    // images are left as they are.
+    bool subsample_chroma;
+} jpeg_resample_t;
+
+/**
+ * Returns a newly allocated copy of jpeg with the frame dimensions and sampling factors that
+ * resample produces. Its entropy coded data is left as it was in jpeg.
+ *
+ * Returns NULL if jpeg's sampling factors can't be resampled as asked, e.g. chroma that's already
+ * subsampled vertically, if scale_denom isn't supported, or if a component would have to shrink
+ * by more than 8.
+ */
+jpeg_image_t* jpeg_resample_image(const jpeg_image_t* jpeg, const jpeg_resample_t* resample);
+
+/**
+ * Resamples decoded_scan, which was decoded from jpeg, returning a new scan laid out for out_jpeg,
+ * the result of jpeg_resample_image(). decoded_scan can be in either coefficient order; the result
+ * is in zigzag order.
+ *
+ * If rq isn't NULL, every resampled coefficient is quantized straight to the step the requantizer
+ * picks for its block following roi_map, which is in out_jpeg's coordinates, rather than being
+ * rounded twice. rq has to be created from out_jpeg.
+ */
+huffman_decoded_jpeg_scan_t* jpeg_resample_scan(const jpeg_image_t* jpeg,
+                                                const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                const jpeg_resample_t* resample,
+                                                const jpeg_image_t* out_jpeg,
+                                                const jpeg_requantizer_t* rq,
+                                                const jpeg_roi_map_t* roi_map);
+
+#endif
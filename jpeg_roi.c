@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "jpeg_roi.h"
+
+// importance is edge / (edge + texture + ROI_FLAT_ENERGY), with all three in dequantized units. A
+// block whose coefficients add up to much less than this reads as flat.
+#define ROI_FLAT_ENERGY 64
+
+// skin tone range of the average Cb and Cr of a block, from Chai and Ngan's face segmentation,
+// and the luma below which colors are too dark to tell. All three are 8-bit sample values.
+#define ROI_SKIN_CB_MIN 77
+#define ROI_SKIN_CB_MAX 127
+#define ROI_SKIN_CR_MIN 133
+#define ROI_SKIN_CR_MAX 173
+#define ROI_SKIN_Y_MIN 48
+
+/**
+ * Per component lookup data: quantization steps to weigh the coefficients with, laid out in the
+ * scan's coefficient order.
+ */
+typedef struct component_weights
+{
+    // step of every AC coefficient, with 0 for the DC.
+    int16_t ac_steps[64];
+    uint16_t dc_step;
+
+    // level shift of the frame's sample precision, and the shift that takes a sample to 8 bits.
+    int level_shift;
+    int precision_shift;
+
+    // positions of the lowest horizontal and vertical AC frequencies in a block.
+    int edge_x;
+    int edge_y;
+} component_weights_t;
+
+/**
+ * Returns the sum of |coefficient| * weight over the 64 coefficients of block.
+ */
+static uint32_t block_weighted_energy(const jpeg_block_t* block, const int16_t* weights)
+{
+    const int16_t* coefficients = (const int16_t*)block;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for (int i = 0; i < 64; i += 8) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)&coefficients[i]);
+        const __m128i magnitude = _mm_max_epi16(v, _mm_sub_epi16(zero, v));
+        const __m128i w = _mm_loadu_si128((const __m128i*)&weights[i]);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(magnitude, w));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+#else
+    uint32_t sum = 0;
+    for (int i = 0; i < 64; i++) {
+        sum += abs(coefficients[i]) * weights[i];
+    }
+    return sum;
+#endif
+}
+
+static int component_weights_init(const jpeg_image_t* jpeg,
+                                  const huffman_decoded_jpeg_scan_t* decoded_scan, int c,
+                                  component_weights_t* w)
+{
+    const int qt_idx = jpeg->frame_header.csps[c].quantization_table_selector & 0x03;
+    const jpeg_quantization_table_t* table = &jpeg->jpeg_quantization_tables[qt_idx];
+    const int precision = jpeg->frame_header.sample_precision;
+    if (!table->table_valid || ((precision != 8) && (precision != 12))) {
+        return -1;
+    }
+    const bool table_16bit = ((table->pq_tq >> 4) & 0x0f) != 0;
+    const bool natural = (decoded_scan->order == JPEG_COEFFICIENT_ORDER_NATURAL);
+
+    for (int k = 0; k < 64; k++) {
+        // steps are capped so that the 32-bit sums can't overflow on 12-bit data.
+        int step = table_16bit ? table->Q[k]._16 : table->Q[k]._8;
+        step = (step < 1) ? 1 : ((step > 4095) ? 4095 : step);
+        w->ac_steps[natural ? jpeg_zigzag_to_natural[k] : k] = (k == 0) ? 0 : step;
+        if (k == 0) {
+            w->dc_step = step;
+        }
+    }
+    w->edge_x = natural ? 1 : jpeg_natural_to_zigzag[1];
+    w->edge_y = natural ? 8 : jpeg_natural_to_zigzag[8];
+    w->level_shift = 1 << (precision - 1);
+    w->precision_shift = precision - 8;
+
+    return 0;
+}
+
+/**
+ * Returns the average sample value of a block from its DC coefficient, scaled to 8 bits.
+ */
+static int block_average(const jpeg_block_t* block, const component_weights_t* w)
+{
+    const int v = block->dc_value * w->dc_step;
+    return (w->level_shift + ((v + ((v < 0) ? -4 : 4)) / 8)) >> w->precision_shift;
+}
+
+jpeg_roi_map_t* jpeg_roi_map_create_auto(const jpeg_image_t* jpeg,
+                                         const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                         const jpeg_roi_params_t* params)
+{
+    const int num_components = jpeg->frame_header.num_components;
+    component_weights_t weights[3];
+    for (int c = 0; c < num_components; c++) {
+        if (component_weights_init(jpeg, decoded_scan, c, &weights[c])) {
+            return NULL;
+        }
+    }
+
+    jpeg_roi_map_t* roi_map = jpeg_roi_map_create_uniform(jpeg, params->min_quality);
+    const int quality_range = (params->max_quality > params->min_quality) ?
+                              (params->max_quality - params->min_quality) : 0;
+    const bool skin_tone = params->skin_tone && (num_components == 3);
+
+    // a grayscale scan isn't interleaved, so its blocks map onto the image one to one.
+    const bool grayscale = (num_components == 1);
+    const int H_max = grayscale ? 1 : decoded_scan->H_max;
+    const int V_max = grayscale ? 1 : decoded_scan->V_max;
+    int H[3], V[3];
+    for (int c = 0; c < num_components; c++) {
+        H[c] = grayscale ? 1 : jpeg->frame_header.csps[c].horizontal_sampling_factor;
+        V[c] = grayscale ? 1 : jpeg->frame_header.csps[c].vertical_sampling_factor;
+    }
+
+    for (int y = 0; y < roi_map->blocks_high; y++) {
+        uint8_t* row = &roi_map->quality[y * roi_map->blocks_wide];
+        for (int x = 0; x < roi_map->blocks_wide; x++) {
+            const jpeg_block_t* blocks[3];
+            for (int c = 0; c < num_components; c++) {
+                const huffman_decoded_jpeg_component_t* component = &decoded_scan->components[c];
+                int bx = (x * H[c]) / H_max;
+                int by = (y * V[c]) / V_max;
+                bx = (bx < component->blocks_per_line) ? bx : (component->blocks_per_line - 1);
+                by = (by < component->block_lines) ? by : (component->block_lines - 1);
+                blocks[c] = &component->blocks[(by * component->blocks_per_line) + bx];
+            }
+
+            const component_weights_t* w = &weights[0];
+            const int16_t* luma = (const int16_t*)blocks[0];
+            const uint32_t energy = block_weighted_energy(blocks[0], w->ac_steps);
+            const uint32_t edge = (abs(luma[w->edge_x]) * w->ac_steps[w->edge_x]) +
+                                  (abs(luma[w->edge_y]) * w->ac_steps[w->edge_y]);
+            const uint32_t texture = energy - edge;
+            int quality = params->min_quality +
+                          (int)(((uint64_t)quality_range * edge) /
+                                (edge + texture + ROI_FLAT_ENERGY));
+
+            if (skin_tone && (quality < params->skin_quality)) {
+                const int Y = block_average(blocks[0], &weights[0]);
+                const int Cb = block_average(blocks[1], &weights[1]);
+                const int Cr = block_average(blocks[2], &weights[2]);
+                if ((Y >= ROI_SKIN_Y_MIN) &&
+                    (Cb >= ROI_SKIN_CB_MIN) && (Cb <= ROI_SKIN_CB_MAX) &&
+                    (Cr >= ROI_SKIN_CR_MIN) && (Cr <= ROI_SKIN_CR_MAX)) {
+                    quality = params->skin_quality;
+                }
+            }
+
+            row[x] = (quality < 1) ? 1 : ((quality > 100) ? 100 : quality);
+        }
+    }
+
+    return roi_map;
+}
@@ -0,0 +1,41 @@
+#ifndef JPEG_ROI_H
+#define JPEG_ROI_H
+
+#include "jpeg.h"
+#include "jpeg-requantizer.h"
+
+/**
+ * ROI maps worked out from the huffman decoded coefficients, with no pixel decode.
+ *
+ * Every 8x8 block of the image gets an importance in [0, 1] from its luma block. The two lowest
+ * AC frequencies measure how much of an edge or gradient crosses the block. The rest of the AC
+ * energy counts as texture, which hides requantization artifacts and so lowers the importance.
+ * Flat blocks have neither and end up at the bottom of the range. Optionally, blocks whose
+ * average color is a skin tone, as read from the DC coefficients, are kept at a minimum quality
+ * so that faces survive.
+ */
+
+typedef struct jpeg_roi_params
+{
+    // quality for blocks of no importance, and for the most important ones. Both are in [1, 100].
+    uint8_t min_quality;
+    uint8_t max_quality;
+
+    // if set, blocks of three-component images whose average YCbCr color looks like skin get at
+    // least skin_quality.
+    bool skin_tone;
+    uint8_t skin_quality;
+} jpeg_roi_params_t;
+
+/**
+ * Builds a ROI map for jpeg from decoded_scan, which was decoded from it and can be in either
+ * coefficient order. The map can be freed with jpeg_roi_map_destroy().
+ *
+ * Returns NULL if a component references an undefined quantization table, or if the frame's
+ * sample precision is neither 8 nor 12 bits.
+ */
+jpeg_roi_map_t* jpeg_roi_map_create_auto(const jpeg_image_t* jpeg,
+                                         const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                         const jpeg_roi_params_t* params);
+
+#endif
@@ -0,0 +1,67 @@
+#include <time.h>
+
+#include "jpeg_stats.h"
+
+__thread jpeg_stats_t* jpeg_stats_active = NULL;
+
+static const char* stage_names[JPEG_STATS_NUM_STAGES] = {
+    "load", "decode", "requantize", "recode", "store"
+};
+
+void jpeg_stats_attach(jpeg_stats_t* stats)
+{
+    jpeg_stats_active = stats;
+}
+
+uint64_t jpeg_stats_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Writes s as a JSON string, escaping the characters that need it.
+ */
+static void print_json_string(FILE* fp, const char* s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if ((*s == '"') || (*s == '\\')) {
+            fputc('\\', fp);
+            fputc(*s, fp);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(fp, "\\u%04x", *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void jpeg_stats_print_json(FILE* fp, const char* file, const jpeg_stats_t* stats)
+{
+    fprintf(fp, "{\"file\":");
+    print_json_string(fp, file);
+    fprintf(fp,
+            ",\"bytes_read\":%llu,\"ecs_bytes\":%llu,\"blocks_decoded\":%llu"
+            ",\"symbols_decoded\":%llu,\"nonzero_coefficients_before\":%llu"
+            ",\"nonzero_coefficients_after\":%llu,\"stuffed_bytes_read\":%llu"
+            ",\"stuffed_bytes_written\":%llu,\"output_bytes\":%llu",
+            (unsigned long long)stats->bytes_read,
+            (unsigned long long)stats->ecs_bytes,
+            (unsigned long long)stats->blocks_decoded,
+            (unsigned long long)stats->symbols_decoded,
+            (unsigned long long)stats->nonzero_coefficients_before,
+            (unsigned long long)stats->nonzero_coefficients_after,
+            (unsigned long long)stats->stuffed_bytes_read,
+            (unsigned long long)stats->stuffed_bytes_written,
+            (unsigned long long)stats->output_bytes);
+
+    fprintf(fp, ",\"stage_ms\":{");
+    for (int i = 0; i < JPEG_STATS_NUM_STAGES; i++) {
+        fprintf(fp, "%s\"%s\":%.3f", (i == 0) ? "" : ",", stage_names[i],
+                stats->stage_ns[i] / 1e6);
+    }
+    fprintf(fp, "}}\n");
+}
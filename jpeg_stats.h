@@ -0,0 +1,93 @@
+#ifndef JPEG_STATS_H
+#define JPEG_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Optional per-image counters and stage timings.
+ *
+ * Library functions accumulate into whichever jpeg_stats_t is attached to the calling thread with
+ * jpeg_stats_attach(). When nothing is attached, the cost is one well-predicted branch per
+ * library call; hot loops count into locals and publish once at the end. Defining JPEG_NO_STATS
+ * compiles the instrumentation out entirely.
+ */
+
+typedef enum jpeg_stats_stage
+{
+    JPEG_STATS_LOAD = 0,
+    JPEG_STATS_DECODE,
+    JPEG_STATS_REQUANTIZE,
+    JPEG_STATS_RECODE,
+    JPEG_STATS_STORE,
+    JPEG_STATS_NUM_STAGES
+} jpeg_stats_stage_t;
+
+typedef struct jpeg_stats
+{
+    // total bytes read from the input file, and how many of those were entropy coded data.
+    uint64_t bytes_read;
+    uint64_t ecs_bytes;
+
+    uint64_t blocks_decoded;
+
+    // DC and AC huffman symbols decoded, including EOB and ZRL.
+    uint64_t symbols_decoded;
+
+    // nonzero coefficients in every block the requantizer visited, before and after.
+    uint64_t nonzero_coefficients_before;
+    uint64_t nonzero_coefficients_after;
+
+    // 0x00 bytes that followed a 0xff in entropy coded data, on load and on store.
+    uint64_t stuffed_bytes_read;
+    uint64_t stuffed_bytes_written;
+
+    uint64_t output_bytes;
+
+    uint64_t stage_ns[JPEG_STATS_NUM_STAGES];
+} jpeg_stats_t;
+
+extern __thread jpeg_stats_t* jpeg_stats_active;
+
+/**
+ * Directs library calls made on this thread to accumulate into stats. Pass NULL to stop
+ * collecting.
+ */
+void jpeg_stats_attach(jpeg_stats_t* stats);
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+uint64_t jpeg_stats_now_ns();
+
+/**
+ * Prints stats as a single line of JSON, tagged with the given file name.
+ */
+void jpeg_stats_print_json(FILE* fp, const char* file, const jpeg_stats_t* stats);
+
+#ifdef JPEG_NO_STATS
+#define JPEG_STATS_ENABLED() (0)
+#define JPEG_STATS_ADD(field, n) do { } while (0)
+#define JPEG_STATS_TIMER_START() (0)
+#define JPEG_STATS_TIMER_STOP(stage, t0) do { (void)(t0); } while (0)
+#else
+#define JPEG_STATS_ENABLED() (jpeg_stats_active != NULL)
+
+#define JPEG_STATS_ADD(field, n)                        \
+    do {                                                \
+        if (jpeg_stats_active != NULL) {                \
+            jpeg_stats_active->field += (n);            \
+        }                                               \
+    } while (0)
+
+#define JPEG_STATS_TIMER_START() ((jpeg_stats_active != NULL) ? jpeg_stats_now_ns() : 0)
+
+#define JPEG_STATS_TIMER_STOP(stage, t0)                                        \
+    do {                                                                        \
+        if (jpeg_stats_active != NULL) {                                        \
+            jpeg_stats_active->stage_ns[(stage)] += jpeg_stats_now_ns() - (t0); \
+        }                                                                       \
+    } while (0)
+#endif
+
+#endif
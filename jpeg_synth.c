@@ -0,0 +1,163 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpeg_synth.h"
+#include "jpeg-requantizer.h"
+
+void jpeg_synth_options_init(jpeg_synth_options_t* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->width = 1024;
+    opts->height = 1024;
+    opts->num_components = 3;
+    opts->subsampling = JPEG_SYNTH_420;
+    opts->quality = 75;
+    opts->sparsity = 0.85;
+    opts->restart_interval = 0;
+    opts->huffman_tables = JPEG_SYNTH_HUFFMAN_ANNEX_K;
+    opts->seed = 1;
+}
+
+/**
+ * xorshift64* generator; the state must never be 0.
+ */
+static uint64_t synth_rand(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Returns a uniformly distributed double in [0, 1).
+ */
+static double synth_uniform(uint64_t* state)
+{
+    return (synth_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Fills one block with a smoothly varying DC value and low-frequency-weighted AC coefficients.
+ *
+ * dc is the running DC value of the block's component, and is updated.
+ */
+static void synth_block(jpeg_block_t* block, int* dc, int dc_limit, double density,
+                        uint64_t* state)
+{
+    *dc += (int)(synth_rand(state) % 9) - 4;
+    if (*dc > dc_limit) {
+        *dc = dc_limit;
+    } else if (*dc < -dc_limit) {
+        *dc = -dc_limit;
+    }
+    block->dc_value = *dc;
+
+    for (int k = 0; k < 63; k++) {
+        // the weights average out to 1 over the block, so 'density' is the expected fraction of
+        // nonzero coefficients.
+        const double weight = (2.0 * (63 - k)) / 64.0;
+        if (synth_uniform(state) >= (density * weight)) {
+            block->ac_values[k] = 0;
+            continue;
+        }
+
+        // geometrically distributed magnitudes, larger at low frequencies.
+        const double falloff = 1.0 - (k / 63.0);
+        const double scale = 0.5 + (12.0 * falloff * falloff);
+        int magnitude = 1 + (int)(-log(1.0 - synth_uniform(state)) * scale);
+        if (magnitude > 1023) {
+            magnitude = 1023;
+        }
+        block->ac_values[k] = (synth_rand(state) & 1) ? magnitude : -magnitude;
+    }
+}
+
+/**
+ * Adds a minimal JFIF APP0 segment so that the output looks like an ordinary jpeg file.
+ */
+static void add_jfif_segment(jpeg_image_t* jpeg)
+{
+    static const uint8_t jfif[14] = {
+        'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00
+    };
+
+    jpeg_generic_segment_t* gs = calloc(1, sizeof(jpeg_generic_segment_t));
+    gs->header.segment_marker = 0xe0;
+    gs->header.Ls = sizeof(jfif) + 2;
+    gs->data = malloc(sizeof(jfif));
+    memcpy(gs->data, jfif, sizeof(jfif));
+
+    jpeg->num_misc_segments = 1;
+    jpeg->misc_segments = calloc(1, sizeof(jpeg_generic_segment_t*));
+    jpeg->misc_segments[0] = gs;
+}
+
+jpeg_image_t* jpeg_synth_create(const jpeg_synth_options_t* opts)
+{
+    if ((opts->width == 0) || (opts->height == 0) ||
+        ((opts->num_components != 1) && (opts->num_components != 3)) ||
+        (opts->quality < 1) || (opts->quality > 100) ||
+        (opts->sparsity < 0.0) || (opts->sparsity > 1.0)) {
+        return NULL;
+    }
+
+    uint8_t sampling_factors[3] = { 0x11, 0x11, 0x11 };
+    if (opts->num_components == 3) {
+        if (opts->subsampling == JPEG_SYNTH_422) {
+            sampling_factors[0] = 0x21;
+        } else if (opts->subsampling == JPEG_SYNTH_420) {
+            sampling_factors[0] = 0x22;
+        }
+    }
+
+    jpeg_image_t* jpeg = jpeg_image_create(opts->width, opts->height, opts->num_components,
+                                           sampling_factors);
+    if (jpeg == NULL) {
+        return NULL;
+    }
+    jpeg->restart_interval = opts->restart_interval;
+    add_jfif_segment(jpeg);
+
+    const int num_tables = (opts->num_components == 1) ? 1 : 2;
+    for (int i = 0; i < num_tables; i++) {
+        jpeg_quantization_table_for_quality(i, opts->quality, jpeg->frame_header.sample_precision,
+                                            &jpeg->jpeg_quantization_tables[i]);
+        jpeg->jpeg_quantization_tables[i].pq_tq = i;
+        jpeg_huffman_table_annex_k(0, i != 0, i, &jpeg->dc_huffman_tables[i]);
+        jpeg_huffman_table_annex_k(1, i != 0, i, &jpeg->ac_huffman_tables[i]);
+    }
+
+    huffman_decoded_jpeg_scan_t* decoded_scan = huffman_decoded_jpeg_scan_create(jpeg);
+    if (decoded_scan == NULL) {
+        jpeg_image_destroy(jpeg);
+        return NULL;
+    }
+    uint64_t state = (opts->seed != 0) ? opts->seed : 1;
+    const double density = 1.0 - opts->sparsity;
+    for (int c = 0; c < opts->num_components; c++) {
+        const jpeg_quantization_table_t* qt =
+            &jpeg->jpeg_quantization_tables[jpeg->frame_header.csps[c].quantization_table_selector];
+        const int dc_limit = 1016 / qt->Q[0]._8;
+
+        int dc = 0;
+        huffman_decoded_jpeg_component_t* component = &decoded_scan->components[c];
+        for (int i = 0; i < component->num_blocks; i++) {
+            synth_block(&component->blocks[i], &dc, dc_limit, density, &state);
+        }
+    }
+
+    if (opts->huffman_tables == JPEG_SYNTH_HUFFMAN_OPTIMAL) {
+        jpeg_image_optimize_huffman_tables(jpeg, decoded_scan);
+    }
+
+    jpeg_image_t* result = jpeg_image_huffman_recode_with_tables(decoded_scan, jpeg);
+
+    huffman_decoded_jpeg_scan_destroy(decoded_scan);
+    jpeg_image_destroy(jpeg);
+
+    return result;
+}
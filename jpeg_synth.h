@@ -0,0 +1,69 @@
+#ifndef JPEG_SYNTH_H
+#define JPEG_SYNTH_H
+
+#include <stdint.h>
+
+#include "jpeg.h"
+
+/**
+ * Synthesizes valid baseline jpegs directly in the coefficient domain, for benchmarking and
+ * fuzzing without needing real images.
+ *
+ * Coefficients are drawn from a seeded PRNG, so the same options always produce the same file.
+ */
+
+typedef enum jpeg_synth_subsampling
+{
+    JPEG_SYNTH_444 = 0,
+    JPEG_SYNTH_422,
+    JPEG_SYNTH_420
+} jpeg_synth_subsampling_t;
+
+typedef enum jpeg_synth_huffman_tables
+{
+    // the example tables from section K.3 of T.81.
+    JPEG_SYNTH_HUFFMAN_ANNEX_K = 0,
+
+    // tables built from the synthesized coefficients' symbol statistics.
+    JPEG_SYNTH_HUFFMAN_OPTIMAL
+} jpeg_synth_huffman_tables_t;
+
+typedef struct jpeg_synth_options
+{
+    uint16_t width;
+    uint16_t height;
+
+    // 1 for grayscale, 3 for YCbCr.
+    int num_components;
+
+    // ignored for grayscale images.
+    jpeg_synth_subsampling_t subsampling;
+
+    // quality of the quantization tables written to the image, in [1, 100].
+    int quality;
+
+    // Fraction of AC coefficients that are zero, in [0, 1]. Nonzero coefficients are concentrated
+    // at low frequencies like they would be in a photograph.
+    double sparsity;
+
+    // MCUs per restart interval; 0 disables restart markers.
+    uint16_t restart_interval;
+
+    jpeg_synth_huffman_tables_t huffman_tables;
+
+    uint64_t seed;
+} jpeg_synth_options_t;
+
+/**
+ * Fills opts with defaults: a 1024x1024 4:2:0 YCbCr image at quality 75 with 85% sparsity, no
+ * restart markers and Annex K huffman tables.
+ */
+void jpeg_synth_options_init(jpeg_synth_options_t* opts);
+
+/**
+ * Returns a newly allocated, huffman coded jpeg_image_t built according to opts, or NULL if the
+ * options are invalid or allocation fails.
+ */
+jpeg_image_t* jpeg_synth_create(const jpeg_synth_options_t* opts);
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+
+#include "jpeg_transform.h"
+
+/**
+ * Everything an operation does, expressed in source coordinates: an optional transpose, after
+ * which zero, one or both source axes end up mirrored.
+ */
+typedef struct transform_geometry
+{
+    bool transpose;
+    bool mirror_x;
+    bool mirror_y;
+
+    // size of the unit that crops are aligned to, in source pixels. This is the MCU size of an
+    // interleaved scan and a single block for grayscale.
+    uint32_t unit_width;
+    uint32_t unit_height;
+
+    // cropped and trimmed rectangle in source pixels. x0 and y0 are multiples of the unit size.
+    uint32_t x0;
+    uint32_t y0;
+    uint32_t width;
+    uint32_t height;
+} transform_geometry_t;
+
+/**
+ * Per output zigzag index k, the source zigzag index it comes from and whether it's negated.
+ */
+typedef struct coefficient_permutation
+{
+    uint8_t source[64];
+    bool negate[64];
+} coefficient_permutation_t;
+
+static int transform_geometry(const jpeg_image_t* jpeg, const jpeg_transform_t* transform,
+                              transform_geometry_t* g)
+{
+    const jpeg_transform_op_t op = transform->op;
+    g->transpose = ((op == JPEG_TRANSFORM_TRANSPOSE) || (op == JPEG_TRANSFORM_TRANSVERSE) ||
+                    (op == JPEG_TRANSFORM_ROT_90) || (op == JPEG_TRANSFORM_ROT_270));
+    g->mirror_x = ((op == JPEG_TRANSFORM_FLIP_H) || (op == JPEG_TRANSFORM_TRANSVERSE) ||
+                   (op == JPEG_TRANSFORM_ROT_180) || (op == JPEG_TRANSFORM_ROT_270));
+    g->mirror_y = ((op == JPEG_TRANSFORM_FLIP_V) || (op == JPEG_TRANSFORM_TRANSVERSE) ||
+                   (op == JPEG_TRANSFORM_ROT_180) || (op == JPEG_TRANSFORM_ROT_90));
+
+    int H_max = 1, V_max = 1;
+    if (jpeg->frame_header.num_components > 1) {
+        for (int c = 0; c < jpeg->frame_header.num_components; c++) {
+            if (jpeg->frame_header.csps[c].horizontal_sampling_factor > H_max) {
+                H_max = jpeg->frame_header.csps[c].horizontal_sampling_factor;
+            }
+            if (jpeg->frame_header.csps[c].vertical_sampling_factor > V_max) {
+                V_max = jpeg->frame_header.csps[c].vertical_sampling_factor;
+            }
+        }
+    }
+    g->unit_width = 8 * H_max;
+    g->unit_height = 8 * V_max;
+
+    const uint32_t image_width = jpeg->frame_header.samples_per_line;
+    const uint32_t image_height = jpeg->frame_header.number_of_lines;
+    if ((transform->crop_x >= image_width) || (transform->crop_y >= image_height)) {
+        return -1;
+    }
+
+    g->x0 = (transform->crop_x / g->unit_width) * g->unit_width;
+    g->y0 = (transform->crop_y / g->unit_height) * g->unit_height;
+
+    g->width = image_width - g->x0;
+    if ((transform->crop_width != 0) &&
+        ((transform->crop_width + (transform->crop_x - g->x0)) < g->width)) {
+        g->width = transform->crop_width + (transform->crop_x - g->x0);
+    }
+    g->height = image_height - g->y0;
+    if ((transform->crop_height != 0) &&
+        ((transform->crop_height + (transform->crop_y - g->y0)) < g->height)) {
+        g->height = transform->crop_height + (transform->crop_y - g->y0);
+    }
+
+    if (g->mirror_x) {
+        g->width -= g->width % g->unit_width;
+    }
+    if (g->mirror_y) {
+        g->height -= g->height % g->unit_height;
+    }
+
+    // SOF can't describe an image that's more than 65535 pixels on a side.
+    if ((g->width == 0) || (g->height == 0) || (g->width > 0xffff) || (g->height > 0xffff)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void coefficient_permutation_init(const transform_geometry_t* g,
+                                         coefficient_permutation_t* p)
+{
+    // natural index n is (v * 8) + u, with u the horizontal frequency.
+    for (int k = 0; k < 64; k++) {
+        const int u = jpeg_zigzag_to_natural[k] % 8;
+        const int v = jpeg_zigzag_to_natural[k] / 8;
+        const int su = g->transpose ? v : u;
+        const int sv = g->transpose ? u : v;
+        p->source[k] = jpeg_natural_to_zigzag[(sv * 8) + su];
+        p->negate[k] = (g->mirror_x && (su & 1)) != (g->mirror_y && (sv & 1));
+    }
+}
+
+jpeg_image_t* jpeg_transform_image(const jpeg_image_t* jpeg, const jpeg_transform_t* transform)
+{
+    transform_geometry_t g;
+    if (transform_geometry(jpeg, transform, &g)) {
+        return NULL;
+    }
+
+    jpeg_image_t* result = jpeg_image_copy(jpeg);
+    result->frame_header.samples_per_line = g.transpose ? g.height : g.width;
+    result->frame_header.number_of_lines = g.transpose ? g.width : g.height;
+    if (!g.transpose) {
+        return result;
+    }
+
+    for (int c = 0; c < result->frame_header.num_components; c++) {
+        frame_component_specification_parameters_t* csp = &result->frame_header.csps[c];
+        const uint8_t H = csp->horizontal_sampling_factor;
+        csp->horizontal_sampling_factor = csp->vertical_sampling_factor;
+        csp->vertical_sampling_factor = H;
+    }
+
+    coefficient_permutation_t p;
+    coefficient_permutation_init(&g, &p);
+    for (int i = 0; i < 4; i++) {
+        jpeg_quantization_table_t* table = &result->jpeg_quantization_tables[i];
+        if (!table->table_valid) {
+            continue;
+        }
+
+        const jpeg_quantization_table_t source = *table;
+        for (int k = 0; k < 64; k++) {
+            table->Q[k] = source.Q[p.source[k]];
+        }
+    }
+
+    return result;
+}
+
+huffman_decoded_jpeg_scan_t* jpeg_transform_scan(const jpeg_image_t* jpeg,
+                                                 const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                 const jpeg_transform_t* transform,
+                                                 const jpeg_image_t* out_jpeg,
+                                                 const jpeg_requantizer_t* rq,
+                                                 const jpeg_roi_map_t* roi_map)
+{
+    transform_geometry_t g;
+    if (transform_geometry(jpeg, transform, &g)) {
+        return NULL;
+    }
+
+    huffman_decoded_jpeg_scan_t* result = huffman_decoded_jpeg_scan_create(out_jpeg);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    coefficient_permutation_t p;
+    coefficient_permutation_init(&g, &p);
+
+    const bool grayscale = (jpeg->frame_header.num_components == 1);
+    for (int c = 0; c < jpeg->frame_header.num_components; c++) {
+        const huffman_decoded_jpeg_component_t* source = &decoded_scan->components[c];
+        huffman_decoded_jpeg_component_t* dest = &result->components[c];
+
+        // blocks of this component per crop unit.
+        const int H = grayscale ? 1 : jpeg->frame_header.csps[c].horizontal_sampling_factor;
+        const int V = grayscale ? 1 : jpeg->frame_header.csps[c].vertical_sampling_factor;
+
+        // the cropped rectangle in source blocks of this component.
+        const int bx0 = (g.x0 / g.unit_width) * H;
+        const int by0 = (g.y0 / g.unit_height) * V;
+        const int wb = ((g.width * H) + g.unit_width - 1) / g.unit_width;
+        const int hb = ((g.height * V) + g.unit_height - 1) / g.unit_height;
+
+        for (int oy = 0; oy < dest->block_lines; oy++) {
+            for (int ox = 0; ox < dest->blocks_per_line; ox++) {
+                int sx = g.transpose ? oy : ox;
+                int sy = g.transpose ? ox : oy;
+                if (g.mirror_x) {
+                    sx = wb - 1 - sx;
+                }
+                if (g.mirror_y) {
+                    sy = hb - 1 - sy;
+                }
+
+                // blocks that only pad the output plane out to whole MCUs can land outside of
+                // the source plane; any nearby block does for them.
+                sx = bx0 + ((sx < 0) ? 0 : sx);
+                sy = by0 + ((sy < 0) ? 0 : sy);
+                if (sx >= source->blocks_per_line) {
+                    sx = source->blocks_per_line - 1;
+                }
+                if (sy >= source->block_lines) {
+                    sy = source->block_lines - 1;
+                }
+
+                const jpeg_block_t* source_block = &source->blocks[(sy * source->blocks_per_line) +
+                                                                   sx];
+                const int16_t* in = (const int16_t*)source_block;
+                jpeg_block_t* block = &dest->blocks[(oy * dest->blocks_per_line) + ox];
+                int16_t* out = (int16_t*)block;
+                for (int k = 0; k < 64; k++) {
+                    out[k] = p.negate[k] ? -in[p.source[k]] : in[p.source[k]];
+                }
+
+                if (rq != NULL) {
+                    const requantization_table_t* t =
+                        jpeg_requantizer_table_at(rq, out_jpeg, roi_map, result, c, ox, oy);
+                    if (!t->identity) {
+                        jpeg_requantize_block(t, block);
+                    }
+                }
+            }
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,74 @@
+#ifndef JPEG_TRANSFORM_H
+#define JPEG_TRANSFORM_H
+
+#include "jpeg.h"
+#include "jpeg-requantizer.h"
+
+/**
+ * Lossless crops, flips and rotations done on huffman decoded coefficients, with no IDCT.
+ *
+ * Whole blocks are moved around, and inside each block a horizontal mirror negates the odd
+ * horizontal frequencies, a vertical mirror negates the odd vertical frequencies, and a transpose
+ * swaps the two. Transposing operations also transpose the quantization tables and swap every
+ * component's sampling factors.
+ *
+ * Blocks can't be split, so an operation that mirrors an axis trims that axis of the cropped
+ * image down to a whole number of MCUs first; otherwise the partial MCU at the right or bottom
+ * edge would end up at the left or top. This is the same as jpegtran's -trim.
+ */
+
+typedef enum jpeg_transform_op
+{
+    JPEG_TRANSFORM_NONE = 0,
+    JPEG_TRANSFORM_FLIP_H,
+    JPEG_TRANSFORM_FLIP_V,
+
+    // mirror across the top-left to bottom-right diagonal.
+    JPEG_TRANSFORM_TRANSPOSE,
+
+    // mirror across the top-right to bottom-left diagonal.
+    JPEG_TRANSFORM_TRANSVERSE,
+
+    // clockwise rotations.
+    JPEG_TRANSFORM_ROT_90,
+    JPEG_TRANSFORM_ROT_180,
+    JPEG_TRANSFORM_ROT_270
+} jpeg_transform_op_t;
+
+typedef struct jpeg_transform
+{
+    jpeg_transform_op_t op;
+
+    // crop rectangle in source pixels, applied before op. The corner is moved up and left to the
+    // nearest MCU boundary, growing the rectangle to match, and the rectangle is clipped to the
+    // image. A width or height of 0 extends to the edge of the image.
+    uint32_t crop_x;
+    uint32_t crop_y;
+    uint32_t crop_width;
+    uint32_t crop_height;
+} jpeg_transform_t;
+
+/**
+ * Returns a newly allocated copy of jpeg with the frame dimensions, sampling factors and
+ * quantization tables that transform produces. Its entropy coded data is left as it was in jpeg.
+ *
+ * Returns NULL if the crop rectangle doesn't overlap the image or trimming leaves nothing.
+ */
+jpeg_image_t* jpeg_transform_image(const jpeg_image_t* jpeg, const jpeg_transform_t* transform);
+
+/**
+ * Applies transform to decoded_scan, which was decoded from jpeg, returning a new scan laid out
+ * for out_jpeg, the result of jpeg_transform_image().
+ *
+ * If rq isn't NULL, every block is also requantized as it's written, following roi_map, which is
+ * in out_jpeg's coordinates. rq has to be created from out_jpeg so that it sees the transformed
+ * quantization tables.
+ */
+huffman_decoded_jpeg_scan_t* jpeg_transform_scan(const jpeg_image_t* jpeg,
+                                                 const huffman_decoded_jpeg_scan_t* decoded_scan,
+                                                 const jpeg_transform_t* transform,
+                                                 const jpeg_image_t* out_jpeg,
+                                                 const jpeg_requantizer_t* rq,
+                                                 const jpeg_roi_map_t* roi_map);
+
+#endif
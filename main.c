@@ -5,11 +5,24 @@
  * of interest
  */
 
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "jpeg.h"
 #include "jpeg-requantizer.h"
+#include "jpeg_cache.h"
+#include "jpeg_preview.h"
+#include "jpeg_probe.h"
+#include "jpeg_resample.h"
+#include "jpeg_roi.h"
+#include "jpeg_stats.h"
+#include "jpeg_transform.h"
 #include "bit_dispenser.h"
 #include "bit_packer.h"
 
@@ -37,46 +50,371 @@ static void print_block(jpeg_block_t* block)
 
 static void print_block_unzigged(jpeg_block_t* block)
 {
-    jpeg_block_t* unzigged = calloc(1, sizeof(jpeg_block_t));
-
-    // zigzag starts on [1, 0] and moves in the downwards direction
-    int zigdir = -1;
-    int zig_x = 1;
-    int zig_y = 0;
-    for (int i = 0; i < 63; i++) {
-        // copy data over
-        int zigidx = (zig_x + (8 * zig_y)) - 1;
-        unzigged->ac_values[zigidx] = block->ac_values[i];
-//        printf("zigidx = %3i, i = %3i, zig_x = %2i, zig_y = %2i, zigdir = %2i\n",
-//               zigidx, i, zig_x, zig_y, zigdir);
-
-        // update zig coordinates
-        // check and see if moving in the zig direction would put us out of bounds
-        int nx = zig_x + zigdir;
-        int ny = zig_y - zigdir;
-        if ((nx < 0) && (ny > 7)) {
-            zig_x++;
-            zigdir = -zigdir;
-        } else if ((nx < 0) && (zigdir == -1)) {
-            zig_y++;
-            zigdir = -zigdir;
-        } else if ((ny < 0) && (zigdir == 1)) {
-            zig_x++;
-            zigdir = -zigdir;
-        } else if ((nx > 7) && (zigdir == 1)) {
-            zig_y++;
-            zigdir = -zigdir;
-        } else if ((ny > 7) && (zigdir == -1)) {
-            zig_x++;
-            zigdir = -zigdir;
-        } else {
-            zig_x = nx;
-            zig_y = ny;
+    jpeg_block_t unzigged;
+    jpeg_block_zigzag_to_natural(block, &unzigged);
+    print_block(&unzigged);
+}
+
+/**
+ * Prints a one line summary of input_path's headers without loading the rest of it.
+ */
+static int print_info(const char* input_path)
+{
+    const int fd = open(input_path, O_RDONLY);
+    if (fd < 0) {
+        printf("error opening %s\n", input_path);
+        return -1;
+    }
+
+    jpeg_probe_t probe;
+    const int retval = jpeg_probe_fd(fd, &probe);
+    close(fd);
+    if (retval) {
+        printf("error reading jpeg headers\n");
+        return -1;
+    }
+
+    printf("%s: %ux%u, SOF %02x, %u-bit, %u components (", input_path, probe.width,
+           probe.height, probe.sof_marker, probe.sample_precision, probe.num_components);
+    for (int c = 0; c < probe.num_components; c++) {
+        printf("%s%ix%i", (c == 0) ? "" : " ", probe.csps[c].horizontal_sampling_factor,
+               probe.csps[c].vertical_sampling_factor);
+    }
+    printf("), restart interval %u, quality %i (", probe.restart_interval, probe.quality);
+    for (int c = 0; c < probe.num_components; c++) {
+        printf("%s%i", (c == 0) ? "" : " ", probe.component_quality[c]);
+    }
+    printf("), %llu header bytes\n", (unsigned long long)probe.header_size);
+
+    return 0;
+}
+
+/**
+ * Returns true if input_path's headers say that requantizing it to quality would leave every
+ * coefficient as it is.
+ */
+static bool requantizing_changes_nothing(const char* input_path, int quality)
+{
+    const int fd = open(input_path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    jpeg_probe_t probe;
+    const int probe_result = jpeg_probe_fd(fd, &probe);
+    close(fd);
+    if (probe_result || ((probe.sof_marker != 0xc0) && (probe.sof_marker != 0xc1))) {
+        return false;
+    }
+
+    jpeg_requantizer_t* rq = jpeg_requantizer_create_from_probe(&probe);
+    if (rq == NULL) {
+        return false;
+    }
+    const bool result = jpeg_requantizer_quality_is_identity(rq, quality);
+    jpeg_requantizer_destroy(rq);
+    return result;
+}
+
+/**
+ * Returns the size of the file at path, or -1 if it can't be looked at.
+ */
+static long long file_size(const char* path)
+{
+    struct stat st;
+    return (stat(path, &st) == 0) ? (long long)st.st_size : -1;
+}
+
+/**
+ * Returns true if both paths name the same existing file.
+ */
+static bool same_file(const char* a, const char* b)
+{
+    struct stat sa, sb;
+    return (stat(a, &sa) == 0) && (stat(b, &sb) == 0) && (sa.st_dev == sb.st_dev) &&
+           (sa.st_ino == sb.st_ino);
+}
+
+/**
+ * Returns the number of bytes jpeg_image_store_to_file() writes for jpeg, or -1 on failure.
+ */
+static long long stored_size(const jpeg_image_t* jpeg)
+{
+    char* buf = NULL;
+    size_t size = 0;
+    FILE* fp = open_memstream(&buf, &size);
+    if (fp == NULL) {
+        return -1;
+    }
+    const int retval = jpeg_image_store_to_stream(fp, jpeg);
+    fclose(fp);
+    free(buf);
+    return retval ? -1 : (long long)size;
+}
+
+static int copy_file(const char* from, const char* to)
+{
+    FILE* in = fopen(from, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+    FILE* out = fopen(to, "wb");
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+
+    int retval = 0;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            retval = -1;
+            break;
+        }
+    }
+    if (ferror(in)) {
+        retval = -1;
+    }
+
+    fclose(in);
+    if (fclose(out)) {
+        retval = -1;
+    }
+    return retval;
+}
+
+/**
+ * Writes a preview of input_path to preview_path without decoding any AC coefficients.
+ */
+static int write_preview(const char* input_path, const char* preview_path, jpeg_stats_t* stats)
+{
+    jpeg_image_t* jpeg = jpeg_image_load_from_file(input_path);
+    if (jpeg == NULL) {
+        printf("error reading jpeg\n");
+        return -1;
+    }
+
+    huffman_decoded_jpeg_dc_t* decoded_dc = jpeg_image_huffman_decode_dc(jpeg);
+    if (decoded_dc == NULL) {
+        printf("error during huffman decoding\n");
+        jpeg_image_destroy(jpeg);
+        return -1;
+    }
+
+    int retval = jpeg_dc_preview_store_to_file(preview_path, jpeg, decoded_dc);
+    if (retval) {
+        printf("error writing %s\n", preview_path);
+    }
+
+    jpeg_stats_attach(NULL);
+    if (stats != NULL) {
+        jpeg_stats_print_json(stdout, input_path, stats);
+    }
+    huffman_decoded_jpeg_dc_destroy(decoded_dc);
+    jpeg_image_destroy(jpeg);
+    return retval;
+}
+
+static int parse_transform_op(const char* name, jpeg_transform_op_t* op)
+{
+    static const struct {
+        const char* name;
+        jpeg_transform_op_t op;
+    } ops[] = {
+        { "flip-h",     JPEG_TRANSFORM_FLIP_H },
+        { "flip-v",     JPEG_TRANSFORM_FLIP_V },
+        { "transpose",  JPEG_TRANSFORM_TRANSPOSE },
+        { "transverse", JPEG_TRANSFORM_TRANSVERSE },
+        { "rot90",      JPEG_TRANSFORM_ROT_90 },
+        { "rot180",     JPEG_TRANSFORM_ROT_180 },
+        { "rot270",     JPEG_TRANSFORM_ROT_270 },
+    };
+
+    for (int i = 0; i < (sizeof(ops) / sizeof(ops[0])); i++) {
+        if (!strcmp(name, ops[i].name)) {
+            *op = ops[i].op;
+            return 0;
         }
     }
+    return -1;
+}
+
+static int parse_rdo_mode(const char* name, jpeg_rdo_mode_t* mode)
+{
+    static const struct {
+        const char* name;
+        jpeg_rdo_mode_t mode;
+    } modes[] = {
+        { "off",     JPEG_RDO_OFF },
+        { "greedy",  JPEG_RDO_GREEDY },
+        { "trellis", JPEG_RDO_TRELLIS },
+    };
+
+    for (int i = 0; i < (sizeof(modes) / sizeof(modes[0])); i++) {
+        if (!strcmp(name, modes[i].name)) {
+            *mode = modes[i].mode;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parses a crop rectangle given as WxH+X+Y, or WxH for one in the top left corner.
+ */
+static int parse_crop(const char* geometry, jpeg_transform_t* transform)
+{
+    int end = 0;
+    unsigned int w, h, x = 0, y = 0;
+    if (sscanf(geometry, "%ux%u%n", &w, &h, &end) != 2) {
+        return -1;
+    }
+    if (geometry[end] != '\0') {
+        const char* offset = geometry + end;
+        end = 0;
+        if ((sscanf(offset, "+%u+%u%n", &x, &y, &end) != 2) || (offset[end] != '\0')) {
+            return -1;
+        }
+    }
+    if ((w == 0) || (h == 0)) {
+        return -1;
+    }
 
-    print_block(unzigged);
-    free(unzigged);
+    transform->crop_width = w;
+    transform->crop_height = h;
+    transform->crop_x = x;
+    transform->crop_y = y;
+    return 0;
+}
+
+#define MAX_ROI_RECTS 64
+
+/**
+ * Parses a ROI rectangle given as WxH+X+Y:Q.
+ */
+static int parse_roi_rect(const char* spec, jpeg_roi_rect_t* rect)
+{
+    int end = 0;
+    unsigned int w, h, x, y, q;
+    if ((sscanf(spec, "%ux%u+%u+%u:%u%n", &w, &h, &x, &y, &q, &end) != 5) ||
+        (spec[end] != '\0') || (w == 0) || (h == 0) || (q < 1) || (q > 100)) {
+        return -1;
+    }
+
+    rect->width = w;
+    rect->height = h;
+    rect->x = x;
+    rect->y = y;
+    rect->quality = q;
+    return 0;
+}
+
+/**
+ * Parses a comma separated list of qualities into ladder. Returns the number of qualities, or -1
+ * if the list is malformed.
+ */
+static int parse_ladder(const char* list, int* ladder)
+{
+    int n = 0;
+    while (*list) {
+        char* end;
+        const long q = strtol(list, &end, 10);
+        if ((end == list) || (q < 1) || (q > 100) || (n == JPEG_LADDER_MAX_LEVELS) ||
+            ((*end != ',') && (*end != '\0'))) {
+            return -1;
+        }
+        ladder[n++] = q;
+        list = (*end == ',') ? (end + 1) : end;
+    }
+    return (n > 0) ? n : -1;
+}
+
+/**
+ * Writes each level of the ladder to output_path with "-q<quality>" inserted before its extension.
+ */
+static int write_ladder(const jpeg_requantizer_t* rq, const jpeg_image_t* jpeg,
+                        const huffman_decoded_jpeg_scan_t* decoded_scan, const int* ladder,
+                        int num_levels, const char* output_path)
+{
+    jpeg_roi_map_t* roi_maps[JPEG_LADDER_MAX_LEVELS];
+    jpeg_image_t* outputs[JPEG_LADDER_MAX_LEVELS];
+    for (int l = 0; l < num_levels; l++) {
+        roi_maps[l] = jpeg_roi_map_create_uniform(jpeg, ladder[l]);
+    }
+
+    int retval = jpeg_requantize_ladder(rq, jpeg, decoded_scan,
+                                        (const jpeg_roi_map_t* const*)roi_maps, num_levels, true,
+                                        outputs);
+    if (retval) {
+        printf("error during huffman recompression\n");
+    }
+
+    const char* ext = strrchr(output_path, '.');
+    const int stem_len = (ext != NULL) ? (ext - output_path) : strlen(output_path);
+    for (int l = 0; l < num_levels; l++) {
+        if (outputs[l] != NULL) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%.*s-q%i%s", stem_len, output_path, ladder[l],
+                     (ext != NULL) ? ext : "");
+            if (jpeg_image_store_to_file(path, outputs[l])) {
+                printf("error writing %s\n", path);
+                retval = -1;
+            }
+            jpeg_image_destroy(outputs[l]);
+        }
+        jpeg_roi_map_destroy(roi_maps[l]);
+    }
+
+    return retval;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options] in.jpg\n"
+            "    -q, --quality=Q       requantize the whole image to quality Q, 1-100 (default 50)\n"
+            "    -s, --target-size=N   instead of -q, pick the highest quality whose output is\n"
+            "                          estimated to fit in N bytes; huffman tables are optimized\n"
+            "    -b, --target-bpp=B    like -s, with a budget of B bits per pixel\n"
+            "    -a, --auto-roi=Q      raise blocks with edges or skin tones above -q, up to Q,\n"
+            "                          judging them from their coefficients; -s and -b scale\n"
+            "                          the whole map\n"
+            "    -r, --roi=WxH+X+Y:Q   raise the given rectangle of the output to quality Q; can\n"
+            "                          be given up to 64 times\n"
+            "    -z, --rdo=MODE        how hard to look for coefficients worth lowering or zeroing\n"
+            "                          when requantizing: off (default), greedy or trellis\n"
+            "    -Z, --rdo-lambda=L    bits-for-error tradeoff of -z; larger is smaller (default\n"
+            "                          0.025)\n"
+            "    -l, --ladder=Q1,Q2,.. write one output per quality from a single decode, named\n"
+            "                          after --output with -qQ before the extension\n"
+            "    -t, --transform=OP    losslessly apply OP, one of flip-h, flip-v, transpose,\n"
+            "                          transverse, rot90, rot180 or rot270 (clockwise)\n"
+            "    -c, --crop=WxH+X+Y    losslessly crop to the given rectangle before -t; the\n"
+            "                          corner is moved up and left to the nearest MCU boundary\n"
+            "    -d, --downscale=N     shrink the image by N, one of 2, 4 or 8, after -t, by\n"
+            "                          merging blocks' low frequency coefficients\n"
+            "    -u, --subsample-chroma\n"
+            "                          convert 4:4:4 or 4:2:2 input to 4:2:0, after -t, by\n"
+            "                          shrinking the chroma coefficients directly\n"
+            "    -O, --optimize        recode losslessly, leaving every coefficient as it is and\n"
+            "                          only making huffman tables for the image and dropping\n"
+            "                          unused tables; the input is kept if that doesn't make it\n"
+            "                          smaller. Goes with -t and -c, -q is ignored\n"
+            "    -o, --output=FILE     where to write the recoded jpeg (default out.jpg)\n"
+            "    -i, --info            only print what the input's headers say about it,\n"
+            "                          including an estimate of the quality it was saved at\n"
+            "    -P, --preview=FILE    only write a 1/8-scale preview of the input, decoded from\n"
+            "                          the DC coefficients alone, to FILE as a PGM or PPM\n"
+            "    -p, --print=N         print the first N MCUs of the recoded image\n"
+            "    -C, --cache-dir=DIR   keep decoded coefficients in DIR, keyed by the input's\n"
+            "                          contents, and reuse them when the same image comes back\n"
+            "    -m, --cache-size=MB   evict least recently used cache entries past MB megabytes\n"
+            "                          (default 1024)\n"
+            "    -j, --stats-json      print per-image counters and stage timings as a JSON line\n"
+            "    -v, --verify[=N]      re-decode the output and check it coefficient for coefficient\n"
+            "                          against what was encoded; with N, only 1 in N images is checked\n",
+            argv0);
 }
 
 int main(int argc, char** argv)
@@ -101,67 +439,449 @@ int main(int argc, char** argv)
     bit_packer_destroy(bp);
 #endif
 
-    if (argc != 2) {
-        printf("needs an arg\n");
-        return -1;
+    static const struct option long_options[] = {
+        { "quality",     required_argument, NULL, 'q' },
+        { "target-size", required_argument, NULL, 's' },
+        { "target-bpp",  required_argument, NULL, 'b' },
+        { "output",      required_argument, NULL, 'o' },
+        { "print",       required_argument, NULL, 'p' },
+        { "preview",     required_argument, NULL, 'P' },
+        { "info",        no_argument,       NULL, 'i' },
+        { "stats-json",  no_argument,       NULL, 'j' },
+        { "verify",      optional_argument, NULL, 'v' },
+        { "ladder",      required_argument, NULL, 'l' },
+        { "auto-roi",    required_argument, NULL, 'a' },
+        { "roi",         required_argument, NULL, 'r' },
+        { "cache-dir",   required_argument, NULL, 'C' },
+        { "cache-size",  required_argument, NULL, 'm' },
+        { "transform",   required_argument, NULL, 't' },
+        { "crop",        required_argument, NULL, 'c' },
+        { "downscale",   required_argument, NULL, 'd' },
+        { "subsample-chroma", no_argument,  NULL, 'u' },
+        { "rdo",         required_argument, NULL, 'z' },
+        { "rdo-lambda",  required_argument, NULL, 'Z' },
+        { "optimize",    no_argument,       NULL, 'O' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int quality = 50;
+    uint64_t target_bytes = 0;
+    double target_bpp = 0.0;
+    const char* output_path = "out.jpg";
+    int mcus_to_print = 0;
+    const char* preview_path = NULL;
+    bool info = false;
+    bool stats_json = false;
+    int verify_one_in = 0;
+    int ladder[JPEG_LADDER_MAX_LEVELS];
+    int num_ladder_levels = 0;
+    int auto_roi_quality = 0;
+    jpeg_roi_rect_t roi_rects[MAX_ROI_RECTS];
+    int num_roi_rects = 0;
+    const char* cache_dir = NULL;
+    uint64_t cache_megabytes = 1024;
+    jpeg_transform_t transform = { 0 };
+    bool cropping = false;
+    jpeg_resample_t resample = { 0 };
+    jpeg_rdo_params_t rdo = { .num_threads = sysconf(_SC_NPROCESSORS_ONLN) };
+    bool lossless = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "q:s:b:o:p:P:ijv::l:a:r:C:m:t:c:d:uz:Z:O", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'q': quality = atoi(optarg); break;
+            case 's': target_bytes = strtoull(optarg, NULL, 10); break;
+            case 'b': target_bpp = atof(optarg); break;
+            case 'o': output_path = optarg; break;
+            case 'p': mcus_to_print = atoi(optarg); break;
+            case 'P': preview_path = optarg; break;
+            case 'i': info = true; break;
+            case 'j': stats_json = true; break;
+            case 'v': verify_one_in = (optarg != NULL) ? atoi(optarg) : 1; break;
+            case 'a': auto_roi_quality = atoi(optarg); break;
+            case 'r':
+                if ((num_roi_rects == MAX_ROI_RECTS) ||
+                    parse_roi_rect(optarg, &roi_rects[num_roi_rects])) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                num_roi_rects++;
+                break;
+            case 'C': cache_dir = optarg; break;
+            case 'u': resample.subsample_chroma = true; break;
+            case 'O': lossless = true; break;
+            case 'd':
+                resample.scale_denom = atoi(optarg);
+                if ((resample.scale_denom != 2) && (resample.scale_denom != 4) &&
+                    (resample.scale_denom != 8)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'm': cache_megabytes = strtoull(optarg, NULL, 10); break;
+            case 'Z': rdo.lambda = atof(optarg); break;
+            case 'z':
+                if (parse_rdo_mode(optarg, &rdo.mode)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 't':
+                if (parse_transform_op(optarg, &transform.op)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'c':
+                if (parse_crop(optarg, &transform)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                cropping = true;
+                break;
+            case 'l':
+                num_ladder_levels = parse_ladder(optarg, ladder);
+                if (num_ladder_levels < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
     }
 
-    jpeg_image_t* jpeg = jpeg_image_load_from_file(argv[1]);
-    if (jpeg == NULL) {
-        printf("error reading jpeg\n");
+    if ((optind != (argc - 1)) || (quality < 1) || (quality > 100) || (verify_one_in < 0) ||
+        (target_bpp < 0.0) || (auto_roi_quality < 0) || (auto_roi_quality > 100) ||
+        (rdo.lambda < 0.0f) ||
+        ((num_ladder_levels > 0) && ((auto_roi_quality > 0) || (num_roi_rects > 0) ||
+                                     (rdo.mode != JPEG_RDO_OFF))) ||
+        ((num_ladder_levels > 0) && ((target_bytes > 0) || (target_bpp > 0.0) ||
+                                     (mcus_to_print > 0) || (verify_one_in > 0))) ||
+        (lossless && ((num_ladder_levels > 0) || (target_bytes > 0) || (target_bpp > 0.0) ||
+                      (auto_roi_quality > 0) || (num_roi_rects > 0) ||
+                      (rdo.mode != JPEG_RDO_OFF) || resample.subsample_chroma ||
+                      (resample.scale_denom > 1)))) {
+        usage(argv[0]);
         return -1;
     }
+    const char* input_path = argv[optind];
 
-    huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg = jpeg_image_huffman_decode(jpeg);
-    if (huffman_decoded_jpeg == NULL) {
-        printf("error during huffman decoding\n");
-        return -1;
+    if (info) {
+        return print_info(input_path);
+    }
+
+    jpeg_stats_t stats = { 0 };
+    if (stats_json) {
+        jpeg_stats_attach(&stats);
+    }
+
+    if (preview_path != NULL) {
+        return write_preview(input_path, preview_path, stats_json ? &stats : NULL);
+    }
+
+    // requantizing to a quality at or above the source's changes nothing, in which case the
+    // input is copied through untouched, without being decoded or recoded.
+    const bool transforming = cropping || (transform.op != JPEG_TRANSFORM_NONE);
+    const bool resampling = resample.subsample_chroma || (resample.scale_denom > 1);
+    const bool fixed_quality = ((num_ladder_levels == 0) && (target_bytes == 0) &&
+                                (target_bpp == 0.0));
+    if (fixed_quality && !lossless && !transforming && !resampling && (mcus_to_print == 0) &&
+        requantizing_changes_nothing(input_path, quality)) {
+        int retval = copy_file(input_path, output_path);
+        if (retval) {
+            printf("error writing %s\n", output_path);
+        }
+
+        jpeg_stats_attach(NULL);
+        if (stats_json) {
+            jpeg_stats_print_json(stdout, input_path, &stats);
+        }
+        return retval;
     }
 
-    // FUTZ ABOUT
-    for (int i = 0; i < 5700; i++) {
-        for (int j = 4; j < 63; j++) {
-            huffman_decoded_jpeg->components[0].blocks[i].ac_values[j] = 0;
-            huffman_decoded_jpeg->components[1].blocks[i/2].ac_values[j] = 0;
-            huffman_decoded_jpeg->components[2].blocks[i/2].ac_values[j] = 0;
+    jpeg_image_t* jpeg = NULL;
+    huffman_decoded_jpeg_scan_t* huffman_decoded_jpeg = NULL;
+    if (cache_dir != NULL) {
+        jpeg_cache_t* cache = jpeg_cache_open(cache_dir, cache_megabytes << 20);
+        if (cache == NULL) {
+            printf("error opening cache %s\n", cache_dir);
+            return -1;
+        }
+        const int cache_result = jpeg_cache_load_file(cache, input_path, &jpeg,
+                                                      &huffman_decoded_jpeg);
+        jpeg_cache_close(cache);
+        if (cache_result) {
+            printf("error reading jpeg\n");
+            return -1;
+        }
+    } else {
+        jpeg = jpeg_image_load_from_file(input_path);
+        if (jpeg == NULL) {
+            printf("error reading jpeg\n");
+            return -1;
+        }
+
+        huffman_decoded_jpeg = jpeg_image_huffman_decode(jpeg);
+        if (huffman_decoded_jpeg == NULL) {
+            printf("error during huffman decoding\n");
+            return -1;
         }
     }
 
+    // arithmetic coded input is written back out huffman coded. It gets tables made for its own
+    // coefficients up front, so that the rate-distortion optimized quantizer has code lengths to
+    // go by, and optimal ones again once it's been requantized.
+    const bool arithmetic_coded = jpeg_image_is_arithmetic_coded(jpeg);
+    jpeg_image_arithmetic_to_huffman(jpeg, huffman_decoded_jpeg);
 
-    jpeg_image_t* recompress = jpeg_image_huffman_recode_with_tables(huffman_decoded_jpeg, jpeg);
-    huffman_decoded_jpeg_scan_t* redecompress = jpeg_image_huffman_decode(recompress);
+    // with a fixed quality, blocks are requantized as they're moved by the last of the transform
+    // and resampling steps; the other modes search or fan out over the transformed scan, so they
+    // requantize it afterwards, as does the rate-distortion optimized quantizer.
+    const bool fused_requantize = fixed_quality && !lossless && (auto_roi_quality == 0) &&
+                                  (num_roi_rects == 0) && (rdo.mode == JPEG_RDO_OFF);
+    jpeg_requantizer_t* rq = NULL;
+    jpeg_roi_map_t* roi_map = NULL;
+    if (transforming) {
+        jpeg_image_t* transformed = jpeg_transform_image(jpeg, &transform);
+        if (transformed == NULL) {
+            printf("error: the crop rectangle leaves nothing of the image\n");
+            return -1;
+        }
+        if (fused_requantize && !resampling) {
+            rq = jpeg_requantizer_create(transformed);
+            if (rq == NULL) {
+                printf("error creating requantizer\n");
+                return -1;
+            }
+            roi_map = jpeg_roi_map_create_uniform(transformed, quality);
+        }
+
+        huffman_decoded_jpeg_scan_t* transformed_scan =
+            jpeg_transform_scan(jpeg, huffman_decoded_jpeg, &transform, transformed, rq, roi_map);
+        if (transformed_scan == NULL) {
+            printf("error transforming jpeg\n");
+            return -1;
+        }
 
-    if (redecompress == NULL) {
-        printf("error during huffman redcompression\n");
+        jpeg_image_destroy(jpeg);
+        huffman_decoded_jpeg_scan_destroy(huffman_decoded_jpeg);
+        jpeg = transformed;
+        huffman_decoded_jpeg = transformed_scan;
+    }
+    if (resampling) {
+        jpeg_image_t* resampled = jpeg_resample_image(jpeg, &resample);
+        if (resampled == NULL) {
+            printf("error: can't resample an image with these sampling factors\n");
+            return -1;
+        }
+        if (fused_requantize) {
+            rq = jpeg_requantizer_create(resampled);
+            if (rq == NULL) {
+                printf("error creating requantizer\n");
+                return -1;
+            }
+            roi_map = jpeg_roi_map_create_uniform(resampled, quality);
+        }
+
+        huffman_decoded_jpeg_scan_t* resampled_scan =
+            jpeg_resample_scan(jpeg, huffman_decoded_jpeg, &resample, resampled, rq, roi_map);
+        if (resampled_scan == NULL) {
+            printf("error resampling jpeg\n");
+            return -1;
+        }
+
+        jpeg_image_destroy(jpeg);
+        huffman_decoded_jpeg_scan_destroy(huffman_decoded_jpeg);
+        jpeg = resampled;
+        huffman_decoded_jpeg = resampled_scan;
+    }
+
+    if ((rq == NULL) && !lossless) {
+        rq = jpeg_requantizer_create(jpeg);
+        if (rq == NULL) {
+            printf("error creating requantizer\n");
+            return -1;
+        }
+    }
+    if (num_ladder_levels > 0) {
+        int retval = write_ladder(rq, jpeg, huffman_decoded_jpeg, ladder, num_ladder_levels,
+                                  output_path);
+
+        jpeg_stats_attach(NULL);
+        if (stats_json) {
+            jpeg_stats_print_json(stdout, input_path, &stats);
+        }
+        jpeg_requantizer_destroy(rq);
+        jpeg_image_destroy(jpeg);
+        huffman_decoded_jpeg_scan_destroy(huffman_decoded_jpeg);
+        return retval;
+    }
+    if (target_bpp > 0.0) {
+        target_bytes = (target_bpp * jpeg->frame_header.samples_per_line *
+                        jpeg->frame_header.number_of_lines) / 8;
+    }
+    // a ROI map worked out from the image or given on the command line takes the place of a
+    // uniform quality.
+    jpeg_roi_map_t* base_roi_map = NULL;
+    if (auto_roi_quality > 0) {
+        const jpeg_roi_params_t params = {
+            .min_quality = quality,
+            .max_quality = (auto_roi_quality > quality) ? auto_roi_quality : quality,
+            .skin_tone = true,
+            .skin_quality = (auto_roi_quality > quality) ? auto_roi_quality : quality,
+        };
+        base_roi_map = jpeg_roi_map_create_auto(jpeg, huffman_decoded_jpeg, &params);
+        if (base_roi_map == NULL) {
+            printf("error building ROI map\n");
+            return -1;
+        }
+    }
+    if (num_roi_rects > 0) {
+        jpeg_roi_map_t* rect_map = jpeg_roi_map_create_from_shapes(jpeg, quality, roi_rects,
+                                                                   num_roi_rects, NULL, 0);
+        if (base_roi_map == NULL) {
+            base_roi_map = rect_map;
+        } else {
+            for (uint32_t i = 0; i < rect_map->blocks_wide * rect_map->blocks_high; i++) {
+                if (rect_map->quality[i] > base_roi_map->quality[i]) {
+                    base_roi_map->quality[i] = rect_map->quality[i];
+                }
+            }
+            jpeg_roi_map_destroy(rect_map);
+        }
+    }
+
+    const bool fit_size = (target_bytes > 0);
+    if (fit_size) {
+        uint64_t estimated_bytes;
+        quality = jpeg_requantizer_fit_size(rq, jpeg, base_roi_map, huffman_decoded_jpeg,
+                                            target_bytes, true, &estimated_bytes);
+        fprintf(stderr, "%s: quality %i, estimated %llu bytes for a budget of %llu\n", input_path,
+                quality, (unsigned long long)estimated_bytes, (unsigned long long)target_bytes);
+    }
+
+    if (lossless) {
+        // the coefficients are recoded exactly as they were decoded; only the tables change.
+        jpeg_image_strip_unused_tables(jpeg);
+    } else if (roi_map == NULL) {
+        if (base_roi_map == NULL) {
+            roi_map = jpeg_roi_map_create_uniform(jpeg, quality);
+        } else if (fit_size) {
+            // the search picked a scale for the whole map rather than a quality.
+            roi_map = jpeg_roi_map_create_scaled(jpeg, base_roi_map, quality);
+        } else {
+            roi_map = base_roi_map;
+            base_roi_map = NULL;
+        }
+        jpeg_requantize_decoded_scan_rdo(rq, jpeg, roi_map, &rdo, huffman_decoded_jpeg);
+    }
+    if (base_roi_map != NULL) {
+        jpeg_roi_map_destroy(base_roi_map);
+    }
+    // requantized, transformed or resampled coefficients can need symbols that the source's
+    // tables, if they were optimized for it, have no codes for. Transforms always get tables of
+    // their own, since moving coefficients around changes which symbols are common.
+    if (fit_size || transforming || resampling || arithmetic_coded || lossless ||
+        !jpeg_image_huffman_tables_can_code(jpeg, huffman_decoded_jpeg)) {
+        jpeg_image_optimize_huffman_tables(jpeg, huffman_decoded_jpeg);
+    }
+
+    jpeg_image_t* recompress = jpeg_image_huffman_recode_with_tables(huffman_decoded_jpeg, jpeg);
+    if (recompress == NULL) {
+        printf("error during huffman recompression\n");
         return -1;
     }
 
-    // print
-    for (int MCU = 0; MCU < 10; MCU++) {
-        for (int component = 0; component < 3; component++) {
-            const int MCUs_per_line   = ((jpeg->frame_header.csps[component].horizontal_sampling_factor *
-                                          jpeg->frame_header.samples_per_line) /
-                                         redecompress->H_max);
-
-            const int MCU_x = MCU % MCUs_per_line;
-            const int MCU_y = MCU / MCUs_per_line;
-            const int blocks_per_mcu =
-                (jpeg->frame_header.csps[component].horizontal_sampling_factor *
-                 jpeg->frame_header.csps[component].vertical_sampling_factor);
-            const int block_idx = blocks_per_mcu * MCU;
-            for (int block = 0; block < blocks_per_mcu; block++) {
-                printf("Component = %i, MCU = [%i,%i]\n", component, MCU_x, MCU_y);
-                print_block_unzigged(&redecompress->components[component].blocks[block_idx + block]);
+    // sampled verification; the re-decode it costs is what we're trying not to pay on every image.
+    bool verify = false;
+    if (verify_one_in > 0) {
+        srand(time(NULL) ^ getpid());
+        verify = ((rand() % verify_one_in) == 0);
+    }
+
+    int retval = 0;
+    if ((mcus_to_print > 0) || verify) {
+        // re-decoding is only needed for printing and verification, so keep it out of the stats.
+        jpeg_stats_attach(NULL);
+        huffman_decoded_jpeg_scan_t* redecompress = jpeg_image_huffman_decode(recompress);
+        if (stats_json) {
+            jpeg_stats_attach(&stats);
+        }
+
+        if (redecompress == NULL) {
+            printf("error during huffman redcompression\n");
+            return -1;
+        }
+
+        huffman_decoded_jpeg_scan_mismatch_t mismatch;
+        if (verify &&
+            huffman_decoded_jpeg_scan_compare(huffman_decoded_jpeg, redecompress,
+                                              jpeg->frame_header.num_components, &mismatch)) {
+            fprintf(stderr, "%s: verification failed at component %i, block %u, coefficient %i: "
+                    "expected %i, got %i\n", input_path, mismatch.component, mismatch.block,
+                    mismatch.coefficient, mismatch.expected, mismatch.actual);
+            retval = -1;
+        }
+
+        // print
+        const jpeg_mcu_map_t* map = redecompress->mcu_map;
+        for (int MCU = 0; (MCU < mcus_to_print) && (MCU < map->num_mcus); MCU++) {
+            const int MCU_x = MCU % map->mcus_per_line;
+            const int MCU_y = MCU / map->mcus_per_line;
+            for (int block = 0; block < map->blocks_per_mcu; block++) {
+                const int component = map->block_component[block];
+                const uint32_t block_idx = map->block_index[(MCU * map->blocks_per_mcu) + block];
+                printf("Component = %i, MCU = [%i,%i], block = %u\n", component, MCU_x, MCU_y,
+                       block_idx);
+                print_block_unzigged(&redecompress->components[component].blocks[block_idx]);
                 printf("\n\n");
             }
         }
+
+        huffman_decoded_jpeg_scan_destroy(redecompress);
+    }
+
+    // an input that was already coded as tightly as this can't do better than its own bytes,
+    // so they're kept. Sizing the output is kept out of the stats, like the re-decode.
+    bool keep_input = false;
+    if ((retval == 0) && lossless && !transforming && !arithmetic_coded) {
+        jpeg_stats_attach(NULL);
+        const long long output_bytes = stored_size(recompress);
+        keep_input = (output_bytes < 0) || (output_bytes >= file_size(input_path));
+        if (stats_json) {
+            jpeg_stats_attach(&stats);
+        }
+    }
+
+    if ((retval == 0) && keep_input) {
+        if (!same_file(input_path, output_path)) {
+            retval = copy_file(input_path, output_path);
+        }
+        if (retval) {
+            printf("error writing %s\n", output_path);
+        }
+    } else if (retval == 0) {
+        retval = jpeg_image_store_to_file(output_path, recompress);
+        if (retval) {
+            printf("error writing %s\n", output_path);
+        }
     }
 
-    jpeg_image_store_to_file("out.jpg", recompress);
+    jpeg_stats_attach(NULL);
+    if (stats_json) {
+        jpeg_stats_print_json(stdout, input_path, &stats);
+    }
 
     // clean up
+    if (roi_map != NULL) {
+        jpeg_roi_map_destroy(roi_map);
+    }
+    jpeg_requantizer_destroy(rq);
+    jpeg_image_destroy(recompress);
     jpeg_image_destroy(jpeg);
     huffman_decoded_jpeg_scan_destroy(huffman_decoded_jpeg);
 
-    return 0;
+    return retval;
 }
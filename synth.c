@@ -0,0 +1,90 @@
+/**
+ * Command line front end for jpeg_synth; writes one synthetic jpeg.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpeg.h"
+#include "jpeg_synth.h"
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options] out.jpg\n"
+            "    -W width          image width in pixels (default 1024)\n"
+            "    -H height         image height in pixels (default 1024)\n"
+            "    -c components     1 for grayscale, 3 for YCbCr (default 3)\n"
+            "    -s 444|422|420    chroma subsampling (default 420)\n"
+            "    -q quality        quantization table quality, 1-100 (default 75)\n"
+            "    -z sparsity       fraction of zero AC coefficients, 0-1 (default 0.85)\n"
+            "    -r interval       MCUs per restart interval, 0 for none (default 0)\n"
+            "    -t annexk|optimal huffman tables (default annexk)\n"
+            "    -S seed           PRNG seed (default 1)\n",
+            argv0);
+}
+
+int main(int argc, char** argv)
+{
+    jpeg_synth_options_t opts;
+    jpeg_synth_options_init(&opts);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "W:H:c:s:q:z:r:t:S:")) != -1) {
+        switch (opt) {
+            case 'W': opts.width = atoi(optarg); break;
+            case 'H': opts.height = atoi(optarg); break;
+            case 'c': opts.num_components = atoi(optarg); break;
+            case 'q': opts.quality = atoi(optarg); break;
+            case 'z': opts.sparsity = atof(optarg); break;
+            case 'r': opts.restart_interval = atoi(optarg); break;
+            case 'S': opts.seed = strtoull(optarg, NULL, 0); break;
+            case 's':
+                if (!strcmp(optarg, "444")) {
+                    opts.subsampling = JPEG_SYNTH_444;
+                } else if (!strcmp(optarg, "422")) {
+                    opts.subsampling = JPEG_SYNTH_422;
+                } else if (!strcmp(optarg, "420")) {
+                    opts.subsampling = JPEG_SYNTH_420;
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 't':
+                if (!strcmp(optarg, "annexk")) {
+                    opts.huffman_tables = JPEG_SYNTH_HUFFMAN_ANNEX_K;
+                } else if (!strcmp(optarg, "optimal")) {
+                    opts.huffman_tables = JPEG_SYNTH_HUFFMAN_OPTIMAL;
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind != (argc - 1)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    jpeg_image_t* jpeg = jpeg_synth_create(&opts);
+    if (jpeg == NULL) {
+        fprintf(stderr, "invalid options\n");
+        return -1;
+    }
+
+    int retval = jpeg_image_store_to_file(argv[optind], jpeg);
+    if (retval) {
+        fprintf(stderr, "error writing %s\n", argv[optind]);
+    }
+
+    jpeg_image_destroy(jpeg);
+    return retval;
+}